@@ -0,0 +1,364 @@
+// ***************************************************************************************
+//    Project: Easy Cross-Platform File Mapping with a Single-Header C Library
+//    File: bench.c
+//    Date: 2024-08-09
+//    Author : Navid Dezashibi
+//    Contact: navid@dezashibi.com
+//    Website: https://www.dezashibi.com | https://github.com/dezashibi
+//    License:
+//     Please refer to the LICENSE file, repository or website for more information about
+//     the licensing of this work. If you have any questions or concerns,
+//     please feel free to contact me at the email address provided above.
+// ***************************************************************************************
+// *  Description: Compares the scanning backends of the library on one file.
+// *
+// *      gcc -O2 -DDMMAP_USE_IO_URING bench.c -o bench -pthread
+// *      ./bench [file] [rounds] [--cold]
+// *
+// *      Every scenario counts the lines of the file. `--cold` evicts the file from
+// *      the page cache before each round (POSIX only). The parallel scan also
+// *      reports the throughput of each of its workers. On Linux, page faults, dTLB
+// *      and LLC misses, cycles and instructions of every scenario are counted with
+// *      perf_event_open and reported per GiB processed; counters the kernel or the
+// *      machine does not allow (see perf_event_paranoid) show as "n/a".
+// ***************************************************************************************
+
+// Strict C modes hide posix_fadvise and the other POSIX extensions used here
+#ifndef _WIN32
+#define _GNU_SOURCE
+#endif
+
+#define DMMAP_IMPL
+
+#include "dmmap.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#endif
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#define BENCH_COUNTERS 5
+#define BENCH_MAX_SCENARIOS 8
+
+static const char* counter_names[BENCH_COUNTERS] = {"faults", "dTLB-miss", "LLC-miss", "cycles", "instr"};
+
+// Counters of one scenario, summed over its rounds and all the threads it started
+typedef struct BenchCounters
+{
+    int fd[BENCH_COUNTERS];
+    uint64_t value[BENCH_COUNTERS];
+    int valid[BENCH_COUNTERS];
+} BenchCounters;
+
+typedef struct BenchScenario
+{
+    const char* name;
+    DmmapReaderBackend backend;
+} BenchScenario;
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static void evict(const char* filename)
+{
+#ifndef _WIN32
+    int fd = open(filename, O_RDONLY);
+    if (fd != -1)
+    {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+#else
+    (void)filename;
+#endif
+}
+
+#ifdef __linux__
+static int open_counter(uint32_t type, uint64_t config)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.inherit = 1; // Also count the threads of the backends
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+    int fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (fd == -1)
+    {
+        // Unprivileged processes may only count user space
+        attr.exclude_kernel = 1;
+        fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+    return fd;
+}
+#endif
+
+static void counters_open(BenchCounters* counters)
+{
+    memset(counters, 0, sizeof(*counters));
+    for (int i = 0; i < BENCH_COUNTERS; ++i)
+        counters->fd[i] = -1;
+
+#ifdef __linux__
+    counters->fd[0] = open_counter(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS);
+    counters->fd[1] = open_counter(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                                           (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+    counters->fd[2] = open_counter(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                                           (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+    counters->fd[3] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+    counters->fd[4] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+#endif
+}
+
+static void counters_enable(BenchCounters* counters, int enable)
+{
+#ifdef __linux__
+    for (int i = 0; i < BENCH_COUNTERS; ++i)
+    {
+        if (counters->fd[i] != -1)
+            ioctl(counters->fd[i], enable ? PERF_EVENT_IOC_ENABLE : PERF_EVENT_IOC_DISABLE, 0);
+    }
+#else
+    (void)counters;
+    (void)enable;
+#endif
+}
+
+// Reads the totals and closes the counters. With more events than hardware counters the
+// kernel multiplexes them, each value is scaled up from the time its event was on the PMU.
+static void counters_close(BenchCounters* counters)
+{
+#ifdef __linux__
+    for (int i = 0; i < BENCH_COUNTERS; ++i)
+    {
+        if (counters->fd[i] == -1)
+            continue;
+
+        uint64_t data[3]; // value, time enabled, time running
+        if (read(counters->fd[i], data, sizeof(data)) == sizeof(data) && data[2] > 0)
+        {
+            counters->value[i] = data[1] == data[2] ? data[0] : (uint64_t)((double)data[0] * data[1] / data[2]);
+            counters->valid[i] = 1;
+        }
+        close(counters->fd[i]);
+        counters->fd[i] = -1;
+    }
+#else
+    (void)counters;
+#endif
+}
+
+static uint64_t count_lines(const char* data, size_t size)
+{
+    uint64_t lines = 0;
+    const char* end = data + size;
+    while ((data = (const char*)memchr(data, '\n', (size_t)(end - data))) != NULL)
+    {
+        ++lines;
+        ++data;
+    }
+    return lines;
+}
+
+// Scans the whole file once, returns the number of lines or -1 on failure
+static int64_t scan(const char* filename, DmmapReaderBackend backend)
+{
+    DmmapReaderOptions options;
+    memset(&options, 0, sizeof(options));
+    options.backend = backend;
+    DmmapReader reader;
+    if (!dmmap_reader_open(&reader, filename, &options))
+        return -1;
+
+    DmmapChunk chunk;
+    uint64_t lines = 0;
+    int ret;
+    while ((ret = dmmap_reader_next(&reader, &chunk)) == 1)
+        lines += count_lines((const char*)chunk.data, chunk.size);
+
+    dmmap_reader_close(&reader);
+    return ret < 0 ? -1 : (int64_t)lines;
+}
+
+static void count_range(void* user_data, unsigned worker, const void* data, size_t offset, size_t size)
+{
+    (void)offset;
+    ((uint64_t*)user_data)[worker] = count_lines((const char*)data, size);
+}
+
+// Scans the whole file with one worker per physical core, returns the number of lines or -1 on failure
+static int64_t scan_parallel(const char* filename, DmmapScanWorkerStats* stats, unsigned* workers)
+{
+    DmmapFile file = dmmap_file_open(filename, 1);
+    if (!file.data)
+        return -1;
+
+    static uint64_t lines[DMMAP_SCAN_MAX_THREADS];
+    *workers = dmmap_scan(&file, NULL, count_range, lines, stats);
+    dmmap_file_close(&file);
+
+    int64_t total = 0;
+    for (unsigned t = 0; t < *workers; ++t)
+        total += (int64_t)lines[t];
+    return *workers ? total : -1;
+}
+
+int main(int argc, char** argv)
+{
+    const char* filename = "bench_text.txt";
+    int rounds = 5;
+    int cold = 0;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--cold") == 0)
+            cold = 1;
+        else if (atoi(argv[i]) > 0)
+            rounds = atoi(argv[i]);
+        else
+            filename = argv[i];
+    }
+
+    BenchScenario scenarios[] = {
+        {"mmap", DMMAP_READER_MMAP},
+#if defined(__linux__) && defined(DMMAP_USE_IO_URING)
+        {"io_uring", DMMAP_READER_URING},
+#else
+        {"read", DMMAP_READER_URING},
+#endif
+        {"direct", DMMAP_READER_DIRECT},
+    };
+
+    DmmapFile file = dmmap_file_open(filename, 1);
+    if (!file.data)
+    {
+        printf("Failed to map file\n");
+        return 1;
+    }
+    double megabytes = (double)file.size / (1024.0 * 1024.0);
+    dmmap_file_close(&file);
+
+    printf("%s: %.1f MiB, %d rounds, %s cache\n", filename, megabytes, rounds, cold ? "cold" : "warm");
+    printf("%-10s %12s %12s %12s\n", "backend", "best (s)", "MiB/s", "lines");
+
+    const char* names[BENCH_MAX_SCENARIOS];
+    BenchCounters counters[BENCH_MAX_SCENARIOS];
+    int64_t processed[BENCH_MAX_SCENARIOS]; // Rounds completed, for the per GiB figures
+    size_t measured = 0;
+
+    for (size_t s = 0; s < sizeof(scenarios) / sizeof(scenarios[0]); ++s)
+    {
+        double best = 0;
+        int64_t lines = 0;
+        names[measured] = scenarios[s].name;
+        processed[measured] = 0;
+        counters_open(&counters[measured]);
+        for (int round = 0; round < rounds; ++round)
+        {
+            if (cold)
+                evict(filename);
+
+            counters_enable(&counters[measured], 1);
+            double start = now_seconds();
+            lines = scan(filename, scenarios[s].backend);
+            double elapsed = now_seconds() - start;
+            counters_enable(&counters[measured], 0);
+            if (lines < 0)
+                break;
+            ++processed[measured];
+            if (round == 0 || elapsed < best)
+                best = elapsed;
+        }
+        counters_close(&counters[measured++]);
+
+        if (lines < 0)
+            printf("%-10s %12s\n", scenarios[s].name, "failed");
+        else
+            printf("%-10s %12.4f %12.1f %12lld\n", scenarios[s].name, best, megabytes / best, (long long)lines);
+    }
+
+    // Per-worker throughput of the best parallel round shows how evenly the cores were loaded
+    DmmapScanWorkerStats stats[DMMAP_SCAN_MAX_THREADS], best_stats[DMMAP_SCAN_MAX_THREADS];
+    unsigned workers = 0;
+    double best = 0;
+    int64_t lines = 0;
+    names[measured] = "parallel";
+    processed[measured] = 0;
+    counters_open(&counters[measured]);
+    for (int round = 0; round < rounds; ++round)
+    {
+        if (cold)
+            evict(filename);
+
+        counters_enable(&counters[measured], 1);
+        double start = now_seconds();
+        lines = scan_parallel(filename, stats, &workers);
+        double elapsed = now_seconds() - start;
+        counters_enable(&counters[measured], 0);
+        if (lines < 0)
+            break;
+        ++processed[measured];
+        if (round == 0 || elapsed < best)
+        {
+            best = elapsed;
+            memcpy(best_stats, stats, workers * sizeof(stats[0]));
+        }
+    }
+
+    counters_close(&counters[measured++]);
+
+    if (lines < 0)
+        printf("%-10s %12s\n", "parallel", "failed");
+    else
+    {
+        printf("%-10s %12.4f %12.1f %12lld\n", "parallel", best, megabytes / best, (long long)lines);
+        for (unsigned t = 0; t < workers; ++t)
+        {
+            printf("  worker %-3u cpu %-4d %10.1f MiB %10.1f MiB/s\n", t, best_stats[t].cpu,
+                   (double)best_stats[t].bytes / (1024.0 * 1024.0), best_stats[t].bytes_per_second / (1024.0 * 1024.0));
+        }
+    }
+
+    // Counters per GiB processed, over all completed rounds
+    printf("\n%-10s", "per GiB");
+    for (int i = 0; i < BENCH_COUNTERS; ++i)
+        printf(" %12s", counter_names[i]);
+    printf(" %8s\n", "IPC");
+
+    for (size_t s = 0; s < measured; ++s)
+    {
+        double gigabytes = megabytes / 1024.0 * (double)processed[s];
+        printf("%-10s", names[s]);
+        for (int i = 0; i < BENCH_COUNTERS; ++i)
+        {
+            if (counters[s].valid[i] && gigabytes > 0)
+                printf(" %12.4g", (double)counters[s].value[i] / gigabytes);
+            else
+                printf(" %12s", "n/a");
+        }
+        if (counters[s].valid[3] && counters[s].valid[4] && counters[s].value[3])
+            printf(" %8.2f\n", (double)counters[s].value[4] / (double)counters[s].value[3]);
+        else
+            printf(" %8s\n", "n/a");
+    }
+
+    return 0;
+}
@@ -51,6 +51,11 @@
 // *         #define DMMAP_IMPL
 // *         #include "dmmap.h"
 // *
+// *         The header defines no feature macros, the file keeps the C mode it was
+// *         compiled with and the implementation builds in strict ones like `-std=c11`.
+// *         On POSIX systems link with `-pthread`, some functions run helper threads.
+// *         Define "DMMAP_USE_IO_URING" as well to let Linux builds use io_uring.
+// *
 // *      3. Use the `dmmap_file_open` function to map a file into memory. This function
 // *         returns a `DmmapFile` structure containing a pointer to the file’s contents
 // *         in memory and its size. Example:
@@ -89,6 +94,11 @@ extern "C"
 {
 #endif
 
+    /**
+     * Library bookkeeping of a mapping (budget, locks, statistics), opaque to callers.
+     */
+    typedef struct DmmapState DmmapState;
+
     /**
      * @struct DmmapFile
      * @brief A structure representing a memory-mapped file.
@@ -101,6 +111,10 @@ extern "C"
      * - `size`: The size of the memory-mapped file in bytes.
      * - `fd`: A file descriptor (on POSIX systems) or a file mapping handle
      *         (on Windows). The `uintptr_t` type ensures portability across platforms.
+     * - `backend`: Whether `data` is a mapping or a buffer, see `DmmapBackend`.
+     * - `offset`: The file offset `data` starts at, non-zero only for windows
+     *             opened with `dmmap_file_open_range`.
+     * - `state`: The registry entry the library keeps for a mapping, `NULL` for buffers.
      *
      * This structure is the main interface for interacting with the memory-mapped
      * file in the library, allowing direct access to the file contents as if they
@@ -108,11 +122,32 @@ extern "C"
      */
     typedef struct DmmapFile
     {
-        void* data;   /**< Pointer to the memory-mapped file contents */
-        size_t size;  /**< Size of the memory-mapped file in bytes */
-        uintptr_t fd; /**< File descriptor or file mapping handle */
+        void* data;        /**< Pointer to the memory-mapped file contents */
+        size_t size;       /**< Size of the memory-mapped file in bytes */
+        uintptr_t fd;      /**< File descriptor or file mapping handle */
+        int backend;       /**< How `data` is backed, one of `DmmapBackend` */
+        uint64_t offset;   /**< File offset of `data`, see `dmmap_file_open_range` and `dmmap_file_open_stdin` */
+        DmmapState* state; /**< Registry entry of a mapping, `NULL` for buffers */
     } DmmapFile;
 
+    /**
+     * @enum DmmapBackend
+     * @brief What backs the `data` of a `DmmapFile`.
+     *
+     * - `DMMAP_BACKEND_MMAP`: a mapping of the file, the default.
+     * - `DMMAP_BACKEND_BUFFER`: a copy of a small read-only file in a pooled buffer,
+     *   see `dmmap_set_small_file_threshold`. The file is closed and `fd` is 0.
+     * - `DMMAP_BACKEND_ANON`: the contents of a source that cannot be mapped (pipe, FIFO,
+     *   socket, terminal or a procfs file reporting size 0), read to its end into anonymous
+     *   memory. The source is closed and `fd` is 0.
+     */
+    typedef enum DmmapBackend
+    {
+        DMMAP_BACKEND_MMAP = 0,
+        DMMAP_BACKEND_BUFFER = 1,
+        DMMAP_BACKEND_ANON = 2
+    } DmmapBackend;
+
     /**
      * @brief Maps a file into memory, providing direct access to its contents.
      *
@@ -131,9 +166,72 @@ extern "C"
      * @note If the file cannot be opened or mapped, the `data` field in the returned
      *       `DmmapFile` structure will be `NULL`, and appropriate error handling should
      *       be performed.
+     *
+     * @note Sources that cannot be mapped (pipes, FIFOs, sockets, procfs files) are read
+     *       to their end into anonymous memory when `read_only` is set, see
+     *       `DMMAP_BACKEND_ANON`. Opening them read-write fails, and so does a source
+     *       that delivers no data. Endless sources such as `/dev/zero` are not detected.
      */
     DmmapFile dmmap_file_open(const char* filename, int read_only);
 
+    /**
+     * @brief Opens the standard input of the process read-only.
+     *
+     * A redirected regular file is mapped like `dmmap_file_open` would, from the current
+     * position of the standard input to the end of the file, `offset` then holds that
+     * position. Anything else (a pipe, a terminal) is read to its end, see
+     * `DMMAP_BACKEND_ANON`. The standard input itself stays open, the position of a
+     * redirected file is not moved.
+     *
+     * @return A `DmmapFile` to close with `dmmap_file_close`, `data` is `NULL` on failure.
+     */
+    DmmapFile dmmap_file_open_stdin(void);
+
+    /**
+     * @struct DmmapDeviceInfo
+     * @brief Size and alignment of a file or block device, see `dmmap_device_info`.
+     */
+    typedef struct DmmapDeviceInfo
+    {
+        uint64_t size;                 /**< Size in bytes */
+        uint32_t logical_sector_size;  /**< Alignment required for ranges, 1 for regular files */
+        uint32_t physical_sector_size; /**< Native sector size of the device, 1 for regular files */
+        int is_block_device;           /**< Non-zero for a raw block device or volume */
+    } DmmapDeviceInfo;
+
+    /**
+     * @brief Queries the size and sector sizes of a file or block device.
+     *
+     * `fstat` reports a size of 0 for block devices, their size comes from `BLKGETSIZE64`
+     * on Linux, `DKIOCGETBLOCKCOUNT` on macOS and `IOCTL_DISK_GET_LENGTH_INFO` on Windows.
+     *
+     * @param filename The path of the file or device, e.g. `/dev/nvme0n1p3`.
+     * @param info Receives the result.
+     * @return 1 on success, 0 on failure.
+     */
+    int dmmap_device_info(const char* filename, DmmapDeviceInfo* info);
+
+    /**
+     * @brief Maps a window of a file or block device.
+     *
+     * `data` points at `offset` even though the mapping itself starts at the page (the
+     * allocation granularity on Windows) below it, `dmmap_file_close` takes care of the
+     * difference. Block devices are mapped whole by `dmmap_file_open` as well.
+     *
+     * @param filename The path of the file or device.
+     * @param read_only Mapping mode, see `dmmap_file_open`.
+     * @param offset Start of the window. Must be a multiple of the logical sector size
+     *               for block devices.
+     * @param length Length of the window, 0 for everything after `offset`. Must be a
+     *               multiple of the logical sector size for block devices unless the
+     *               window ends at the end of the device.
+     * @return A `DmmapFile` covering the window, `data` is `NULL` on failure or when the
+     *         window is misaligned or does not fit.
+     *
+     * @note Windows cannot map volume handles, there this only works on files.
+     */
+    DmmapFile dmmap_file_open_range(const char* filename, int read_only, uint64_t offset, size_t length);
+
     /**
      * @brief Unmaps a file from memory and releases associated resources.
      *
@@ -148,110 +246,7643 @@ extern "C"
      */
     void dmmap_file_close(DmmapFile* file);
 
-#ifdef __cplusplus
-}
+    /**
+     * @brief Creates (or truncates) a file of the given size and maps it read-write.
+     *
+     * The new file is zero-filled. This is the building block used by the index
+     * builders below to write their output directly through a mapping.
+     *
+     * @param filename The path of the file to create.
+     * @param size The size of the new file in bytes, must be greater than zero.
+     * @return A `DmmapFile` mapped in read-write mode, `data` is `NULL` on failure.
+     */
+    DmmapFile dmmap_file_create(const char* filename, size_t size);
+
+    /**
+     * @brief Writes the modified pages of a read-write mapping back to the file and waits for it.
+     *
+     * Uses `msync(MS_SYNC)`, `FlushViewOfFile` on Windows. Mappings without a file behind
+     * them (small files read into a buffer, streamed sources) have nothing to flush.
+     *
+     * @return 1 on success, 0 on failure.
+     */
+    int dmmap_file_flush(DmmapFile* file);
+
+    // ***************************************************************************************
+    // *  Small files
+    // ***************************************************************************************
+
+/**
+ * Default size up to which `dmmap_file_open` reads read-only files into a buffer instead
+ * of mapping them. Below this size one `read` costs less than setting up and tearing down
+ * a mapping, see `dmmap_calibrate_small_file_threshold` to measure it on your system.
+ */
+#ifndef DMMAP_SMALL_FILE_THRESHOLD
+#define DMMAP_SMALL_FILE_THRESHOLD (64u * 1024u)
 #endif
 
-#ifdef DMMAP_IMPL
+/**
+ * Number of free buffers the pool keeps per size class for reuse.
+ */
+#ifndef DMMAP_BUFFER_POOL_DEPTH
+#define DMMAP_BUFFER_POOL_DEPTH 32
+#endif
 
-#ifdef _WIN32
-#include <windows.h>
+/**
+ * Initial capacity of the anonymous memory that unmappable sources are read into, it
+ * doubles whenever it fills up.
+ */
+#ifndef DMMAP_STREAM_INITIAL_SIZE
+#define DMMAP_STREAM_INITIAL_SIZE (64u * 1024u)
+#endif
 
-DmmapFile dmmap_file_open(const char* filename, int read_only)
-{
-    DmmapFile result = {0};
-    DWORD access = read_only ? GENERIC_READ : GENERIC_READ | GENERIC_WRITE;
-    DWORD protect = read_only ? PAGE_READONLY : PAGE_READWRITE;
-    DWORD map_access = read_only ? FILE_MAP_READ : FILE_MAP_WRITE;
+    /**
+     * @brief Overrides the size up to which read-only files are read into pooled buffers.
+     *
+     * Call it at startup, before files are opened from several threads.
+     *
+     * @param bytes The new threshold, 0 maps every file.
+     */
+    void dmmap_set_small_file_threshold(size_t bytes);
 
-    HANDLE file = CreateFileA(filename, access, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
-    if (file == INVALID_HANDLE_VALUE)
-        return result;
+    /**
+     * @brief Returns the size up to which read-only files are read into pooled buffers.
+     */
+    size_t dmmap_get_small_file_threshold(void);
 
-    DWORD fileSize = GetFileSize(file, NULL);
-    HANDLE map = CreateFileMapping(file, NULL, protect, 0, fileSize, NULL);
-    if (!map)
+    /**
+     * @brief Measures mapping against reading on this system and sets the threshold accordingly.
+     *
+     * Sizes from 4 KiB to 4 MiB (or the size of the probe) are opened both ways.
+     * The threshold becomes the largest size at which reading is still faster.
+     *
+     * @param probe_filename An existing file to measure with, preferably on the target file system.
+     * @return The new threshold, the previous one is kept if the probe cannot be opened.
+     */
+    size_t dmmap_calibrate_small_file_threshold(const char* probe_filename);
+
+    /**
+     * @brief Frees the buffers the small file pool keeps for reuse.
+     */
+    void dmmap_buffer_pool_clear(void);
+
+    // ***************************************************************************************
+    // *  Batch open
+    // ***************************************************************************************
+
+/**
+ * Number of threads the batch open uses when io_uring is not available.
+ */
+#ifndef DMMAP_OPEN_THREADS
+#define DMMAP_OPEN_THREADS 16
+#endif
+
+    /**
+     * @brief Called once for every file of a batch open, successful or not.
+     *
+     * Callbacks run on the library's worker threads and may run concurrently.
+     *
+     * @param user_data The pointer given to the batch open.
+     * @param index The index of the file in the batch.
+     * @param file The result, `file->data` is `NULL` if that file failed.
+     */
+    typedef void (*DmmapOpenCallback)(void* user_data, size_t index, DmmapFile* file);
+
+    /**
+     * @brief The future of an asynchronous batch open, see `dmmap_file_open_batch_async`.
+     */
+    typedef struct DmmapOpenBatch DmmapOpenBatch;
+
+    /**
+     * @brief Opens and maps many files at once.
+     *
+     * Every file is opened like `dmmap_file_open` would. On Linux, when compiled
+     * with `DMMAP_USE_IO_URING` and the kernel supports it, the `openat` calls of the
+     * whole batch are submitted through one io_uring, then the `statx` calls on the
+     * descriptors they returned. Otherwise a pool of `DMMAP_OPEN_THREADS` threads
+     * opens the files in parallel.
+     *
+     * @param filenames The paths of the files.
+     * @param count The number of files.
+     * @param read_only Mapping mode for all files, see `dmmap_file_open`.
+     * @param files Receives `count` results in the order of `filenames`.
+     * @param callback Optional per-file completion callback, may be `NULL`.
+     * @param user_data Passed to `callback`.
+     * @return The number of files that were mapped.
+     */
+    size_t dmmap_file_open_batch(const char* const* filenames, size_t count, int read_only, DmmapFile* files,
+                                 DmmapOpenCallback callback, void* user_data);
+
+    /**
+     * @brief Starts `dmmap_file_open_batch` in the background and returns at once.
+     *
+     * `filenames` and `files` must stay valid until `dmmap_file_open_batch_wait` returns.
+     *
+     * @return The future of the batch, or `NULL` if it could not be allocated.
+     */
+    DmmapOpenBatch* dmmap_file_open_batch_async(const char* const* filenames, size_t count, int read_only,
+                                                DmmapFile* files, DmmapOpenCallback callback, void* user_data);
+
+    /**
+     * @brief Tells whether an asynchronous batch open has completed, without blocking.
+     */
+    int dmmap_file_open_batch_ready(DmmapOpenBatch* batch);
+
+    /**
+     * @brief Waits for an asynchronous batch open and releases its future.
+     *
+     * @return The number of files that were mapped.
+     */
+    size_t dmmap_file_open_batch_wait(DmmapOpenBatch* batch);
+
+    // ***************************************************************************************
+    // *  Drop-behind
+    // ***************************************************************************************
+
+/**
+ * Least number of bytes `dmmap_drop_behind` lets pile up before it issues a drop, so that
+ * a scan does not make one system call per record.
+ */
+#ifndef DMMAP_DROP_BEHIND_BATCH
+#define DMMAP_DROP_BEHIND_BATCH (1u << 20)
+#endif
+
+    /**
+     * @enum DmmapDropMode
+     * @brief How `dmmap_drop` lets go of the pages of a range.
+     *
+     * - `DMMAP_DROP_NONE`: keep everything.
+     * - `DMMAP_DROP_DONTNEED`: unmap the pages (`MADV_DONTNEED`) and drop the clean ones
+     *   from the page cache (`POSIX_FADV_DONTNEED`). Use it for data nobody else reads.
+     * - `DMMAP_DROP_COLD`: only mark the pages as first candidates for reclaim
+     *   (`MADV_COLD`), the cache stays intact for other processes sharing the file.
+     * - `DMMAP_DROP_PAGEOUT`: reclaim the pages of this process right away
+     *   (`MADV_PAGEOUT`), the copies other processes map stay.
+     *
+     * `MADV_COLD` and `MADV_PAGEOUT` need Linux 5.4, elsewhere they act like `MADV_DONTNEED`
+     * without the cache drop. On Windows every mode trims the range from the working set.
+     */
+    typedef enum DmmapDropMode
     {
-        CloseHandle(file);
-        return result;
-    }
+        DMMAP_DROP_NONE = 0,
+        DMMAP_DROP_DONTNEED = 1,
+        DMMAP_DROP_COLD = 2,
+        DMMAP_DROP_PAGEOUT = 3
+    } DmmapDropMode;
 
-    void* data = MapViewOfFile(map, map_access, 0, 0, fileSize);
-    if (!data)
+    /**
+     * @struct DmmapDropBehind
+     * @brief Cursor of a sequential consumer for `dmmap_drop_behind`.
+     */
+    typedef struct DmmapDropBehind
     {
-        CloseHandle(map);
-        CloseHandle(file);
-        return result;
-    }
+        size_t distance;    /**< Bytes behind the position that are kept, 0 disables dropping */
+        DmmapDropMode mode; /**< How passed ranges are dropped */
+        size_t dropped;     /**< Offset below which everything has been dropped */
+    } DmmapDropBehind;
 
-    result.data = data;
-    result.size = fileSize;
-    result.fd = (uintptr_t)map; // Storing map handle as uintptr_t
-    CloseHandle(file);
-    return result;
-}
+    /**
+     * @brief Lets go of the resident pages of a range of a mapping.
+     *
+     * Only pages entirely inside the range are affected. Buffers of
+     * `DMMAP_BACKEND_BUFFER` and `DMMAP_BACKEND_ANON` are not page cache and are left
+     * alone. Dropped pages of a mapping read back from the file on the next access.
+     *
+     * @param offset Start of the range, relative to `data`.
+     * @param length Length of the range, clipped to the end of the file.
+     * @return 1 on success, 0 on failure.
+     */
+    int dmmap_drop(DmmapFile* file, size_t offset, size_t length, DmmapDropMode mode);
 
-void dmmap_file_close(DmmapFile* file)
-{
-    if (file->data)
-    {
-        UnmapViewOfFile(file->data);
-        CloseHandle((HANDLE)file->fd);
-        file->data = NULL;
-        file->size = 0;
-        file->fd = 0;
-    }
-}
+    /**
+     * @brief Drops what a sequential consumer has passed by more than `drop->distance`.
+     *
+     * Call it with the offset the consumer has reached, it drops in batches of at least
+     * `DMMAP_DROP_BEHIND_BATCH` bytes. Resident memory of a full scan then stays around
+     * `distance` plus one batch.
+     *
+     * @param position Offset the consumer has reached, relative to `data`.
+     */
+    void dmmap_drop_behind(DmmapFile* file, DmmapDropBehind* drop, size_t position);
 
-#else // POSIX (Linux, macOS)
-#include <fcntl.h>
-#include <sys/mman.h>
-#include <sys/stat.h>
-#include <unistd.h>
+    // ***************************************************************************************
+    // *  Resident memory budget
+    // ***************************************************************************************
 
-DmmapFile dmmap_file_open(const char* filename, int read_only)
-{
-    DmmapFile result = {0};
-    int flags = read_only ? O_RDONLY : O_RDWR;
-    int fd = open(filename, flags);
-    if (fd == -1)
-        return result;
+/**
+ * Granularity at which the budget tracks recency and evicts, 2 MiB.
+ */
+#ifndef DMMAP_BUDGET_CHUNK
+#define DMMAP_BUDGET_CHUNK (2u << 20)
+#endif
 
-    struct stat sb;
-    if (fstat(fd, &sb) == -1)
+/**
+ * How the budget evicts a chunk, see `DmmapDropMode`. Chunks the drop fails on or leaves
+ * resident (kernels before 5.4 lack `MADV_PAGEOUT`) are dropped with `DMMAP_DROP_DONTNEED`.
+ */
+#ifndef DMMAP_BUDGET_DROP_MODE
+#define DMMAP_BUDGET_DROP_MODE DMMAP_DROP_PAGEOUT
+#endif
+
+    /**
+     * @struct DmmapBudgetStats
+     * @brief Outcome of one `dmmap_budget_enforce` pass.
+     */
+    typedef struct DmmapBudgetStats
     {
-        close(fd);
-        return result;
-    }
+        size_t budget;   /**< Budget in bytes, 0 when none is set */
+        size_t resident; /**< Resident bytes of all registered mappings after the pass */
+        size_t evicted;  /**< Resident bytes the pass evicted */
+        size_t mappings; /**< Number of registered mappings */
+    } DmmapBudgetStats;
 
-    int prot = read_only ? PROT_READ : PROT_READ | PROT_WRITE;
-    void* data = mmap(NULL, sb.st_size, prot, MAP_SHARED, fd, 0);
-    if (data == MAP_FAILED)
+    /**
+     * @brief Returns `file->data + offset` and marks the range as recently used.
+     *
+     * Every mapping opened by the library is kept in a process-wide registry. The
+     * budget evicts the chunks that were used least recently first, where a use is a
+     * call of this accessor or a chunk turning resident between two passes.
+     *
+     * @param offset Start of the range, must lie inside the file.
+     * @param length Length of the range, clipped to the end of the file. A zero length
+     *               only returns the pointer and marks nothing.
+     */
+    void* dmmap_access(DmmapFile* file, size_t offset, size_t length);
+
+    /**
+     * @brief Sets the resident memory budget of all mappings of the process.
+     *
+     * @param bytes The budget, 0 removes it.
+     * @param interval_ms When non-zero, a monitor thread enforces the budget at this
+     *                    interval. 0 stops the monitor, `dmmap_budget_enforce` can then
+     *                    be called at the points that suit the application.
+     */
+    void dmmap_budget_set(size_t bytes, unsigned interval_ms);
+
+    /**
+     * @brief Samples the residency of all registered mappings and evicts the least
+     * recently used chunks until they fit the budget.
+     *
+     * @param stats Receives the outcome of the pass, may be `NULL`.
+     */
+    void dmmap_budget_enforce(DmmapBudgetStats* stats);
+
+    /**
+     * @struct DmmapPressureOptions
+     * @brief Settings of `dmmap_pressure_watch`, zero fields take the defaults.
+     */
+    typedef struct DmmapPressureOptions
     {
-        close(fd);
-        return result;
-    }
+        const char* path;        /**< PSI file, `/proc/pressure/memory` by default, or a cgroup `memory.pressure` */
+        unsigned stall_us;       /**< Stall time per window that counts as pressure, 200 ms by default */
+        unsigned window_us;      /**< Window of the stall time, 2 s by default */
+        unsigned shrink_percent; /**< Share of the resident mapped memory paged out per event, 25 by default */
+        unsigned calm_ms;        /**< Time without pressure before readahead comes back, 10 s by default */
+    } DmmapPressureOptions;
 
-    result.data = data;
-    result.size = sb.st_size;
-    result.fd = fd;
-    return result;
-}
+    /**
+     * @brief Watches Linux pressure stall information and shrinks the mappings under pressure.
+     *
+     * A watcher thread registers a PSI trigger ("some" stall time per window) and falls
+     * back to polling `avg10` where triggers are not allowed. On every pressure event the
+     * registered mappings lose their readahead (`MADV_RANDOM`) and their least recently
+     * used chunks are paged out, see `dmmap_budget_enforce`. Once no event came for
+     * `calm_ms`, the mappings get their previous advice back.
+     *
+     * @param options Settings, `NULL` for the defaults.
+     * @return 1 when the watcher runs, 0 when PSI is not available (not Linux, a kernel
+     *         before 4.20 or PSI disabled).
+     */
+    int dmmap_pressure_watch(const DmmapPressureOptions* options);
 
-void dmmap_file_close(DmmapFile* file)
-{
-    if (file->data)
+    /**
+     * @brief Stops the pressure watcher and restores the advice of the mappings.
+     */
+    void dmmap_pressure_unwatch(void);
+
+    /**
+     * @brief Tells whether the pressure watcher currently keeps the mappings shrunk.
+     */
+    int dmmap_under_pressure(void);
+
+    // ***************************************************************************************
+    // *  Adaptive readahead
+    // ***************************************************************************************
+
+/**
+ * Consecutive accesses of one kind after which the readahead controller switches pattern.
+ */
+#ifndef DMMAP_READAHEAD_CONFIRM
+#define DMMAP_READAHEAD_CONFIRM 4
+#endif
+
+/**
+ * First and largest window the controller prefetches ahead of a sequential reader.
+ */
+#ifndef DMMAP_READAHEAD_MIN
+#define DMMAP_READAHEAD_MIN (128u * 1024u)
+#endif
+
+#ifndef DMMAP_READAHEAD_MAX
+#define DMMAP_READAHEAD_MAX (16u * 1024u * 1024u)
+#endif
+
+/**
+ * Number of strides the controller prefetches ahead of a strided reader.
+ */
+#ifndef DMMAP_READAHEAD_STRIDES
+#define DMMAP_READAHEAD_STRIDES 8
+#endif
+
+    /**
+     * @enum DmmapAccessPattern
+     * @brief Access pattern of a mapping as detected from its `dmmap_access` calls.
+     */
+    typedef enum DmmapAccessPattern
     {
-        munmap(file->data, file->size);
-        close(file->fd);
-        file->data = NULL;
-        file->size = 0;
-        file->fd = 0;
-    }
-}
+        DMMAP_PATTERN_UNKNOWN = 0,    /**< Not enough accesses yet, or adaptive readahead is off */
+        DMMAP_PATTERN_SEQUENTIAL = 1, /**< Each access starts where the previous one ended, or inside it */
+        DMMAP_PATTERN_STRIDED = 2,    /**< Accesses are a constant distance apart, like a column of records */
+        DMMAP_PATTERN_RANDOM = 3      /**< Neither */
+    } DmmapAccessPattern;
+
+    /**
+     * @brief Turns the adaptive readahead of a mapping on or off.
+     *
+     * While on, `dmmap_access` classifies the accesses of the mapping. Once a pattern has
+     * held for `DMMAP_READAHEAD_CONFIRM` accesses the advice of the mapping follows it
+     * (`MADV_SEQUENTIAL`, `MADV_RANDOM` for strides and random accesses) and the
+     * controller prefetches with `MADV_WILLNEED`: a window ahead of a sequential reader
+     * that doubles from `DMMAP_READAHEAD_MIN` up to `DMMAP_READAHEAD_MAX`, or the next
+     * `DMMAP_READAHEAD_STRIDES` strides, which the kernel's own readahead never catches.
+     * Turning it off restores the advice the mapping had before. Prefetching pauses while
+     * the pressure watcher holds the mapping. On Windows only the prefetching applies.
+     *
+     * @return 1 on success, 0 if the mapping is not registered.
+     */
+    int dmmap_readahead_auto(DmmapFile* file, int enable);
+
+    /**
+     * @brief Returns the access pattern the readahead controller currently assumes.
+     */
+    DmmapAccessPattern dmmap_access_pattern(const DmmapFile* file);
+
+    // ***************************************************************************************
+    // *  Performance counters
+    // ***************************************************************************************
 
+/**
+ * Number of buckets of the flush latency histograms, bucket `i` counts flushes that took
+ * `[2^i, 2^(i+1))` microseconds, the first one also those below a microsecond and the
+ * last one all longer ones.
+ */
+#ifndef DMMAP_STATS_BUCKETS
+#define DMMAP_STATS_BUCKETS 24
 #endif
 
+    /**
+     * @struct DmmapFileStats
+     * @brief Counters of one mapping, or the totals of the process, see `dmmap_stats_enable`.
+     */
+    typedef struct DmmapFileStats
+    {
+        uint64_t opens;            /**< Files opened with `dmmap_file_open` while counting */
+        uint64_t open_ns;          /**< Time in `open` (`CreateFile`) */
+        uint64_t fstat_ns;         /**< Time in `fstat` (`GetFileSize`) */
+        uint64_t map_ns;           /**< Time in `mmap` (`MapViewOfFile`), or reading a small file */
+        uint64_t unmap_ns;         /**< Time in `munmap` (`UnmapViewOfFile`), only in the totals */
+        uint64_t minor_faults;     /**< Faults served from memory, all faults on Windows */
+        uint64_t major_faults;     /**< Faults that waited for I/O */
+        uint64_t bytes_advised;    /**< Bytes given access pattern hints or dropped */
+        uint64_t bytes_prefetched; /**< Bytes the library prefetched or faulted in ahead of use */
+        uint64_t flushes;          /**< Calls of `dmmap_file_flush` */
+        uint64_t flush_ns;         /**< Time in `dmmap_file_flush` */
+        uint64_t flush_histogram[DMMAP_STATS_BUCKETS]; /**< Flushes by latency */
+    } DmmapFileStats;
+
+    /**
+     * @struct DmmapFaultScope
+     * @brief Fault counts of the calling thread at the start of a scope, see `dmmap_stats_fault_begin`.
+     */
+    typedef struct DmmapFaultScope
+    {
+        uint64_t minor;
+        uint64_t major;
+    } DmmapFaultScope;
+
+    /**
+     * @brief Turns the counters on or off for the whole process, they are off by default.
+     *
+     * While on, opening, mapping, unmapping, advising, prefetching and flushing are timed
+     * or counted per mapping and in process-wide totals, so that production systems can
+     * see where their mapped I/O time goes without a profiler. A `DMMAP_READER_MMAP`
+     * reader charges the faults its consumer takes between two chunks to its mapping.
+     * Turning them off keeps what was counted.
+     */
+    void dmmap_stats_enable(int enable);
+
+    /**
+     * @brief Reads the counters of a mapping.
+     *
+     * @return 1 on success, 0 if the mapping is not registered (`data` is `NULL`, or
+     *         it is a small file read into a buffer).
+     */
+    int dmmap_file_stats(const DmmapFile* file, DmmapFileStats* stats);
+
+    /**
+     * @brief Reads the totals of all mappings, including those closed since.
+     */
+    void dmmap_stats_totals(DmmapFileStats* stats);
+
+    /**
+     * @brief Starts charging the page faults of the calling thread to a mapping.
+     *
+     * Faults come from `getrusage(RUSAGE_THREAD)` on Linux, from the whole process
+     * elsewhere.
+     */
+    void dmmap_stats_fault_begin(DmmapFaultScope* scope);
+
+    /**
+     * @brief Charges the faults the calling thread took since `dmmap_stats_fault_begin` to a mapping.
+     */
+    void dmmap_stats_fault_end(DmmapFile* file, const DmmapFaultScope* scope);
+
+    // ***************************************************************************************
+    // *  Locked ranges
+    // ***************************************************************************************
+
+/**
+ * Lock flag: lock pages as they are faulted in (`MLOCK_ONFAULT`, Linux 4.4) instead of
+ * reading the whole range in right away. Other systems always populate the range.
+ */
+#define DMMAP_LOCK_ONFAULT 0x1u
+
+    /**
+     * @enum DmmapLockResult
+     * @brief Outcome of `dmmap_lock`.
+     */
+    typedef enum DmmapLockResult
+    {
+        DMMAP_LOCK_DENIED = -2, /**< Not permitted (`EPERM`) */
+        DMMAP_LOCK_LIMIT = -1,  /**< The range does not fit `RLIMIT_MEMLOCK` (the working set quota on Windows) */
+        DMMAP_LOCK_FAILED = 0,  /**< Invalid range or any other failure */
+        DMMAP_LOCK_OK = 1       /**< The range is locked */
+    } DmmapLockResult;
+
+    /**
+     * @struct DmmapLockLimits
+     * @brief How much memory may be locked, see `dmmap_lock_limits`.
+     */
+    typedef struct DmmapLockLimits
+    {
+        uint64_t limit;     /**< `RLIMIT_MEMLOCK` (the minimum working set on Windows), `UINT64_MAX` when unlimited */
+        uint64_t locked;    /**< Bytes of mappings locked through `dmmap_lock` and not unlocked or unmapped since */
+        uint64_t available; /**< What is left of `limit` */
+    } DmmapLockLimits;
+
+    /**
+     * @brief Keeps a range of a mapping in memory, it is never paged out or evicted.
+     *
+     * Use it for the hot parts of a mapping, like the header of an index or the top
+     * levels of a B-tree, where one major fault on the request path costs milliseconds.
+     * The memory budget and the pressure watcher skip chunks holding locked ranges.
+     *
+     * @param offset Start of the range, relative to `data`, widened to whole pages.
+     * @param length Length of the range.
+     * @param flags `DMMAP_LOCK_ONFAULT` or 0.
+     * @return One of `DmmapLockResult`.
+     */
+    DmmapLockResult dmmap_lock(DmmapFile* file, size_t offset, size_t length, unsigned flags);
+
+    /**
+     * @brief Unlocks the pages of a range, whether they were locked once or several times.
+     *
+     * Locks do not nest, so a page locked twice is unlocked by one call. Pages that
+     * were not locked are left alone and do not change the counters.
+     *
+     * @return 1 on success, 0 on failure.
+     */
+    int dmmap_unlock(DmmapFile* file, size_t offset, size_t length);
+
+    /**
+     * @brief Reports the lock limit of the process and how much the library has locked.
+     */
+    void dmmap_lock_limits(DmmapLockLimits* limits);
+
+    // ***************************************************************************************
+    // *  NUMA placement
+    // ***************************************************************************************
+
+/**
+ * Highest number of NUMA nodes the placement functions handle.
+ */
+#ifndef DMMAP_NUMA_MAX_NODES
+#define DMMAP_NUMA_MAX_NODES 64
+#endif
+
+/**
+ * Unit in which `dmmap_numa_prefault` hands a range out to the nodes.
+ */
+#ifndef DMMAP_NUMA_STRIPE
+#define DMMAP_NUMA_STRIPE (2u * 1024u * 1024u)
+#endif
+
+    /**
+     * @enum DmmapNumaPolicy
+     * @brief Where the pages of a range are placed on a multi-socket machine.
+     */
+    typedef enum DmmapNumaPolicy
+    {
+        DMMAP_NUMA_DEFAULT = 0,   /**< The policy of the process, usually the node of the faulting thread */
+        DMMAP_NUMA_LOCAL = 1,     /**< The node of the thread that touches a page first */
+        DMMAP_NUMA_BIND = 2,      /**< One node */
+        DMMAP_NUMA_INTERLEAVE = 3 /**< Round-robin over all nodes */
+    } DmmapNumaPolicy;
+
+    /**
+     * @brief Returns the number of NUMA nodes of the machine, 1 when it has none.
+     */
+    int dmmap_numa_nodes(void);
+
+    /**
+     * @brief Sets the placement policy of a range of a mapping (`mbind`, Linux only).
+     *
+     * The policy applies to pages faulted in later and moves the resident pages that only
+     * this process maps. The kernel allocates the page cache of a file on the node policy
+     * of the thread reading it, so use `dmmap_numa_prefault` to place a file that is not
+     * yet cached; anonymous and tmpfs backed mappings follow this policy directly.
+     *
+     * @param offset Start of the range, relative to `data`, widened to whole pages.
+     * @param length Length of the range.
+     * @param policy The placement.
+     * @param node The node for `DMMAP_NUMA_BIND`, ignored otherwise.
+     * @return 1 on success, 0 on failure or where it is not supported.
+     */
+    int dmmap_numa_set(DmmapFile* file, size_t offset, size_t length, DmmapNumaPolicy policy, int node);
+
+    /**
+     * @brief Faults a range in from threads running on the nodes it should live on.
+     *
+     * The range is cut into `DMMAP_NUMA_STRIPE` stripes. `DMMAP_NUMA_INTERLEAVE` deals
+     * them out to the nodes in turn, `DMMAP_NUMA_LOCAL` gives each node one contiguous
+     * part so that a scan split the same way reads local memory, `DMMAP_NUMA_BIND` sends
+     * all of them to `node`, and `DMMAP_NUMA_DEFAULT` only prefaults in parallel.
+     * Every node gets `threads_per_node` threads, pinned to its CPUs and with their
+     * memory policy bound to it, so the page cache they read in is allocated there.
+     * Pages that are already resident stay where they are.
+     *
+     * @param offset Start of the range, relative to `data`.
+     * @param length Length of the range.
+     * @param policy The placement.
+     * @param node The node for `DMMAP_NUMA_BIND`, ignored otherwise.
+     * @param threads_per_node Threads per node, 0 means 1.
+     * @return The number of bytes faulted in, 0 on failure.
+     */
+    size_t dmmap_numa_prefault(DmmapFile* file, size_t offset, size_t length, DmmapNumaPolicy policy, int node,
+                               unsigned threads_per_node);
+
+    /**
+     * @brief Returns the node holding the page at `offset`, faulting it in if needed.
+     *
+     * @return The node, 0 on machines without NUMA, -1 on failure.
+     */
+    int dmmap_numa_node_of(const DmmapFile* file, size_t offset);
+
+    // ***************************************************************************************
+    // *  Replicated mappings
+    // ***************************************************************************************
+
+/**
+ * Calls of `dmmap_replica` after which a thread looks up its NUMA node again, in case the
+ * scheduler moved it.
+ */
+#ifndef DMMAP_REPLICA_RECHECK
+#define DMMAP_REPLICA_RECHECK 4096
+#endif
+
+    /**
+     * @struct DmmapReplicas
+     * @brief Read-only copies of a file, one in the memory of every NUMA node.
+     */
+    typedef struct DmmapReplicas
+    {
+        const void* data[DMMAP_NUMA_MAX_NODES]; /**< The copy on each node, `NULL` for nodes without one */
+        size_t size;                            /**< Size of every copy */
+        int count;                              /**< Number of copies */
+    } DmmapReplicas;
+
+    /**
+     * @brief Copies a mapping into anonymous memory on every NUMA node.
+     *
+     * For small, hot, read-only files, where reading another node's memory costs more
+     * than keeping one copy per node. The copies are made in parallel by one thread per
+     * node, pinned to it, and are independent of `file` once this returns. On machines
+     * without NUMA there is a single copy.
+     *
+     * @param replicas Receives the copies.
+     * @param file The mapping to copy.
+     * @return 1 if at least one copy was made, 0 on failure.
+     */
+    int dmmap_replicas_open(DmmapReplicas* replicas, const DmmapFile* file);
+
+    /**
+     * @brief Returns the copy on the NUMA node of the calling thread.
+     *
+     * The node is looked up every `DMMAP_REPLICA_RECHECK` calls and cached in between,
+     * so the call is cheap enough for every lookup. Falls back to any copy when the node
+     * has none.
+     */
+    const void* dmmap_replica(const DmmapReplicas* replicas);
+
+    /**
+     * @brief Returns the NUMA node the calling thread currently runs on, 0 without NUMA.
+     */
+    int dmmap_numa_current_node(void);
+
+    /**
+     * @brief Frees all copies.
+     */
+    void dmmap_replicas_close(DmmapReplicas* replicas);
+
+    // ***************************************************************************************
+    // *  Parallel scan
+    // ***************************************************************************************
+
+/**
+ * Highest number of workers of `dmmap_scan`.
+ */
+#ifndef DMMAP_SCAN_MAX_THREADS
+#define DMMAP_SCAN_MAX_THREADS 256
+#endif
+
+    /**
+     * @brief Processes the range of one worker of `dmmap_scan`.
+     *
+     * @param user_data The pointer given to `dmmap_scan`.
+     * @param worker Index of the worker, below the number of workers.
+     * @param data Start of the range.
+     * @param offset Offset of the range in the mapping.
+     * @param size Size of the range.
+     */
+    typedef void (*DmmapScanFn)(void* user_data, unsigned worker, const void* data, size_t offset, size_t size);
+
+    /**
+     * @struct DmmapScanOptions
+     * @brief Options of `dmmap_scan`, zero-initialize for the defaults.
+     */
+    typedef struct DmmapScanOptions
+    {
+        unsigned threads;   /**< Number of workers, 0 for one per physical core */
+        int smt;            /**< Also use the sibling hyperthreads of the cores, for latency-bound kernels */
+        int no_pin;         /**< Leave the workers to the scheduler */
+        size_t granularity; /**< Ranges start at multiples of it, 0 for the page size */
+    } DmmapScanOptions;
+
+    /**
+     * @struct DmmapScanWorkerStats
+     * @brief What one worker of `dmmap_scan` did.
+     */
+    typedef struct DmmapScanWorkerStats
+    {
+        int cpu;                 /**< CPU the worker was pinned to, -1 if it was not */
+        size_t offset;           /**< Start of its range */
+        size_t bytes;            /**< Size of its range */
+        double seconds;          /**< Time it spent in the callback */
+        double bytes_per_second; /**< Its throughput */
+    } DmmapScanWorkerStats;
+
+    /**
+     * @brief Splits a mapping into one contiguous range per worker and processes them in parallel.
+     *
+     * Workers are pinned to one CPU each. The CPUs are taken one per physical core first,
+     * alternating between packages, so that bandwidth-bound kernels never share a core
+     * while cores are idle; sibling hyperthreads are only used when `smt` is set or
+     * more workers than cores are asked for. Only CPUs the process may run on count.
+     *
+     * @param file The mapping to scan.
+     * @param options Options, `NULL` for the defaults.
+     * @param fn Called once by every worker with its range.
+     * @param user_data Passed to `fn`.
+     * @param stats Optional, receives one entry per worker, room for `DMMAP_SCAN_MAX_THREADS`.
+     * @return The number of workers, 0 on failure.
+     */
+    unsigned dmmap_scan(const DmmapFile* file, const DmmapScanOptions* options, DmmapScanFn fn, void* user_data,
+                        DmmapScanWorkerStats* stats);
+
+    // ***************************************************************************************
+    // *  Residency
+    // ***************************************************************************************
+
+/**
+ * Number of largest cold gaps `dmmap_residency_summary` reports.
+ */
+#ifndef DMMAP_RESIDENCY_GAPS
+#define DMMAP_RESIDENCY_GAPS 8
+#endif
+
+    /**
+     * @struct DmmapColdGap
+     * @brief A run of pages of a mapping that are not in memory.
+     */
+    typedef struct DmmapColdGap
+    {
+        size_t offset; /**< Start of the run, relative to `data`, page aligned within the mapping */
+        size_t length; /**< Length of the run in bytes */
+    } DmmapColdGap;
+
+    /**
+     * @struct DmmapResidencySummary
+     * @brief How much of a range of a mapping is in memory, see `dmmap_residency_summary`.
+     */
+    typedef struct DmmapResidencySummary
+    {
+        size_t pages;                           /**< Pages in the range */
+        size_t resident;                        /**< Pages in memory */
+        double percent;                         /**< `resident` in percent of `pages` */
+        unsigned gap_count;                     /**< Valid entries of `gaps` */
+        DmmapColdGap gaps[DMMAP_RESIDENCY_GAPS]; /**< The largest runs of cold pages, largest first */
+    } DmmapResidencySummary;
+
+    /**
+     * @brief Tells which pages of a range of a mapping are in memory (`mincore`).
+     *
+     * The range is widened to whole pages. Bit `i % 8` of `bitmap[i / 8]` is set when
+     * page `i` of the range is resident. Nothing is faulted in. Pass a `NULL` bitmap to
+     * learn the number of pages, the bitmap needs `(pages + 7) / 8` bytes.
+     *
+     * @param offset Start of the range, relative to `data`.
+     * @param length Length of the range, clamped to the mapping.
+     * @param bitmap Receives one bit per page, may be `NULL`.
+     * @return The number of pages of the range, 0 on failure.
+     */
+    size_t dmmap_residency(const DmmapFile* file, size_t offset, size_t length, uint8_t* bitmap);
+
+    /**
+     * @brief Sums up the residency of a range: share in memory and largest cold gaps.
+     *
+     * Cheap enough to check whether a query would hit RAM before routing it, or to log
+     * how warm a mapping is after a deploy.
+     *
+     * @return 1 on success, 0 on failure.
+     */
+    int dmmap_residency_summary(const DmmapFile* file, size_t offset, size_t length, DmmapResidencySummary* summary);
+
+    /**
+     * @brief Renders the residency of a range as a one-line text heatmap.
+     *
+     * The range is divided into `cells` equal parts and each becomes one character of
+     * " .:-=+*#%@", from cold to fully resident, so warm-up problems show in a log line.
+     *
+     * @param out Receives `cells` characters and a terminating zero.
+     * @param cells Number of cells, `out` must hold `cells + 1` bytes.
+     * @return `cells` on success, 0 on failure.
+     */
+    size_t dmmap_residency_heatmap(const DmmapFile* file, size_t offset, size_t length, char* out, size_t cells);
+
+    // ***************************************************************************************
+    // *  Access profiles
+    // ***************************************************************************************
+
+/**
+ * Granularity of access profiles, a unit counts as touched once any of its pages turns resident.
+ */
+#ifndef DMMAP_PROFILE_UNIT
+#define DMMAP_PROFILE_UNIT (64u * 1024u)
+#endif
+
+    /**
+     * @struct DmmapProfileOptions
+     * @brief Options of `dmmap_profile_start`, zero fields take the defaults.
+     */
+    typedef struct DmmapProfileOptions
+    {
+        unsigned duration_ms; /**< How long to record, 0 until `dmmap_profile_stop` */
+        unsigned interval_ms; /**< Time between two samples, 250 ms by default */
+    } DmmapProfileOptions;
+
+    /**
+     * @brief Starts recording which parts of the open mappings are faulted in.
+     *
+     * A background thread samples the residency (`mincore`) of every mapping opened by
+     * path, also those opened later, and remembers in which sample each `DMMAP_PROFILE_UNIT`
+     * turned resident. A mapping is snapshot when it is first seen, at the start or when it
+     * is opened, and only changes from then on are recorded: pages already in the page cache
+     * are not mistaken for touched ones. A page that was cached before it was touched is
+     * missed as well, and pages brought in by kernel readahead or other processes count as
+     * touched, so record from a cold cache. Record the first seconds or minutes after a
+     * start, save the profile and replay it on the next start to be warm right away. A
+     * running recording is restarted.
+     *
+     * @param options Options, `NULL` for the defaults.
+     * @return 1 on success, 0 if the thread could not be started.
+     */
+    int dmmap_profile_start(const DmmapProfileOptions* options);
+
+    /**
+     * @brief Stops recording, the profile is kept for `dmmap_profile_save`.
+     */
+    void dmmap_profile_stop(void);
+
+    /**
+     * @brief Writes the recorded profile as text, keyed by the paths the mappings were opened with.
+     *
+     * @return 1 on success, 0 on failure or when nothing was recorded.
+     */
+    int dmmap_profile_save(const char* filename);
+
+    /**
+     * @brief Prefetches the open mappings in the order a saved profile touched them.
+     *
+     * Mappings are matched by the path they were opened with. Ranges are handed out in
+     * recorded order to `threads` threads that fault them in (`MADV_POPULATE_READ`,
+     * `MADV_WILLNEED` on older kernels, `PrefetchVirtualMemory` on Windows), so the
+     * reads are in flight in parallel. Parts beyond the current size of a file are
+     * skipped. The mappings must stay open until this returns.
+     *
+     * @param filename The profile.
+     * @param threads Number of threads, 0 for 4.
+     * @return The number of bytes prefetched, 0 if the profile could not be read.
+     */
+    size_t dmmap_profile_replay(const char* filename, unsigned threads);
+
+    // ***************************************************************************************
+    // *  Hot-first layout
+    // ***************************************************************************************
+
+    /**
+     * @struct DmmapRelayoutStats
+     * @brief What `dmmap_relayout` did.
+     */
+    typedef struct DmmapRelayoutStats
+    {
+        size_t records;      /**< Records in the file */
+        size_t hot_records;  /**< Records the profile saw touched, now at the front */
+        size_t pages_before; /**< Pages the hot records spanned in the original file */
+        size_t pages_after;  /**< Pages they span in the new file */
+    } DmmapRelayoutStats;
+
+    /**
+     * @brief Rewrites a file of fixed-size records with the records a profile saw touched first.
+     *
+     * Hot records are packed at the front in the order they were first touched, the cold
+     * ones follow in their original order. Hot data then spans far fewer pages, so the
+     * page cache holds more of it and readahead brings in useful records. Any bytes after
+     * the last whole record are copied as they are.
+     *
+     * The remapping table is a file of `uint64_t` in native byte order, entry `i` is the new
+     * index of record `i`, so it can itself be mapped with `dmmap_file_open` to rewrite
+     * indexes or offsets that point into the file.
+     *
+     * The profile has to be recorded from a cold page cache, see `dmmap_profile_start`.
+     * A profile that marks no record or every record as hot cannot improve the layout and
+     * is rejected, `stats->records` and `stats->hot_records` then tell which case it was.
+     *
+     * @param filename The record file, also the key of its mapping in the profile. It has to
+     *                 be spelled the way the profiled process opened it.
+     * @param record_size Size of one record.
+     * @param profile A profile saved by `dmmap_profile_save`.
+     * @param output Path of the rewritten file.
+     * @param remap Path of the remapping table.
+     * @param stats Optional, receives what was done.
+     * @return 1 on success, 0 on failure, if the file holds no whole record, if the profile
+     *         has no mapping of `filename` or if it marks no record or every record as hot.
+     *         Nothing is left at `output` or `remap` on failure.
+     */
+    int dmmap_relayout(const char* filename, size_t record_size, const char* profile, const char* output,
+                       const char* remap, DmmapRelayoutStats* stats);
+
+    // ***************************************************************************************
+    // *  Segment pool
+    // ***************************************************************************************
+
+/**
+ * Default size of the segments of a `DmmapSegmentPool`, 2 MiB.
+ */
+#ifndef DMMAP_SEGMENT_SIZE
+#define DMMAP_SEGMENT_SIZE (2u << 20)
+#endif
+
+/**
+ * Cap of the usage count of a frame, a segment pinned with a high priority survives at
+ * most this many sweeps of the clock hand without being pinned again.
+ */
+#ifndef DMMAP_SEGMENT_MAX_USAGE
+#define DMMAP_SEGMENT_MAX_USAGE 16
+#endif
+
+    /**
+     * A buffer manager over a file far larger than memory, see `dmmap_segment_pool_open`.
+     */
+    typedef struct DmmapSegmentPool DmmapSegmentPool;
+
+    /**
+     * @struct DmmapPin
+     * @brief A pinned segment, mapped until `dmmap_segment_unpin`.
+     */
+    typedef struct DmmapPin
+    {
+        void* data;      /**< Start of the segment */
+        size_t size;     /**< Size of the segment, shorter for the last one */
+        uint64_t offset; /**< File offset of the segment */
+        uint32_t frame;  /**< Frame holding the segment */
+    } DmmapPin;
+
+    /**
+     * @struct DmmapSegmentStats
+     * @brief Counters of a `DmmapSegmentPool`.
+     */
+    typedef struct DmmapSegmentStats
+    {
+        uint64_t hits;      /**< Pins of a segment that was mapped already */
+        uint64_t misses;    /**< Pins that had to map their segment */
+        uint64_t evictions; /**< Segments unmapped to make room */
+        size_t mapped;      /**< Segments mapped right now */
+        size_t pinned;      /**< Segments pinned right now */
+    } DmmapSegmentStats;
+
+    /**
+     * @brief Opens a file for access through at most `frames` mapped segments.
+     *
+     * Segments are mapped on the first pin and unmapped by a GCLOCK policy once a pin
+     * needs their frame: every pin adds its priority to the usage count of the frame,
+     * the clock hand decrements the counts of unpinned frames and evicts the first one
+     * at zero. Eviction then follows the priorities of the workload rather than the
+     * kernel, and the number of mappings (VMAs) and their page tables stay bounded.
+     * The pool is thread-safe.
+     *
+     * @param segment_size Bytes per segment, rounded up to the page size (the allocation
+     *                     granularity on Windows), 0 for `DMMAP_SEGMENT_SIZE`.
+     * @param frames Most segments mapped at once.
+     * @return The pool, `NULL` on failure.
+     */
+    DmmapSegmentPool* dmmap_segment_pool_open(const char* filename, int read_only, size_t segment_size, size_t frames);
+
+    /**
+     * @brief Pins the segment holding `offset`, mapping it if needed.
+     *
+     * @param priority Weight added to the usage count of the segment, 0 counts as 1.
+     * @return 1 on success, 0 when `offset` lies outside the file, every frame is pinned
+     *         or the segment cannot be mapped.
+     */
+    int dmmap_segment_pin(DmmapSegmentPool* pool, uint64_t offset, unsigned priority, DmmapPin* pin);
+
+    /**
+     * @brief Releases a pin, the segment stays mapped until the clock evicts it.
+     */
+    void dmmap_segment_unpin(DmmapSegmentPool* pool, DmmapPin* pin);
+
+    /**
+     * @brief Reads the counters of a pool.
+     */
+    void dmmap_segment_pool_stats(DmmapSegmentPool* pool, DmmapSegmentStats* stats);
+
+    /**
+     * @brief Unmaps all segments and closes the pool, no pins may be held.
+     */
+    void dmmap_segment_pool_close(DmmapSegmentPool* pool);
+
+    // ***************************************************************************************
+    // *  Streaming reader
+    // ***************************************************************************************
+
+/**
+ * Default size of the chunks handed out by a `DmmapReader`.
+ */
+#ifndef DMMAP_READER_CHUNK_SIZE
+#define DMMAP_READER_CHUNK_SIZE (1u << 20)
+#endif
+
+/**
+ * Default number of buffers a buffered `DmmapReader` keeps in flight.
+ */
+#ifndef DMMAP_READER_QUEUE_DEPTH
+#define DMMAP_READER_QUEUE_DEPTH 8
+#endif
+
+/**
+ * Default number of buffers of a `DMMAP_READER_DIRECT` reader, 3 for triple buffering.
+ */
+#ifndef DMMAP_READER_DIRECT_DEPTH
+#define DMMAP_READER_DIRECT_DEPTH 3
+#endif
+
+/**
+ * How much consumption the prefetch thread of a mapping reader keeps populated ahead,
+ * in milliseconds at the consumer's measured rate, within `DmmapReaderOptions.prefetch`.
+ */
+#ifndef DMMAP_READER_PREFETCH_MS
+#define DMMAP_READER_PREFETCH_MS 250
+#endif
+
+    /**
+     * @enum DmmapReaderBackend
+     * @brief How a `DmmapReader` gets the bytes of the file.
+     *
+     * - `DMMAP_READER_MMAP`: chunks are windows of a mapping of the whole file.
+     * - `DMMAP_READER_URING`: chunks are read ahead into a pool of buffers, through
+     *   an io_uring with registered buffers when compiled with `DMMAP_USE_IO_URING`
+     *   on Linux, through plain reads otherwise. A single pass scan avoids the page
+     *   faults and TLB churn of the mapping. Sources that cannot be read at offsets
+     *   (pipes, procfs files) fall back to `DMMAP_READER_MMAP`.
+     * - `DMMAP_READER_DIRECT`: like `DMMAP_READER_URING` but bypassing the page cache
+     *   (`O_DIRECT` on Linux, `F_NOCACHE` on macOS, `FILE_FLAG_NO_BUFFERING` on Windows),
+     *   so that a one pass scan does not evict the cached working set of the process.
+     *   Without io_uring the reads are done ahead by an I/O thread. Filesystems that
+     *   refuse direct I/O (tmpfs) are read through the cache.
+     */
+    typedef enum DmmapReaderBackend
+    {
+        DMMAP_READER_MMAP = 0,
+        DMMAP_READER_URING = 1,
+        DMMAP_READER_DIRECT = 2
+    } DmmapReaderBackend;
+
+    /**
+     * @struct DmmapReaderOptions
+     * @brief Per-open settings of a `DmmapReader`, zero fields take the defaults.
+     */
+    typedef struct DmmapReaderOptions
+    {
+        DmmapReaderBackend backend; /**< Backend of the reader */
+        size_t chunk_size;          /**< Bytes per chunk, rounded up to the page size */
+        unsigned queue_depth;       /**< Buffers in flight for the buffered backends, at most 64 */
+        size_t drop_behind;         /**< Drop-behind distance in bytes, 0 keeps what was read */
+        DmmapDropMode drop_mode;    /**< Drop-behind mode, `DMMAP_DROP_DONTNEED` when 0 */
+        size_t prefetch;            /**< Most bytes the prefetch thread of `DMMAP_READER_MMAP` stays ahead, 0 for none */
+    } DmmapReaderOptions;
+
+    /**
+     * @struct DmmapChunk
+     * @brief A piece of the file handed out by `dmmap_reader_next`.
+     */
+    typedef struct DmmapChunk
+    {
+        const void* data; /**< The bytes of the chunk */
+        size_t size;      /**< Number of bytes in the chunk */
+        uint64_t offset;  /**< File offset of the first byte */
+    } DmmapChunk;
+
+    /**
+     * @struct DmmapReader
+     * @brief A sequential reader that hands a file out in consecutive chunks.
+     */
+    typedef struct DmmapReader
+    {
+        DmmapReaderBackend backend; /**< Backend in use */
+        DmmapFile file;             /**< The mapping of the `DMMAP_READER_MMAP` backend */
+        uint64_t size;              /**< Size of the file in bytes */
+        uint64_t offset;            /**< File offset of the next chunk */
+        size_t chunk_size;          /**< Bytes per chunk */
+        DmmapDropBehind drop;       /**< Drop-behind cursor, see `DmmapReaderOptions` */
+        DmmapFaultScope faults;     /**< Faults at the last chunk, when counters are on */
+        void* impl;                 /**< Backend state */
+    } DmmapReader;
+
+    /**
+     * @brief Opens a file for a sequential scan.
+     *
+     * With `drop_behind` set, the pages of chunks that lie more than that many bytes
+     * behind the current one are dropped, see `dmmap_drop_behind`. The buffered backends
+     * only drop from the page cache and only in `DMMAP_DROP_DONTNEED` mode.
+     *
+     * With `prefetch` set, a `DMMAP_READER_MMAP` reader gets a helper thread that faults
+     * the chunks ahead of the consumer in (`MADV_POPULATE_READ`, or by touching them), so
+     * the consumer does not stall on major faults. It stays `DMMAP_READER_PREFETCH_MS`
+     * of the consumer's measured rate ahead, at least two chunks and at most `prefetch`.
+     *
+     * @param options Settings for this reader, `NULL` for the mapping backend with defaults.
+     * @return 1 on success, 0 on failure.
+     */
+    int dmmap_reader_open(DmmapReader* reader, const char* filename, const DmmapReaderOptions* options);
+
+    /**
+     * @brief Hands out the next chunk of the file.
+     *
+     * The chunk stays valid until the next call on the same reader.
+     *
+     * @return 1 when `chunk` was filled, 0 at the end of the file, -1 on a read error.
+     */
+    int dmmap_reader_next(DmmapReader* reader, DmmapChunk* chunk);
+
+    /**
+     * @brief Releases a reader opened with `dmmap_reader_open`.
+     */
+    void dmmap_reader_close(DmmapReader* reader);
+
+    // ***************************************************************************************
+    // *  Search layouts for sorted keys
+    // ***************************************************************************************
+
+#define DMMAP_LAYOUT_MAX_LEVELS 16
+
+/**
+ * Number of keys in one node of `DMMAP_LAYOUT_BTREE`, 512 keys of 8 bytes fill one 4 KiB page.
+ */
+#ifndef DMMAP_LAYOUT_BTREE_KEYS
+#define DMMAP_LAYOUT_BTREE_KEYS 512
+#endif
+
+    /**
+     * @enum DmmapLayoutKind
+     * @brief The physical order a sorted key file is re-laid into.
+     *
+     * - `DMMAP_LAYOUT_EYTZINGER`: implicit binary tree in breadth-first order. The
+     *   top levels share a few cache lines and pages, the search prefetches the
+     *   cache line holding the descendants three levels down.
+     * - `DMMAP_LAYOUT_BTREE`: static B+ tree with one page per node
+     *   (`DMMAP_LAYOUT_BTREE_KEYS` keys). A lookup touches one page per level,
+     *   around four levels for 10^10 keys, where the upper ones stay resident.
+     */
+    typedef enum DmmapLayoutKind
+    {
+        DMMAP_LAYOUT_EYTZINGER = 1,
+        DMMAP_LAYOUT_BTREE = 2
+    } DmmapLayoutKind;
+
+    /**
+     * @struct DmmapLayout
+     * @brief An opened layout file produced by `dmmap_layout_build`.
+     *
+     * Lookups return the rank of the key in the original sorted file, so any
+     * payload stored in the original order stays addressable.
+     */
+    typedef struct DmmapLayout
+    {
+        DmmapFile file;                                 /**< Mapping of the layout file */
+        const uint64_t* keys;                           /**< First key slot of the layout */
+        uint64_t count;                                 /**< Number of keys of the original sorted file */
+        uint32_t kind;                                  /**< One of `DmmapLayoutKind` */
+        uint32_t levels;                                /**< Number of levels of the tree */
+        uint64_t level_offset[DMMAP_LAYOUT_MAX_LEVELS]; /**< B+ tree only: first node of each level, leaves first */
+    } DmmapLayout;
+
+    /**
+     * @brief Re-lays a sorted key file into a search friendly order.
+     *
+     * @param sorted_keys A mapped file holding an ascending array of native `uint64_t` keys.
+     * @param out_filename The layout file to create, an existing file is overwritten.
+     * @param kind The target layout.
+     * @return 1 on success, 0 on failure.
+     */
+    int dmmap_layout_build(const DmmapFile* sorted_keys, const char* out_filename, DmmapLayoutKind kind);
+
+    /**
+     * @brief Maps a layout file created by `dmmap_layout_build` in read-only mode.
+     *
+     * @return 1 on success, 0 if the file cannot be mapped or is not a layout file.
+     */
+    int dmmap_layout_open(DmmapLayout* layout, const char* filename);
+
+    /**
+     * @brief Finds the first key that is not less than `key`.
+     *
+     * @return The rank of that key in the original sorted file, or `layout->count`
+     *         when every key is less than `key`.
+     */
+    uint64_t dmmap_layout_lower_bound(const DmmapLayout* layout, uint64_t key);
+
+    /**
+     * @brief Unmaps a layout file opened with `dmmap_layout_open`.
+     */
+    void dmmap_layout_close(DmmapLayout* layout);
+
+    // ***************************************************************************************
+    // *  Batched lookups
+    // ***************************************************************************************
+
+/**
+ * Number of lookups a batch advances in lockstep, each step prefetches for the whole group.
+ */
+#ifndef DMMAP_BATCH_GROUP
+#define DMMAP_BATCH_GROUP 16
+#endif
+
+/**
+ * Batch flag: also issue `madvise(MADV_WILLNEED)` (`PrefetchVirtualMemory` on Windows) for
+ * the next page of every lookup. It costs a system call per key and level, use it when the
+ * index is mostly cold.
+ */
+#define DMMAP_BATCH_WILLNEED 0x1u
+
+    // ***************************************************************************************
+    // *  Learned index for sorted keys
+    // ***************************************************************************************
+
+/**
+ * Default error bound of the learned index, in positions (keys or bytes).
+ */
+#ifndef DMMAP_PGM_EPSILON
+#define DMMAP_PGM_EPSILON 64
+#endif
+
+    /**
+     * @struct DmmapRange
+     * @brief A half-open range `[begin, end)` of positions or byte offsets.
+     */
+    typedef struct DmmapRange
+    {
+        uint64_t begin; /**< First position of the range */
+        uint64_t end;   /**< One past the last position of the range */
+    } DmmapRange;
+
+    /**
+     * @struct DmmapPgmSegment
+     * @brief One linear piece of the learned index as stored in the sidecar file.
+     */
+    typedef struct DmmapPgmSegment
+    {
+        uint64_t key;      /**< First key covered by the segment */
+        uint64_t position; /**< Position of `key` */
+        double slope;      /**< Positions per key unit */
+    } DmmapPgmSegment;
+
+    /**
+     * @struct DmmapPgm
+     * @brief A piecewise linear learned index mapped from its sidecar file.
+     *
+     * The index maps a key to its position within `epsilon` positions. For a
+     * key file the position is the index of the key, for a text file it is the
+     * byte offset of the line that holds the key. Near linear data such as
+     * consecutive numbers fits in a single segment, so the sidecar stays a few
+     * bytes long where a dense offset index needs 8 bytes per key.
+     */
+    typedef struct DmmapPgm
+    {
+        DmmapFile file;                  /**< Mapping of the sidecar file */
+        const DmmapPgmSegment* segments; /**< Segments ordered by key */
+        uint64_t count;                  /**< Number of segments */
+        uint64_t epsilon;                /**< Maximum prediction error in positions */
+        uint64_t max_gap;                /**< Largest distance between two consecutive positions */
+        uint64_t size;                   /**< Number of positions covered (keys or bytes) */
+    } DmmapPgm;
+
+    /**
+     * @brief Builds a learned index over an ascending array of native `uint64_t` keys.
+     *
+     * The keys are read once from start to end.
+     *
+     * @param sorted_keys The mapped key file.
+     * @param sidecar The index file to create, an existing file is overwritten.
+     * @param epsilon The maximum prediction error in keys, `DMMAP_PGM_EPSILON` is a good default.
+     * @return 1 on success, 0 on failure or if the keys are not sorted.
+     */
+    int dmmap_pgm_build(const DmmapFile* sorted_keys, const char* sidecar, uint64_t epsilon);
+
+    /**
+     * @brief Builds a learned index over a text file with one ascending decimal key per line.
+     *
+     * Positions are byte offsets of the lines, lines without a leading digit are skipped.
+     *
+     * @return 1 on success, 0 on failure or if the keys are not sorted.
+     */
+    int dmmap_pgm_build_text(const DmmapFile* text, const char* sidecar, uint64_t epsilon);
+
+    /**
+     * @brief Maps a sidecar file created by one of the `dmmap_pgm_build` functions.
+     *
+     * @return 1 on success, 0 if the file cannot be mapped or is not a learned index.
+     */
+    int dmmap_pgm_open(DmmapPgm* pgm, const char* sidecar);
+
+    /**
+     * @brief Predicts the positions that can hold the first key not less than `key`.
+     *
+     * @return The window to search, it is never wider than `2 * epsilon + max_gap + 2`.
+     */
+    DmmapRange dmmap_pgm_search(const DmmapPgm* pgm, uint64_t key);
+
+    /**
+     * @brief Finds the first key not less than `key` in the key file the index was built from.
+     *
+     * The search never leaves `sorted_keys`. An index built for a different number of
+     * keys is ignored and the whole file is binary searched.
+     *
+     * @return The index of that key, or the number of keys when every key is less than `key`.
+     */
+    uint64_t dmmap_pgm_lower_bound(const DmmapPgm* pgm, const DmmapFile* sorted_keys, uint64_t key);
+
+    /**
+     * @brief Finds the first line whose key is not less than `key` in the text file the index was built from.
+     *
+     * An index built for a text of a different size is ignored and the text is scanned from the start.
+     *
+     * @return The byte offset of that line, or `text->size` when every key is less than `key`.
+     */
+    uint64_t dmmap_pgm_find_line(const DmmapPgm* pgm, const DmmapFile* text, uint64_t key);
+
+    /**
+     * @brief Unmaps a sidecar file opened with `dmmap_pgm_open`.
+     */
+    void dmmap_pgm_close(DmmapPgm* pgm);
+
+    /**
+     * @brief Resolves `count` independent lookups, see `dmmap_layout_lower_bound`.
+     *
+     * Lookups are processed in groups of `DMMAP_BATCH_GROUP` that advance one search
+     * step at a time. The memory (and with `DMMAP_BATCH_WILLNEED` the page fault)
+     * latency of one lookup overlaps with the work on the others.
+     *
+     * @param keys The keys to look up.
+     * @param count The number of keys.
+     * @param ranks Receives `count` results, in the order of `keys`.
+     * @param flags Zero or `DMMAP_BATCH_WILLNEED`.
+     */
+    void dmmap_layout_lower_bound_batch(const DmmapLayout* layout, const uint64_t* keys, size_t count, uint64_t* ranks,
+                                        unsigned flags);
+
+    /**
+     * @brief Resolves `count` independent lookups, see `dmmap_pgm_lower_bound`.
+     *
+     * The windows of a whole group are predicted and prefetched before any of them is searched.
+     */
+    void dmmap_pgm_lower_bound_batch(const DmmapPgm* pgm, const DmmapFile* sorted_keys, const uint64_t* keys,
+                                     size_t count, uint64_t* ranks, unsigned flags);
+
+    // ***************************************************************************************
+    // *  Fault-aware interleaved lookups
+    // ***************************************************************************************
+
+/**
+ * Upper bound for the number of lookups `dmmap_layout_lower_bound_interleaved` keeps in flight.
+ */
+#ifndef DMMAP_INFLIGHT_MAX
+#define DMMAP_INFLIGHT_MAX 64
+#endif
+
+    /**
+     * @struct DmmapResidencyCache
+     * @brief One bit per page of a mapping, remembering pages already seen resident.
+     *
+     * Checking a remembered page costs a bit test instead of a `mincore`
+     * (`QueryWorkingSetEx` on Windows) call. Pages evicted after they were seen
+     * are still reported resident, touching them just takes a regular fault.
+     */
+    typedef struct DmmapResidencyCache
+    {
+        const void* data; /**< Start of the covered mapping */
+        size_t size;      /**< Size of the covered mapping in bytes */
+        uint8_t* bits;    /**< One bit per page */
+    } DmmapResidencyCache;
+
+    /**
+     * @brief Prepares a residency cache covering `size` bytes from `data`, with no page known resident.
+     *
+     * @return 1 on success, 0 if the bitmap cannot be allocated.
+     */
+    int dmmap_residency_cache_init(DmmapResidencyCache* cache, const void* data, size_t size);
+
+    /**
+     * @brief Releases the bitmap of a residency cache.
+     */
+    void dmmap_residency_cache_free(DmmapResidencyCache* cache);
+
+    /**
+     * @brief Tells whether the page holding `addr` is resident, without touching it.
+     *
+     * @param cache An optional cache covering `addr`, may be `NULL`.
+     * @return 1 if the page is resident, 0 otherwise.
+     */
+    int dmmap_is_resident(DmmapResidencyCache* cache, const void* addr);
+
+    /**
+     * @brief Resolves `count` lookups while keeping up to `inflight` of them suspended on cold pages.
+     *
+     * Every lookup is a small resumable state machine. Before a lookup dereferences
+     * its next node it checks the page residency, a cold page gets an asynchronous
+     * readahead request and the lookup yields to the other ones in flight. When every
+     * lookup in flight waits, the oldest one takes its fault so the batch keeps moving.
+     * One thread thereby keeps dozens of major faults outstanding instead of one.
+     *
+     * @param inflight Number of concurrent lookups, capped at `DMMAP_INFLIGHT_MAX`.
+     * @param cache An optional cache covering `layout->file`, reused across calls.
+     *              When `NULL` a temporary cache is used for the call.
+     */
+    void dmmap_layout_lower_bound_interleaved(const DmmapLayout* layout, const uint64_t* keys, size_t count,
+                                              uint64_t* ranks, size_t inflight, DmmapResidencyCache* cache);
+
+#ifdef __cplusplus
+}
+#endif
+
+#ifdef DMMAP_IMPL
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static size_t dmmap__small_file_threshold = DMMAP_SMALL_FILE_THRESHOLD;
+static size_t dmmap__page_size(void);
+static void* dmmap__pool_get(size_t size);
+static void dmmap__pool_put(void* buffer, size_t size);
+static void dmmap__registry_add(DmmapFile* file, const char* path);
+static void dmmap__registry_remove(DmmapFile* file);
+static void dmmap__readahead(DmmapFile* file, size_t offset, size_t length);
+static uint64_t dmmap__now_ns(void);
+static int dmmap__stats_enabled(void);
+static void dmmap__stats_open(const DmmapFile* file, const uint64_t* marks);
+static void dmmap__stats_unmap(uint64_t start);
+static void dmmap__stats_add(DmmapState* state, size_t counter, uint64_t value);
+static void dmmap__profile_track(const DmmapState* state);
+
+#ifdef _WIN32
+#include <windows.h>
+#include <winioctl.h>
+#include <psapi.h>
+
+// Alignment of the offsets that views can be mapped at
+static size_t dmmap__map_granularity(void)
+{
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwAllocationGranularity;
+}
+
+// Reads a whole small file into a pooled buffer, `file` stays open
+static DmmapFile dmmap__read_handle(HANDLE file, size_t size)
+{
+    DmmapFile result = {0};
+    char* buffer = (char*)dmmap__pool_get(size);
+    if (!buffer)
+        return result;
+
+    size_t done = 0;
+    while (done < size)
+    {
+        DWORD got = 0;
+        if (!ReadFile(file, buffer + done, (DWORD)(size - done), &got, NULL) || got == 0)
+        {
+            dmmap__pool_put(buffer, size);
+            return result;
+        }
+        done += got;
+    }
+
+    result.data = buffer;
+    result.size = size;
+    result.backend = DMMAP_BACKEND_BUFFER;
+    return result;
+}
+
+// Maps `size` bytes of `file`, `file` stays open
+static DmmapFile dmmap__map_handle(HANDLE file, size_t size, int read_only)
+{
+    DmmapFile result = {0};
+    DWORD protect = read_only ? PAGE_READONLY : PAGE_READWRITE;
+    DWORD map_access = read_only ? FILE_MAP_READ : FILE_MAP_WRITE;
+
+    HANDLE map = CreateFileMapping(file, NULL, protect, 0, (DWORD)size, NULL);
+    if (!map)
+        return result;
+
+    void* data = MapViewOfFile(map, map_access, 0, 0, size);
+    if (!data)
+    {
+        CloseHandle(map);
+        return result;
+    }
+
+    result.data = data;
+    result.size = size;
+    result.fd = (uintptr_t)map; // Storing map handle as uintptr_t
+    return result;
+}
+
+// Reads a source that cannot be mapped (pipe, console) to its end, `file` stays open
+static DmmapFile dmmap__stream_handle(HANDLE file)
+{
+    DmmapFile result = {0};
+    size_t capacity = DMMAP_STREAM_INITIAL_SIZE;
+    char* data = (char*)VirtualAlloc(NULL, capacity, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    if (!data)
+        return result;
+
+    size_t size = 0;
+    for (;;)
+    {
+        if (size == capacity)
+        {
+            char* grown = (char*)VirtualAlloc(NULL, capacity * 2, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+            if (!grown)
+            {
+                VirtualFree(data, 0, MEM_RELEASE);
+                return result;
+            }
+            memcpy(grown, data, size);
+            VirtualFree(data, 0, MEM_RELEASE);
+            data = grown;
+            capacity *= 2;
+        }
+
+        DWORD chunk = (capacity - size) > 0x40000000u ? 0x40000000u : (DWORD)(capacity - size);
+        DWORD got = 0;
+        if (!ReadFile(file, data + size, chunk, &got, NULL))
+        {
+            // The writing end of a pipe going away is its end of file
+            if (GetLastError() == ERROR_BROKEN_PIPE)
+                break;
+            VirtualFree(data, 0, MEM_RELEASE);
+            return result;
+        }
+        if (got == 0)
+            break;
+        size += got;
+    }
+
+    if (size == 0)
+    {
+        VirtualFree(data, 0, MEM_RELEASE);
+        return result;
+    }
+
+    DWORD old;
+    VirtualProtect(data, size, PAGE_READONLY, &old);
+    result.data = data;
+    result.size = size;
+    result.backend = DMMAP_BACKEND_ANON;
+    return result;
+}
+
+DmmapFile dmmap_file_open(const char* filename, int read_only)
+{
+    DmmapFile result = {0};
+    DWORD access = read_only ? GENERIC_READ : GENERIC_READ | GENERIC_WRITE;
+
+    // Before opening, sizing, mapping and after, when counting
+    uint64_t marks[4] = {0};
+    int timed = dmmap__stats_enabled();
+    if (timed)
+        marks[0] = dmmap__now_ns();
+
+    HANDLE file = CreateFileA(filename, access, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return result;
+    if (timed)
+        marks[1] = dmmap__now_ns();
+
+    if (GetFileType(file) != FILE_TYPE_DISK)
+    {
+        if (read_only)
+            result = dmmap__stream_handle(file);
+        CloseHandle(file);
+        return result;
+    }
+
+    DWORD fileSize = GetFileSize(file, NULL);
+    if (timed)
+        marks[2] = dmmap__now_ns();
+    if (read_only && fileSize > 0 && fileSize <= dmmap__small_file_threshold)
+        result = dmmap__read_handle(file, fileSize);
+
+    if (!result.data)
+        result = dmmap__map_handle(file, fileSize, read_only);
+    if (timed)
+        marks[3] = dmmap__now_ns();
+
+    CloseHandle(file);
+    dmmap__registry_add(&result, filename);
+    if (timed)
+        dmmap__stats_open(&result, marks);
+    return result;
+}
+
+DmmapFile dmmap_file_open_stdin(void)
+{
+    DmmapFile result = {0};
+    HANDLE input = GetStdHandle(STD_INPUT_HANDLE);
+    if (input == NULL || input == INVALID_HANDLE_VALUE)
+        return result;
+
+    if (GetFileType(input) != FILE_TYPE_DISK)
+        return dmmap__stream_handle(input);
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(input, &size) || size.QuadPart == 0)
+        return result;
+
+    // A redirected file may be partly read already, map the rest from the current position
+    // the way `dmmap_file_open_range` maps its window
+    LARGE_INTEGER zero = {0};
+    LARGE_INTEGER position = {0};
+    if (SetFilePointerEx(input, zero, &position, FILE_CURRENT) && position.QuadPart > 0)
+    {
+        if (position.QuadPart >= size.QuadPart)
+            return result;
+
+        HANDLE map = CreateFileMapping(input, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (!map)
+            return result;
+
+        uint64_t offset = (uint64_t)position.QuadPart;
+        size_t length = (size_t)(size.QuadPart - position.QuadPart);
+        uint64_t delta = offset % dmmap__map_granularity();
+        uint64_t base = offset - delta;
+        char* data = (char*)MapViewOfFile(map, FILE_MAP_READ, (DWORD)(base >> 32), (DWORD)base, length + (size_t)delta);
+        if (!data)
+        {
+            CloseHandle(map);
+            return result;
+        }
+
+        result.data = data + delta;
+        result.size = length;
+        result.fd = (uintptr_t)map;
+        result.offset = offset;
+        dmmap__registry_add(&result, NULL);
+        return result;
+    }
+
+    result = dmmap__map_handle(input, (size_t)size.QuadPart, 1);
+    dmmap__registry_add(&result, NULL);
+    return result;
+}
+
+// Fills `info` for an open file or volume handle
+static int dmmap__handle_info(HANDLE file, DmmapDeviceInfo* info)
+{
+    memset(info, 0, sizeof(*info));
+    if (GetFileType(file) != FILE_TYPE_DISK)
+        return 0;
+
+    GET_LENGTH_INFORMATION length;
+    DISK_GEOMETRY geometry;
+    DWORD got;
+    if (DeviceIoControl(file, IOCTL_DISK_GET_LENGTH_INFO, NULL, 0, &length, sizeof(length), &got, NULL))
+    {
+        info->size = (uint64_t)length.Length.QuadPart;
+        info->logical_sector_size = 512;
+        if (DeviceIoControl(file, IOCTL_DISK_GET_DRIVE_GEOMETRY, NULL, 0, &geometry, sizeof(geometry), &got, NULL))
+            info->logical_sector_size = geometry.BytesPerSector;
+        info->physical_sector_size = info->logical_sector_size;
+        info->is_block_device = 1;
+        return 1;
+    }
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size))
+        return 0;
+    info->size = (uint64_t)size.QuadPart;
+    info->logical_sector_size = 1;
+    info->physical_sector_size = 1;
+    return 1;
+}
+
+int dmmap_device_info(const char* filename, DmmapDeviceInfo* info)
+{
+    HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING,
+                              FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return 0;
+
+    int ret = dmmap__handle_info(file, info);
+    CloseHandle(file);
+    return ret;
+}
+
+DmmapFile dmmap_file_open_range(const char* filename, int read_only, uint64_t offset, size_t length)
+{
+    DmmapFile result = {0};
+    DWORD access = read_only ? GENERIC_READ : GENERIC_READ | GENERIC_WRITE;
+    DWORD protect = read_only ? PAGE_READONLY : PAGE_READWRITE;
+    DWORD map_access = read_only ? FILE_MAP_READ : FILE_MAP_WRITE;
+
+    HANDLE file = CreateFileA(filename, access, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING,
+                              FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return result;
+
+    DmmapDeviceInfo info;
+    if (!dmmap__handle_info(file, &info) || offset >= info.size)
+    {
+        CloseHandle(file);
+        return result;
+    }
+
+    if (length == 0)
+        length = (size_t)(info.size - offset);
+    uint64_t end = offset + length;
+    if (end > info.size || offset % info.logical_sector_size != 0 ||
+        (end != info.size && end % info.logical_sector_size != 0))
+    {
+        CloseHandle(file);
+        return result;
+    }
+
+    HANDLE map = CreateFileMapping(file, NULL, protect, 0, 0, NULL);
+    CloseHandle(file);
+    if (!map)
+        return result;
+
+    uint64_t delta = offset % dmmap__map_granularity();
+    uint64_t base = offset - delta;
+    char* data = (char*)MapViewOfFile(map, map_access, (DWORD)(base >> 32), (DWORD)base, length + (size_t)delta);
+    if (!data)
+    {
+        CloseHandle(map);
+        return result;
+    }
+
+    result.data = data + delta;
+    result.size = length;
+    result.fd = (uintptr_t)map;
+    result.offset = offset;
+    dmmap__registry_add(&result, filename);
+    return result;
+}
+
+void dmmap_file_close(DmmapFile* file)
+{
+    if (file->data)
+    {
+        if (file->state)
+            dmmap__registry_remove(file);
+
+        if (file->backend == DMMAP_BACKEND_BUFFER)
+            dmmap__pool_put(file->data, file->size);
+        else if (file->backend == DMMAP_BACKEND_ANON)
+            VirtualFree(file->data, 0, MEM_RELEASE);
+        else
+        {
+            uint64_t start = dmmap__stats_enabled() ? dmmap__now_ns() : 0;
+
+            // Windows of `dmmap_file_open_range` start inside their view
+            UnmapViewOfFile((char*)file->data - (uintptr_t)file->data % dmmap__map_granularity());
+            CloseHandle((HANDLE)file->fd);
+            if (start)
+                dmmap__stats_unmap(start);
+        }
+        file->data = NULL;
+        file->size = 0;
+        file->fd = 0;
+        file->backend = DMMAP_BACKEND_MMAP;
+        file->offset = 0;
+        file->state = NULL;
+    }
+}
+
+DmmapFile dmmap_file_create(const char* filename, size_t size)
+{
+    DmmapFile result = {0};
+    if (size == 0)
+        return result;
+
+    HANDLE file = CreateFileA(filename, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return result;
+
+    // The mapping object extends the new file to the requested size
+    HANDLE map = CreateFileMapping(file, NULL, PAGE_READWRITE, (DWORD)((uint64_t)size >> 32), (DWORD)size, NULL);
+    if (!map)
+    {
+        CloseHandle(file);
+        return result;
+    }
+
+    void* data = MapViewOfFile(map, FILE_MAP_WRITE, 0, 0, size);
+    if (!data)
+    {
+        CloseHandle(map);
+        CloseHandle(file);
+        return result;
+    }
+
+    result.data = data;
+    result.size = size;
+    result.fd = (uintptr_t)map;
+    CloseHandle(file);
+    dmmap__registry_add(&result, filename);
+    return result;
+}
+
+#else // POSIX (Linux, macOS)
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <linux/fs.h>
+#include <sys/syscall.h>
+#endif
+#ifdef __APPLE__
+#include <sys/disk.h>
+#endif
+
+// The header leaves the feature macros of its includer alone, so strict C modes
+// (`-std=c11`) hide the POSIX and Linux extensions used below. Take the constants from
+// the kernel headers and declare the few functions glibc then keeps back
+#ifdef __linux__
+#include <time.h>
+#if !defined(MADV_DONTNEED) || !defined(MAP_ANONYMOUS)
+#include <linux/mman.h>
+#endif
+#ifndef CLOCK_MONOTONIC
+#define CLOCK_MONOTONIC 1
+#endif
+#ifdef __GLIBC__
+#ifndef __USE_MISC
+int madvise(void* addr, size_t length, int advice);
+int mincore(void* addr, size_t length, unsigned char* vec);
+long syscall(long number, ...);
+#endif
+#ifndef __USE_POSIX199309
+int clock_gettime(__clockid_t clock, struct timespec* ts);
+int nanosleep(const struct timespec* request, struct timespec* remaining);
+#endif
+#if !defined(__USE_UNIX98) && !defined(__USE_XOPEN2K8)
+#ifdef __USE_FILE_OFFSET64
+ssize_t pread(int fd, void* buffer, size_t count, __off64_t offset) __asm__("pread64");
+#else
+ssize_t pread(int fd, void* buffer, size_t count, __off_t offset);
+#endif
+#endif
+#if !defined(__USE_XOPEN_EXTENDED) && !defined(__USE_XOPEN2K)
+#ifdef __USE_FILE_OFFSET64
+int ftruncate(int fd, __off64_t length) __asm__("ftruncate64");
+#else
+int ftruncate(int fd, __off_t length);
+#endif
+#endif
+#endif
+#endif
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+#ifndef MREMAP_MAYMOVE
+#define MREMAP_MAYMOVE 1
+#endif
+
+// Linux 5.14, faults a range in without touching it page by page
+#ifndef MADV_POPULATE_READ
+#define MADV_POPULATE_READ 22
+#endif
+
+static void dmmap__advise(DmmapFile* file, int advice);
+
+// glibc only declares O_DIRECT with _GNU_SOURCE, its value depends on the architecture
+#if defined(__linux__) && !defined(O_DIRECT)
+#if defined(__x86_64__) || defined(__i386__)
+#define O_DIRECT 040000
+#elif defined(__aarch64__) || defined(__arm__)
+#define O_DIRECT 0200000
+#endif
+#endif
+
+// Reads a whole small file into a pooled buffer, `fd` stays open
+static DmmapFile dmmap__read_fd(int fd, size_t size)
+{
+    DmmapFile result = {0};
+    char* buffer = (char*)dmmap__pool_get(size);
+    if (!buffer)
+        return result;
+
+    size_t done = 0;
+    while (done < size)
+    {
+        ssize_t got = pread(fd, buffer + done, size - done, (off_t)done);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+        {
+            dmmap__pool_put(buffer, size);
+            return result;
+        }
+        done += (size_t)got;
+    }
+
+    result.data = buffer;
+    result.size = size;
+    result.backend = DMMAP_BACKEND_BUFFER;
+    return result;
+}
+
+// Maps `size` bytes of `fd`, takes ownership of `fd` and closes it on failure
+static DmmapFile dmmap__map_fd(int fd, int read_only, size_t size)
+{
+    DmmapFile result = {0};
+    int prot = read_only ? PROT_READ : PROT_READ | PROT_WRITE;
+    void* data = mmap(NULL, size, prot, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED)
+    {
+        close(fd);
+        return result;
+    }
+
+    result.data = data;
+    result.size = size;
+    result.fd = fd;
+    return result;
+}
+
+// Grows an anonymous mapping, moving it if needed, returns MAP_FAILED on failure
+static char* dmmap__anon_grow(char* data, size_t size, size_t capacity, size_t new_capacity)
+{
+#if defined(__linux__) && defined(SYS_mremap)
+    (void)size;
+    return (char*)syscall(SYS_mremap, data, capacity, new_capacity, MREMAP_MAYMOVE);
+#else
+    char* grown = (char*)mmap(NULL, new_capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (grown != (char*)MAP_FAILED)
+    {
+        memcpy(grown, data, size);
+        munmap(data, capacity);
+    }
+    return grown;
+#endif
+}
+
+// Reads a source that cannot be mapped (pipe, socket, procfs) to its end, `fd` stays open
+static DmmapFile dmmap__stream_fd(int fd)
+{
+    DmmapFile result = {0};
+    size_t capacity = DMMAP_STREAM_INITIAL_SIZE;
+    char* data = (char*)mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (data == (char*)MAP_FAILED)
+        return result;
+
+    size_t size = 0;
+    for (;;)
+    {
+        if (size == capacity)
+        {
+            char* grown = dmmap__anon_grow(data, size, capacity, capacity * 2);
+            if (grown == (char*)MAP_FAILED)
+            {
+                munmap(data, capacity);
+                return result;
+            }
+            data = grown;
+            capacity *= 2;
+        }
+
+        ssize_t got = read(fd, data + size, capacity - size);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got < 0)
+        {
+            munmap(data, capacity);
+            return result;
+        }
+        if (got == 0)
+            break;
+        size += (size_t)got;
+    }
+
+    if (size == 0)
+    {
+        munmap(data, capacity);
+        return result;
+    }
+
+    // Give the unused tail back so that closing only needs `size`
+    size_t page = dmmap__page_size();
+    size_t used = (size + page - 1) & ~(page - 1);
+    if (used < capacity)
+        munmap(data + used, capacity - used);
+    mprotect(data, used, PROT_READ);
+
+    result.data = data;
+    result.size = size;
+    result.backend = DMMAP_BACKEND_ANON;
+    return result;
+}
+
+// Fills `info` for an open file or block device described by `sb`
+static int dmmap__fd_info(int fd, const struct stat* sb, DmmapDeviceInfo* info)
+{
+    memset(info, 0, sizeof(*info));
+    if (S_ISREG(sb->st_mode))
+    {
+        info->size = (uint64_t)sb->st_size;
+        info->logical_sector_size = 1;
+        info->physical_sector_size = 1;
+        return 1;
+    }
+    if (!S_ISBLK(sb->st_mode))
+        return 0;
+
+#if defined(__linux__)
+    int logical = 0;
+    unsigned int physical = 0;
+    if (ioctl(fd, BLKGETSIZE64, &info->size) == -1 || ioctl(fd, BLKSSZGET, &logical) == -1)
+        return 0;
+    if (ioctl(fd, BLKPBSZGET, &physical) == -1)
+        physical = (unsigned int)logical;
+    info->logical_sector_size = (uint32_t)logical;
+    info->physical_sector_size = (uint32_t)physical;
+#elif defined(__APPLE__)
+    uint64_t count = 0;
+    uint32_t block_size = 0;
+    if (ioctl(fd, DKIOCGETBLOCKCOUNT, &count) == -1 || ioctl(fd, DKIOCGETBLOCKSIZE, &block_size) == -1)
+        return 0;
+    info->size = count * block_size;
+    info->logical_sector_size = block_size;
+    info->physical_sector_size = block_size;
+#ifdef DKIOCGETPHYSICALBLOCKSIZE
+    ioctl(fd, DKIOCGETPHYSICALBLOCKSIZE, &info->physical_sector_size);
+#endif
+#else
+    (void)fd;
+    return 0;
+#endif
+
+    info->is_block_device = 1;
+    return info->logical_sector_size != 0;
+}
+
+// Opens a file described by `sb` the way its kind and size call for, takes ownership of `fd`
+static DmmapFile dmmap__open_fd(int fd, int read_only, const struct stat* sb)
+{
+    // fstat reports 0 for block devices, their size comes from the driver
+    if (S_ISBLK(sb->st_mode))
+    {
+        DmmapFile result = {0};
+        DmmapDeviceInfo info;
+        if (!dmmap__fd_info(fd, sb, &info) || info.size == 0 || info.size > SIZE_MAX)
+        {
+            close(fd);
+            return result;
+        }
+        return dmmap__map_fd(fd, read_only, (size_t)info.size);
+    }
+
+    // Pipes, sockets, terminals and procfs files have nothing to map, read them instead
+    if (!S_ISREG(sb->st_mode) || sb->st_size == 0)
+    {
+        DmmapFile result = {0};
+        if (read_only)
+            result = dmmap__stream_fd(fd);
+        close(fd);
+        return result;
+    }
+
+    if (read_only && S_ISREG(sb->st_mode) && sb->st_size > 0 && (uint64_t)sb->st_size <= dmmap__small_file_threshold)
+    {
+        DmmapFile result = dmmap__read_fd(fd, (size_t)sb->st_size);
+        if (result.data)
+        {
+            close(fd);
+            return result;
+        }
+    }
+
+    return dmmap__map_fd(fd, read_only, (size_t)sb->st_size);
+}
+
+DmmapFile dmmap_file_open(const char* filename, int read_only)
+{
+    DmmapFile result = {0};
+    int flags = read_only ? O_RDONLY : O_RDWR;
+
+    // Before open, fstat, mapping and after, when counting
+    uint64_t marks[4] = {0};
+    int timed = dmmap__stats_enabled();
+    if (timed)
+        marks[0] = dmmap__now_ns();
+
+    int fd = open(filename, flags);
+    if (fd == -1)
+        return result;
+    if (timed)
+        marks[1] = dmmap__now_ns();
+
+    struct stat sb;
+    if (fstat(fd, &sb) == -1)
+    {
+        close(fd);
+        return result;
+    }
+    if (timed)
+        marks[2] = dmmap__now_ns();
+
+    result = dmmap__open_fd(fd, read_only, &sb);
+    if (timed)
+        marks[3] = dmmap__now_ns();
+    dmmap__registry_add(&result, filename);
+    if (timed)
+        dmmap__stats_open(&result, marks);
+    return result;
+}
+
+DmmapFile dmmap_file_open_stdin(void)
+{
+    DmmapFile result = {0};
+    int fd = dup(STDIN_FILENO);
+    if (fd == -1)
+        return result;
+
+    struct stat sb;
+    if (fstat(fd, &sb) == -1)
+    {
+        close(fd);
+        return result;
+    }
+
+    // A redirected file may be partly read already, map the rest from the current position
+    // the way `dmmap_file_open_range` maps its window
+    off_t position = S_ISREG(sb.st_mode) ? lseek(fd, 0, SEEK_CUR) : 0;
+    if (position > 0)
+    {
+        if (position >= sb.st_size)
+        {
+            close(fd);
+            return result;
+        }
+
+        size_t length = (size_t)(sb.st_size - position);
+        size_t delta = (size_t)((uint64_t)position % dmmap__page_size());
+        char* data = (char*)mmap(NULL, length + delta, PROT_READ, MAP_SHARED, fd, position - (off_t)delta);
+        if (data == (char*)MAP_FAILED)
+        {
+            close(fd);
+            return result;
+        }
+
+        result.data = data + delta;
+        result.size = length;
+        result.fd = fd;
+        result.offset = (uint64_t)position;
+        dmmap__registry_add(&result, NULL);
+        return result;
+    }
+
+    result = dmmap__open_fd(fd, 1, &sb);
+    dmmap__registry_add(&result, NULL);
+    return result;
+}
+
+int dmmap_device_info(const char* filename, DmmapDeviceInfo* info)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1)
+        return 0;
+
+    struct stat sb;
+    int ret = fstat(fd, &sb) != -1 && dmmap__fd_info(fd, &sb, info);
+    close(fd);
+    return ret;
+}
+
+DmmapFile dmmap_file_open_range(const char* filename, int read_only, uint64_t offset, size_t length)
+{
+    DmmapFile result = {0};
+    int fd = open(filename, read_only ? O_RDONLY : O_RDWR);
+    if (fd == -1)
+        return result;
+
+    struct stat sb;
+    DmmapDeviceInfo info;
+    if (fstat(fd, &sb) == -1 || !dmmap__fd_info(fd, &sb, &info) || offset >= info.size)
+    {
+        close(fd);
+        return result;
+    }
+
+    if (length == 0)
+        length = (size_t)(info.size - offset);
+    uint64_t end = offset + length;
+    if (end > info.size || offset % info.logical_sector_size != 0 ||
+        (end != info.size && end % info.logical_sector_size != 0))
+    {
+        close(fd);
+        return result;
+    }
+
+    size_t delta = (size_t)(offset % dmmap__page_size());
+    int prot = read_only ? PROT_READ : PROT_READ | PROT_WRITE;
+    char* data = (char*)mmap(NULL, length + delta, prot, MAP_SHARED, fd, (off_t)(offset - delta));
+    if (data == (char*)MAP_FAILED)
+    {
+        close(fd);
+        return result;
+    }
+
+    result.data = data + delta;
+    result.size = length;
+    result.fd = fd;
+    result.offset = offset;
+    dmmap__registry_add(&result, filename);
+    return result;
+}
+
+void dmmap_file_close(DmmapFile* file)
+{
+    if (file->data)
+    {
+        if (file->state)
+            dmmap__registry_remove(file);
+
+        if (file->backend == DMMAP_BACKEND_BUFFER)
+            dmmap__pool_put(file->data, file->size);
+        else if (file->backend == DMMAP_BACKEND_ANON)
+            munmap(file->data, file->size);
+        else
+        {
+            uint64_t start = dmmap__stats_enabled() ? dmmap__now_ns() : 0;
+
+            // Windows of `dmmap_file_open_range` start inside their first page
+            size_t delta = (uintptr_t)file->data % dmmap__page_size();
+            munmap((char*)file->data - delta, file->size + delta);
+            close(file->fd);
+            if (start)
+                dmmap__stats_unmap(start);
+        }
+        file->data = NULL;
+        file->size = 0;
+        file->fd = 0;
+        file->backend = DMMAP_BACKEND_MMAP;
+        file->offset = 0;
+        file->state = NULL;
+    }
+}
+
+DmmapFile dmmap_file_create(const char* filename, size_t size)
+{
+    DmmapFile result = {0};
+    if (size == 0)
+        return result;
+
+    int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+        return result;
+
+    if (ftruncate(fd, (off_t)size) == -1)
+    {
+        close(fd);
+        return result;
+    }
+
+    void* data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED)
+    {
+        close(fd);
+        return result;
+    }
+
+    result.data = data;
+    result.size = size;
+    result.fd = fd;
+    dmmap__registry_add(&result, filename);
+    return result;
+}
+
+#endif
+
+// ***************************************************************************************
+// *  Shared helpers
+// ***************************************************************************************
+
+#if defined(__GNUC__) || defined(__clang__)
+#define DMMAP__PREFETCH(addr) __builtin_prefetch((const void*)(addr))
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <xmmintrin.h>
+#define DMMAP__PREFETCH(addr) _mm_prefetch((const char*)(addr), _MM_HINT_T0)
+#else
+#define DMMAP__PREFETCH(addr) ((void)(addr))
+#endif
+
+// Number of trailing zero bits, `x` must not be zero
+static unsigned dmmap__ctz64(uint64_t x)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return (unsigned)__builtin_ctzll(x);
+#else
+    unsigned n = 0;
+    while (!(x & 1))
+    {
+        x >>= 1;
+        ++n;
+    }
+    return n;
+#endif
+}
+
+// Floor of log2, `x` must not be zero
+static unsigned dmmap__log2_64(uint64_t x)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return 63u - (unsigned)__builtin_clzll(x);
+#else
+    unsigned n = 0;
+    while (x >>= 1)
+        ++n;
+    return n;
+#endif
+}
+
+// Monotonic clock in nanoseconds
+static uint64_t dmmap__now_ns(void)
+{
+#ifdef _WIN32
+    static LARGE_INTEGER frequency;
+    LARGE_INTEGER counter;
+    if (!frequency.QuadPart)
+        QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (uint64_t)((double)counter.QuadPart * 1e9 / (double)frequency.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+static void dmmap__sleep_ms(unsigned ms)
+{
+#ifdef _WIN32
+    Sleep(ms);
+#else
+    struct timespec ts;
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (long)(ms % 1000) * 1000000L;
+    while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+    {
+    }
+#endif
+}
+
+static size_t dmmap__page_size(void)
+{
+    static size_t page_size = 0;
+    if (!page_size)
+    {
+#ifdef _WIN32
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        page_size = info.dwPageSize;
+#else
+        page_size = (size_t)sysconf(_SC_PAGESIZE);
+#endif
+    }
+    return page_size;
+}
+
+// Starts asynchronous readahead of the pages covering `[addr, addr + len)` of a mapping
+static void dmmap__willneed(const void* addr, size_t len)
+{
+    uintptr_t page_mask = (uintptr_t)dmmap__page_size() - 1;
+    uintptr_t begin = (uintptr_t)addr & ~page_mask;
+    uintptr_t end = ((uintptr_t)addr + len + page_mask) & ~page_mask;
+
+#ifdef _WIN32
+#if _WIN32_WINNT >= 0x0602
+    WIN32_MEMORY_RANGE_ENTRY range;
+    range.VirtualAddress = (PVOID)begin;
+    range.NumberOfBytes = end - begin;
+    PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+#else
+    (void)begin;
+    (void)end;
+#endif
+#else
+    madvise((void*)begin, end - begin, MADV_WILLNEED);
+#endif
+}
+
+// Writes one byte per page of `[addr, addr + pages * page size)`, 1 for resident pages; `addr` is page aligned
+static int dmmap__residency(const void* addr, size_t pages, uint8_t* out)
+{
+#ifdef _WIN32
+    size_t page_size = dmmap__page_size();
+    PSAPI_WORKING_SET_EX_INFORMATION info[64];
+    for (size_t done = 0; done < pages; done += 64)
+    {
+        size_t batch = pages - done < 64 ? pages - done : 64;
+        for (size_t i = 0; i < batch; ++i)
+            info[i].VirtualAddress = (PVOID)((const char*)addr + (done + i) * page_size);
+
+        if (!QueryWorkingSetEx(GetCurrentProcess(), info, (DWORD)(batch * sizeof(info[0]))))
+            return 0;
+
+        for (size_t i = 0; i < batch; ++i)
+            out[done + i] = (uint8_t)info[i].VirtualAttributes.Valid;
+    }
+#else
+#ifdef __APPLE__
+    if (mincore((void*)addr, pages * dmmap__page_size(), (char*)out) == -1)
+#else
+    if (mincore((void*)addr, pages * dmmap__page_size(), (unsigned char*)out) == -1)
+#endif
+        return 0;
+
+    for (size_t i = 0; i < pages; ++i)
+        out[i] &= 1;
+#endif
+    return 1;
+}
+
+// ***************************************************************************************
+// *  Threads and atomics
+// ***************************************************************************************
+
+#if defined(_MSC_VER) && !defined(__clang__)
+#define DMMAP__ATOMIC_ADD(ptr, value) ((uint64_t)InterlockedExchangeAdd64((volatile LONG64*)(ptr), (LONG64)(value)))
+#define DMMAP__ATOMIC_LOAD(ptr) ((uint64_t)InterlockedCompareExchange64((volatile LONG64*)(ptr), 0, 0))
+#define DMMAP__ATOMIC_STORE(ptr, value) ((void)InterlockedExchange64((volatile LONG64*)(ptr), (LONG64)(value)))
+#define DMMAP__THREAD_LOCAL __declspec(thread)
+#else
+#define DMMAP__ATOMIC_ADD(ptr, value) __atomic_fetch_add((ptr), (value), __ATOMIC_SEQ_CST)
+#define DMMAP__ATOMIC_LOAD(ptr) __atomic_load_n((ptr), __ATOMIC_ACQUIRE)
+#define DMMAP__ATOMIC_STORE(ptr, value) __atomic_store_n((ptr), (value), __ATOMIC_RELEASE)
+#define DMMAP__THREAD_LOCAL __thread
+#endif
+
+typedef void (*DmmapThreadFn)(void* arg);
+
+typedef struct DmmapThreadStart
+{
+    DmmapThreadFn fn;
+    void* arg;
+} DmmapThreadStart;
+
+#ifdef _WIN32
+typedef HANDLE DmmapThread;
+typedef SRWLOCK DmmapMutex;
+typedef CONDITION_VARIABLE DmmapCond;
+#define DMMAP__MUTEX_INIT SRWLOCK_INIT
+
+static DWORD WINAPI dmmap__thread_main(LPVOID param)
+{
+    DmmapThreadStart start = *(DmmapThreadStart*)param;
+    free(param);
+    start.fn(start.arg);
+    return 0;
+}
+
+static int dmmap__thread_start(DmmapThread* thread, DmmapThreadFn fn, void* arg)
+{
+    DmmapThreadStart* start = (DmmapThreadStart*)malloc(sizeof(*start));
+    if (!start)
+        return 0;
+
+    start->fn = fn;
+    start->arg = arg;
+    *thread = CreateThread(NULL, 0, dmmap__thread_main, start, 0, NULL);
+    if (!*thread)
+    {
+        free(start);
+        return 0;
+    }
+    return 1;
+}
+
+static void dmmap__thread_join(DmmapThread thread)
+{
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+}
+
+static void dmmap__mutex_init(DmmapMutex* mutex)
+{
+    InitializeSRWLock(mutex);
+}
+
+static void dmmap__mutex_lock(DmmapMutex* mutex)
+{
+    AcquireSRWLockExclusive(mutex);
+}
+
+static void dmmap__mutex_unlock(DmmapMutex* mutex)
+{
+    ReleaseSRWLockExclusive(mutex);
+}
+
+static void dmmap__mutex_destroy(DmmapMutex* mutex)
+{
+    (void)mutex;
+}
+
+static void dmmap__cond_init(DmmapCond* cond)
+{
+    InitializeConditionVariable(cond);
+}
+
+static void dmmap__cond_wait(DmmapCond* cond, DmmapMutex* mutex)
+{
+    SleepConditionVariableSRW(cond, mutex, INFINITE, 0);
+}
+
+static void dmmap__cond_broadcast(DmmapCond* cond)
+{
+    WakeAllConditionVariable(cond);
+}
+
+static void dmmap__cond_destroy(DmmapCond* cond)
+{
+    (void)cond;
+}
+#else
+typedef pthread_t DmmapThread;
+typedef pthread_mutex_t DmmapMutex;
+typedef pthread_cond_t DmmapCond;
+#define DMMAP__MUTEX_INIT PTHREAD_MUTEX_INITIALIZER
+
+static void* dmmap__thread_main(void* param)
+{
+    DmmapThreadStart start = *(DmmapThreadStart*)param;
+    free(param);
+    start.fn(start.arg);
+    return NULL;
+}
+
+static int dmmap__thread_start(DmmapThread* thread, DmmapThreadFn fn, void* arg)
+{
+    DmmapThreadStart* start = (DmmapThreadStart*)malloc(sizeof(*start));
+    if (!start)
+        return 0;
+
+    start->fn = fn;
+    start->arg = arg;
+    if (pthread_create(thread, NULL, dmmap__thread_main, start) != 0)
+    {
+        free(start);
+        return 0;
+    }
+    return 1;
+}
+
+static void dmmap__thread_join(DmmapThread thread)
+{
+    pthread_join(thread, NULL);
+}
+
+static void dmmap__mutex_init(DmmapMutex* mutex)
+{
+    pthread_mutex_init(mutex, NULL);
+}
+
+static void dmmap__mutex_lock(DmmapMutex* mutex)
+{
+    pthread_mutex_lock(mutex);
+}
+
+static void dmmap__mutex_unlock(DmmapMutex* mutex)
+{
+    pthread_mutex_unlock(mutex);
+}
+
+static void dmmap__mutex_destroy(DmmapMutex* mutex)
+{
+    pthread_mutex_destroy(mutex);
+}
+
+static void dmmap__cond_init(DmmapCond* cond)
+{
+    pthread_cond_init(cond, NULL);
+}
+
+static void dmmap__cond_wait(DmmapCond* cond, DmmapMutex* mutex)
+{
+    pthread_cond_wait(cond, mutex);
+}
+
+static void dmmap__cond_broadcast(DmmapCond* cond)
+{
+    pthread_cond_broadcast(cond);
+}
+
+static void dmmap__cond_destroy(DmmapCond* cond)
+{
+    pthread_cond_destroy(cond);
+}
+#endif
+
+// ***************************************************************************************
+// *  io_uring (Linux, opt-in with DMMAP_USE_IO_URING)
+// ***************************************************************************************
+
+#if defined(__linux__) && defined(DMMAP_USE_IO_URING)
+#include <linux/io_uring.h>
+#include <linux/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#define DMMAP__HAS_IO_URING 1
+
+// Hidden in strict C modes
+#ifndef AT_FDCWD
+#define AT_FDCWD -100
+#endif
+
+// glibc only declares it with _GNU_SOURCE
+#ifndef AT_EMPTY_PATH
+#define AT_EMPTY_PATH 0x1000
+#endif
+
+// A minimal submission/completion ring on top of the raw system calls, used by one thread at a time
+typedef struct DmmapUring
+{
+    int fd;
+    unsigned entries;
+    unsigned sq_tail;
+    unsigned* sq_head_ptr;
+    unsigned* sq_tail_ptr;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head_ptr;
+    unsigned* cq_tail_ptr;
+    unsigned* cq_mask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    void* sq_ring;
+    void* cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+} DmmapUring;
+
+static void dmmap__uring_free(DmmapUring* ring)
+{
+    if (ring->sqes)
+        munmap(ring->sqes, ring->entries * sizeof(struct io_uring_sqe));
+    if (ring->cq_ring && ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    if (ring->sq_ring)
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    if (ring->fd > 0)
+        close(ring->fd);
+    memset(ring, 0, sizeof(*ring));
+}
+
+static int dmmap__uring_init(DmmapUring* ring, unsigned entries)
+{
+    struct io_uring_params params;
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+
+    int fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (fd < 0)
+        return 0;
+
+    ring->fd = fd;
+    ring->entries = params.sq_entries;
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (ring->cq_ring_size > ring->sq_ring_size)
+            ring->sq_ring_size = ring->cq_ring_size;
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                         IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED)
+    {
+        ring->sq_ring = NULL;
+        dmmap__uring_free(ring);
+        return 0;
+    }
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        ring->cq_ring = ring->sq_ring;
+    else
+    {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                             IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED)
+        {
+            ring->cq_ring = NULL;
+            dmmap__uring_free(ring);
+            return 0;
+        }
+    }
+
+    void* sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED)
+    {
+        dmmap__uring_free(ring);
+        return 0;
+    }
+
+    char* sq = (char*)ring->sq_ring;
+    char* cq = (char*)ring->cq_ring;
+    ring->sqes = (struct io_uring_sqe*)sqes;
+    ring->sq_head_ptr = (unsigned*)(sq + params.sq_off.head);
+    ring->sq_tail_ptr = (unsigned*)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(sq + params.sq_off.array);
+    ring->cq_head_ptr = (unsigned*)(cq + params.cq_off.head);
+    ring->cq_tail_ptr = (unsigned*)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    ring->sq_tail = *ring->sq_tail_ptr;
+    return 1;
+}
+
+// Next free submission entry, zeroed, or NULL when the submission queue is full
+static struct io_uring_sqe* dmmap__uring_sqe(DmmapUring* ring)
+{
+    unsigned head = DMMAP__ATOMIC_LOAD(ring->sq_head_ptr);
+    if (ring->sq_tail - head >= ring->entries)
+        return NULL;
+
+    unsigned index = ring->sq_tail & *ring->sq_mask;
+    ring->sq_array[index] = index;
+    ++ring->sq_tail;
+
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+// Publishes the queued entries and waits for at least `wait` completions. The kernel may
+// consume only part of the queue, the rest is resubmitted until none is left. Fails when
+// it stops making progress, the caller would otherwise wait for completions that never come.
+static int dmmap__uring_submit(DmmapUring* ring, unsigned wait)
+{
+    DMMAP__ATOMIC_STORE(ring->sq_tail_ptr, ring->sq_tail);
+    for (;;)
+    {
+        unsigned pending = ring->sq_tail - DMMAP__ATOMIC_LOAD(ring->sq_head_ptr);
+        int ret = (int)syscall(__NR_io_uring_enter, ring->fd, pending, wait, wait ? IORING_ENTER_GETEVENTS : 0,
+                               NULL, 0);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0)
+            return 0;
+        if ((unsigned)ret >= pending)
+            return 1;
+        if (ret == 0)
+            return 0;
+    }
+}
+
+// Pops one completion, returns 0 when the completion queue is empty
+static int dmmap__uring_cqe(DmmapUring* ring, uint64_t* user_data, int* res)
+{
+    unsigned head = *ring->cq_head_ptr;
+    if (head == DMMAP__ATOMIC_LOAD(ring->cq_tail_ptr))
+        return 0;
+
+    const struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cq_mask];
+    *user_data = cqe->user_data;
+    *res = cqe->res;
+    DMMAP__ATOMIC_STORE(ring->cq_head_ptr, head + 1);
+    return 1;
+}
+#endif
+
+// ***************************************************************************************
+// *  Search layouts for sorted keys
+// ***************************************************************************************
+
+#define DMMAP__LAYOUT_MAGIC 0x3159414c504d4d44ull // "DMMPLAY1"
+#define DMMAP__LAYOUT_HEADER_SIZE 4096           // keeps the key area page aligned
+
+typedef struct DmmapLayoutHeader
+{
+    uint64_t magic;
+    uint32_t kind;
+    uint32_t levels;
+    uint64_t count;
+    uint64_t node_keys;
+} DmmapLayoutHeader;
+
+// Rank of eytzinger slot `k` in sorted order, for a tree of `levels` levels holding `n` keys
+static uint64_t dmmap__eytzinger_rank(uint64_t k, uint64_t n, uint32_t levels)
+{
+    unsigned depth = dmmap__log2_64(k);
+    uint64_t full = ((2 * (k - ((uint64_t)1 << depth)) + 1) << (levels - 1 - depth)) - 1;
+
+    // Slots of the last level are filled from the left, skip the missing ones before `full`
+    uint64_t last_level = n - (((uint64_t)1 << (levels - 1)) - 1);
+    uint64_t leaves_before = (full + 1) / 2;
+    return leaves_before > last_level ? full - (leaves_before - last_level) : full;
+}
+
+// Number of keys in `node` that are less than `key` (branchless lower bound)
+static size_t dmmap__node_rank(const uint64_t* node, size_t len, uint64_t key)
+{
+    const uint64_t* base = node;
+    while (len > 1)
+    {
+        size_t half = len / 2;
+        base = (base[half] < key) ? base + half : base;
+        len -= half;
+    }
+    return (size_t)(base - node) + (*base < key);
+}
+
+// Fills `level_size` (leaves first) and returns the number of levels of the B+ tree
+static uint32_t dmmap__btree_levels(uint64_t count, uint64_t* level_size)
+{
+    const uint64_t B = DMMAP_LAYOUT_BTREE_KEYS;
+    uint32_t levels = 1;
+    level_size[0] = (count + B - 1) / B;
+    while (level_size[levels - 1] > 1 && levels < DMMAP_LAYOUT_MAX_LEVELS)
+    {
+        level_size[levels] = (level_size[levels - 1] + B) / (B + 1);
+        ++levels;
+    }
+    return levels;
+}
+
+int dmmap_layout_build(const DmmapFile* sorted_keys, const char* out_filename, DmmapLayoutKind kind)
+{
+    const uint64_t* src = (const uint64_t*)sorted_keys->data;
+    uint64_t n = sorted_keys->size / sizeof(uint64_t);
+    if (!src || n == 0)
+        return 0;
+
+    DmmapLayoutHeader header = {DMMAP__LAYOUT_MAGIC, (uint32_t)kind, 0, n, 0};
+    uint64_t level_size[DMMAP_LAYOUT_MAX_LEVELS];
+    uint64_t slots;
+
+    if (kind == DMMAP_LAYOUT_EYTZINGER)
+    {
+        header.levels = dmmap__log2_64(n) + 1;
+        header.node_keys = 1;
+        slots = n + 1; // slot 0 is unused, the root lives in slot 1
+    }
+    else if (kind == DMMAP_LAYOUT_BTREE)
+    {
+        header.levels = dmmap__btree_levels(n, level_size);
+        header.node_keys = DMMAP_LAYOUT_BTREE_KEYS;
+        if (level_size[header.levels - 1] != 1)
+            return 0;
+
+        slots = 0;
+        for (uint32_t j = 0; j < header.levels; ++j)
+            slots += level_size[j] * DMMAP_LAYOUT_BTREE_KEYS;
+    }
+    else
+        return 0;
+
+    DmmapFile out = dmmap_file_create(out_filename, DMMAP__LAYOUT_HEADER_SIZE + slots * sizeof(uint64_t));
+    if (!out.data)
+        return 0;
+
+    memcpy(out.data, &header, sizeof(header));
+    uint64_t* dst = (uint64_t*)((char*)out.data + DMMAP__LAYOUT_HEADER_SIZE);
+
+    if (kind == DMMAP_LAYOUT_EYTZINGER)
+    {
+        for (uint64_t k = 1; k <= n; ++k)
+            dst[k] = src[dmmap__eytzinger_rank(k, n, header.levels)];
+    }
+    else
+    {
+        const uint64_t B = DMMAP_LAYOUT_BTREE_KEYS;
+
+        // Levels are stored from the root down to the leaves
+        uint64_t offset = 0;
+        for (uint32_t j = header.levels; j-- > 0;)
+        {
+            uint64_t* level = dst + offset * B;
+            offset += level_size[j];
+
+            if (j == 0)
+            {
+                for (uint64_t i = 0; i < level_size[0] * B; ++i)
+                    level[i] = i < n ? src[i] : UINT64_MAX;
+                continue;
+            }
+
+            // Leaves below one child of this level, (B + 1)^(j - 1)
+            uint64_t subtree_leaves = 1;
+            for (uint32_t l = 1; l < j; ++l)
+                subtree_leaves *= B + 1;
+
+            // Key `i` of a node is the smallest key below its child `i + 1`
+            for (uint64_t node = 0; node < level_size[j]; ++node)
+            {
+                for (uint64_t i = 0; i < B; ++i)
+                {
+                    uint64_t first = (node * (B + 1) + i + 1) * subtree_leaves * B;
+                    level[node * B + i] = first < n ? src[first] : UINT64_MAX;
+                }
+            }
+        }
+    }
+
+    dmmap_file_close(&out);
+    return 1;
+}
+
+// Validates the header of a mapped layout file and fills the search parameters of `layout`
+static int dmmap__layout_parse(DmmapLayout* layout, const DmmapFile* file)
+{
+    DmmapLayoutHeader header;
+    if (file->size < DMMAP__LAYOUT_HEADER_SIZE)
+        return 0;
+
+    memcpy(&header, file->data, sizeof(header));
+    if (header.magic != DMMAP__LAYOUT_MAGIC || header.count == 0 || header.levels == 0)
+        return 0;
+
+    uint64_t slots = (file->size - DMMAP__LAYOUT_HEADER_SIZE) / sizeof(uint64_t);
+    if (header.kind == DMMAP_LAYOUT_EYTZINGER)
+    {
+        if (header.levels != dmmap__log2_64(header.count) + 1 || slots < header.count + 1)
+            return 0;
+    }
+    else if (header.kind == DMMAP_LAYOUT_BTREE && header.node_keys == DMMAP_LAYOUT_BTREE_KEYS)
+    {
+        uint64_t level_size[DMMAP_LAYOUT_MAX_LEVELS];
+        if (dmmap__btree_levels(header.count, level_size) != header.levels)
+            return 0;
+
+        uint64_t offset = 0;
+        for (uint32_t j = header.levels; j-- > 0;)
+        {
+            layout->level_offset[j] = offset;
+            offset += level_size[j];
+        }
+        if (slots < offset * DMMAP_LAYOUT_BTREE_KEYS)
+            return 0;
+    }
+    else
+        return 0;
+
+    layout->keys = (const uint64_t*)((const char*)file->data + DMMAP__LAYOUT_HEADER_SIZE);
+    layout->count = header.count;
+    layout->kind = header.kind;
+    layout->levels = header.levels;
+    return 1;
+}
+
+int dmmap_layout_open(DmmapLayout* layout, const char* filename)
+{
+    memset(layout, 0, sizeof(*layout));
+
+    DmmapFile file = dmmap_file_open(filename, 1);
+    if (!file.data)
+        return 0;
+
+    if (!dmmap__layout_parse(layout, &file))
+    {
+        dmmap_file_close(&file);
+        memset(layout, 0, sizeof(*layout));
+        return 0;
+    }
+
+#ifndef _WIN32
+    // Lookups jump around, readahead around each fault would only pull in unrelated keys
+    dmmap__advise(&file, MADV_RANDOM);
+#endif
+
+    layout->file = file;
+    return 1;
+}
+
+uint64_t dmmap_layout_lower_bound(const DmmapLayout* layout, uint64_t key)
+{
+    const uint64_t* keys = layout->keys;
+    uint64_t n = layout->count;
+
+    if (layout->kind == DMMAP_LAYOUT_EYTZINGER)
+    {
+        uint64_t k = 1;
+        while (k <= n)
+        {
+            // The 8 descendants three levels down share one cache line
+            DMMAP__PREFETCH(keys + 8 * k);
+            k = 2 * k + (keys[k] < key);
+        }
+
+        // Drop the trailing right turns and the last left turn to reach the answer
+        k >>= dmmap__ctz64(~k) + 1;
+        return k ? dmmap__eytzinger_rank(k, n, layout->levels) : n;
+    }
+
+    const uint64_t B = DMMAP_LAYOUT_BTREE_KEYS;
+    uint64_t node = 0;
+    for (uint32_t j = layout->levels - 1; j > 0; --j)
+    {
+        node = node * (B + 1) + dmmap__node_rank(keys + (layout->level_offset[j] + node) * B, B, key);
+        DMMAP__PREFETCH(keys + (layout->level_offset[j - 1] + node) * B + B / 2);
+    }
+
+    uint64_t rank = node * B + dmmap__node_rank(keys + (layout->level_offset[0] + node) * B, B, key);
+    return rank < n ? rank : n;
+}
+
+void dmmap_layout_close(DmmapLayout* layout)
+{
+    dmmap_file_close(&layout->file);
+    memset(layout, 0, sizeof(*layout));
+}
+
+// ***************************************************************************************
+// *  Learned index for sorted keys
+// ***************************************************************************************
+
+#define DMMAP__PGM_MAGIC 0x314d4750504d4d44ull // "DMMPPGM1"
+#define DMMAP__PGM_HEADER_SIZE 64
+
+typedef struct DmmapPgmHeader
+{
+    uint64_t magic;
+    uint64_t epsilon;
+    uint64_t count;
+    uint64_t max_gap;
+    uint64_t size;
+} DmmapPgmHeader;
+
+// One pass "shrinking cone" fitting, a segment grows while one slope keeps every point within epsilon
+typedef struct DmmapPgmBuilder
+{
+    DmmapPgmSegment* segments;
+    uint64_t count;
+    uint64_t capacity;
+    uint64_t epsilon;
+    uint64_t max_gap;
+    uint64_t last_key;
+    uint64_t last_position;
+    double slope_min;
+    double slope_max;
+    int sorted;
+} DmmapPgmBuilder;
+
+static void dmmap__pgm_close_segment(DmmapPgmBuilder* builder)
+{
+    DmmapPgmSegment* segment = &builder->segments[builder->count - 1];
+    if (builder->slope_max == HUGE_VAL)
+        segment->slope = builder->slope_min;
+    else
+        segment->slope = (builder->slope_min + builder->slope_max) / 2;
+}
+
+static int dmmap__pgm_add(DmmapPgmBuilder* builder, uint64_t key, uint64_t position)
+{
+    if (builder->count > 0)
+    {
+        if (key < builder->last_key)
+        {
+            builder->sorted = 0;
+            return 0;
+        }
+        if (position - builder->last_position > builder->max_gap)
+            builder->max_gap = position - builder->last_position;
+
+        const DmmapPgmSegment* segment = &builder->segments[builder->count - 1];
+        double dx = (double)(key - segment->key);
+        double dy = (double)(position - segment->position);
+        double eps = (double)builder->epsilon;
+
+        builder->last_key = key;
+        builder->last_position = position;
+
+        if (dx == 0)
+        {
+            if (dy <= eps)
+                return 1;
+        }
+        else
+        {
+            double low = (dy - eps) / dx;
+            double high = (dy + eps) / dx;
+            if (low < builder->slope_min)
+                low = builder->slope_min;
+            if (high > builder->slope_max)
+                high = builder->slope_max;
+
+            if (low <= high)
+            {
+                builder->slope_min = low;
+                builder->slope_max = high;
+                return 1;
+            }
+        }
+
+        dmmap__pgm_close_segment(builder);
+    }
+
+    if (builder->count == builder->capacity)
+    {
+        uint64_t capacity = builder->capacity ? builder->capacity * 2 : 64;
+        DmmapPgmSegment* segments = (DmmapPgmSegment*)realloc(builder->segments, capacity * sizeof(*segments));
+        if (!segments)
+            return 0;
+
+        builder->segments = segments;
+        builder->capacity = capacity;
+    }
+
+    DmmapPgmSegment* segment = &builder->segments[builder->count++];
+    segment->key = key;
+    segment->position = position;
+    segment->slope = 0;
+
+    builder->last_key = key;
+    builder->last_position = position;
+    builder->slope_min = 0;
+    builder->slope_max = HUGE_VAL;
+    return 1;
+}
+
+static int dmmap__pgm_finish(DmmapPgmBuilder* builder, uint64_t size, const char* sidecar)
+{
+    int ok = 0;
+    if (builder->sorted && builder->count > 0)
+    {
+        dmmap__pgm_close_segment(builder);
+        if (size - builder->last_position > builder->max_gap)
+            builder->max_gap = size - builder->last_position;
+
+        DmmapPgmHeader header = {DMMAP__PGM_MAGIC, builder->epsilon, builder->count, builder->max_gap, size};
+        size_t segments_size = (size_t)builder->count * sizeof(DmmapPgmSegment);
+
+        DmmapFile out = dmmap_file_create(sidecar, DMMAP__PGM_HEADER_SIZE + segments_size);
+        if (out.data)
+        {
+            memcpy(out.data, &header, sizeof(header));
+            memcpy((char*)out.data + DMMAP__PGM_HEADER_SIZE, builder->segments, segments_size);
+            dmmap_file_close(&out);
+            ok = 1;
+        }
+    }
+
+    free(builder->segments);
+    return ok;
+}
+
+int dmmap_pgm_build(const DmmapFile* sorted_keys, const char* sidecar, uint64_t epsilon)
+{
+    const uint64_t* keys = (const uint64_t*)sorted_keys->data;
+    uint64_t n = sorted_keys->size / sizeof(uint64_t);
+    if (!keys || n == 0)
+        return 0;
+
+    DmmapPgmBuilder builder = {NULL, 0, 0, epsilon, 0, 0, 0, 0, 0, 1};
+    for (uint64_t i = 0; i < n; ++i)
+    {
+        if (!dmmap__pgm_add(&builder, keys[i], i))
+            break;
+    }
+
+    return dmmap__pgm_finish(&builder, n, sidecar);
+}
+
+int dmmap_pgm_build_text(const DmmapFile* text, const char* sidecar, uint64_t epsilon)
+{
+    const char* data = (const char*)text->data;
+    if (!data || text->size == 0)
+        return 0;
+
+    DmmapPgmBuilder builder = {NULL, 0, 0, epsilon, 0, 0, 0, 0, 0, 1};
+    size_t pos = 0;
+    while (pos < text->size)
+    {
+        size_t line = pos;
+        uint64_t key = 0;
+        int digits = 0;
+        while (pos < text->size && data[pos] >= '0' && data[pos] <= '9')
+        {
+            key = key * 10 + (uint64_t)(data[pos++] - '0');
+            digits = 1;
+        }
+
+        if (digits && !dmmap__pgm_add(&builder, key, line))
+            break;
+
+        const char* newline = (const char*)memchr(data + pos, '\n', text->size - pos);
+        pos = newline ? (size_t)(newline - data) + 1 : text->size;
+    }
+
+    return dmmap__pgm_finish(&builder, text->size, sidecar);
+}
+
+int dmmap_pgm_open(DmmapPgm* pgm, const char* sidecar)
+{
+    memset(pgm, 0, sizeof(*pgm));
+
+    DmmapFile file = dmmap_file_open(sidecar, 1);
+    if (!file.data)
+        return 0;
+
+    DmmapPgmHeader header;
+    if (file.size >= DMMAP__PGM_HEADER_SIZE)
+        memcpy(&header, file.data, sizeof(header));
+
+    if (file.size < DMMAP__PGM_HEADER_SIZE || header.magic != DMMAP__PGM_MAGIC || header.count == 0 ||
+        (file.size - DMMAP__PGM_HEADER_SIZE) / sizeof(DmmapPgmSegment) < header.count)
+    {
+        dmmap_file_close(&file);
+        return 0;
+    }
+
+    pgm->file = file;
+    pgm->segments = (const DmmapPgmSegment*)((const char*)file.data + DMMAP__PGM_HEADER_SIZE);
+    pgm->count = header.count;
+    pgm->epsilon = header.epsilon;
+    pgm->max_gap = header.max_gap;
+    pgm->size = header.size;
+    return 1;
+}
+
+DmmapRange dmmap_pgm_search(const DmmapPgm* pgm, uint64_t key)
+{
+    // The segment is the last one starting below `key`, equal keys may continue from the previous one
+    uint64_t lo = 0, hi = pgm->count;
+    while (lo < hi)
+    {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (pgm->segments[mid].key < key)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    uint64_t index = lo ? lo - 1 : 0;
+
+    const DmmapPgmSegment* segment = &pgm->segments[index];
+    uint64_t limit = index + 1 < pgm->count ? pgm->segments[index + 1].position : pgm->size;
+    uint64_t predicted = segment->position;
+    if (key > segment->key)
+    {
+        double offset = segment->slope * (double)(key - segment->key);
+        predicted = offset >= (double)(limit - segment->position) ? limit : segment->position + (uint64_t)offset;
+    }
+
+    // One extra position on both sides absorbs floating point rounding
+    DmmapRange range;
+    range.begin = predicted > pgm->epsilon + 1 ? predicted - pgm->epsilon - 1 : 0;
+    range.end = predicted + pgm->epsilon + pgm->max_gap + 1;
+    if (range.end > pgm->size)
+        range.end = pgm->size;
+    return range;
+}
+
+// The predicted window clamped to `size` positions of the searched file. A stale or
+// foreign model is not trusted at all and the whole file is searched instead.
+static DmmapRange dmmap__pgm_window(const DmmapPgm* pgm, uint64_t key, uint64_t size)
+{
+    DmmapRange range = {0, size};
+    if (pgm->size == size)
+        range = dmmap_pgm_search(pgm, key);
+    if (range.end > size)
+        range.end = size;
+    if (range.begin > range.end)
+        range.begin = range.end;
+    return range;
+}
+
+uint64_t dmmap_pgm_lower_bound(const DmmapPgm* pgm, const DmmapFile* sorted_keys, uint64_t key)
+{
+    const uint64_t* keys = (const uint64_t*)sorted_keys->data;
+    DmmapRange range = dmmap__pgm_window(pgm, key, sorted_keys->size / sizeof(uint64_t));
+
+    uint64_t lo = range.begin, hi = range.end;
+    while (lo < hi)
+    {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (keys[mid] < key)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+uint64_t dmmap_pgm_find_line(const DmmapPgm* pgm, const DmmapFile* text, uint64_t key)
+{
+    const char* data = (const char*)text->data;
+    DmmapRange range = dmmap__pgm_window(pgm, key, text->size);
+
+    // The prediction can land inside a line, step back to its start
+    size_t pos = (size_t)range.begin;
+    while (pos > 0 && data[pos - 1] != '\n')
+        --pos;
+
+    while (pos < text->size)
+    {
+        size_t line = pos;
+        uint64_t value = 0;
+        int digits = 0;
+        while (pos < text->size && data[pos] >= '0' && data[pos] <= '9')
+        {
+            value = value * 10 + (uint64_t)(data[pos++] - '0');
+            digits = 1;
+        }
+
+        if (digits && value >= key)
+            return line;
+
+        const char* newline = (const char*)memchr(data + pos, '\n', text->size - pos);
+        pos = newline ? (size_t)(newline - data) + 1 : text->size;
+    }
+    return text->size;
+}
+
+void dmmap_pgm_close(DmmapPgm* pgm)
+{
+    dmmap_file_close(&pgm->file);
+    memset(pgm, 0, sizeof(*pgm));
+}
+
+// ***************************************************************************************
+// *  Batched lookups
+// ***************************************************************************************
+
+static void dmmap__eytzinger_batch(const DmmapLayout* layout, const uint64_t* keys, size_t count, uint64_t* ranks,
+                                   unsigned flags)
+{
+    const uint64_t* slots = layout->keys;
+    uint64_t n = layout->count;
+    uint64_t k[DMMAP_BATCH_GROUP];
+
+    // Slots from this one on no longer share a page with the root
+    uint64_t willneed_from = (flags & DMMAP_BATCH_WILLNEED) ? dmmap__page_size() / sizeof(uint64_t) : UINT64_MAX;
+
+    for (size_t g = 0; g < count; ++g)
+        k[g] = 1;
+
+    for (uint32_t level = 0; level < layout->levels; ++level)
+    {
+        for (size_t g = 0; g < count; ++g)
+        {
+            if (k[g] > n)
+                continue;
+
+            k[g] = 2 * k[g] + (slots[k[g]] < keys[g]);
+            if (k[g] <= n)
+            {
+                DMMAP__PREFETCH(slots + k[g]);
+                if (k[g] >= willneed_from)
+                    dmmap__willneed(slots + k[g], sizeof(uint64_t));
+            }
+        }
+    }
+
+    for (size_t g = 0; g < count; ++g)
+    {
+        uint64_t slot = k[g] >> (dmmap__ctz64(~k[g]) + 1);
+        ranks[g] = slot ? dmmap__eytzinger_rank(slot, n, layout->levels) : n;
+    }
+}
+
+static void dmmap__btree_batch(const DmmapLayout* layout, const uint64_t* keys, size_t count, uint64_t* ranks,
+                               unsigned flags)
+{
+    const size_t B = DMMAP_LAYOUT_BTREE_KEYS;
+    const uint64_t* base[DMMAP_BATCH_GROUP];
+    uint64_t node[DMMAP_BATCH_GROUP];
+
+    for (size_t g = 0; g < count; ++g)
+        node[g] = 0;
+
+    for (uint32_t j = layout->levels; j-- > 0;)
+    {
+        const uint64_t* level = layout->keys + layout->level_offset[j] * B;
+        for (size_t g = 0; g < count; ++g)
+            base[g] = level + node[g] * B;
+
+        // Bisect all nodes of the group together, prefetching each next probe
+        size_t len = B;
+        while (len > 1)
+        {
+            size_t half = len / 2;
+            for (size_t g = 0; g < count; ++g)
+            {
+                base[g] = (base[g][half] < keys[g]) ? base[g] + half : base[g];
+                DMMAP__PREFETCH(base[g] + (len - half) / 2);
+            }
+            len -= half;
+        }
+
+        const uint64_t* below = j > 0 ? layout->keys + layout->level_offset[j - 1] * B : NULL;
+        for (size_t g = 0; g < count; ++g)
+        {
+            uint64_t i = (uint64_t)(base[g] - level) % B + (*base[g] < keys[g]);
+            if (!below)
+            {
+                uint64_t rank = node[g] * B + i;
+                ranks[g] = rank < layout->count ? rank : layout->count;
+                continue;
+            }
+
+            node[g] = node[g] * (B + 1) + i;
+            const uint64_t* next = below + node[g] * B;
+            DMMAP__PREFETCH(next + B / 2);
+            if (flags & DMMAP_BATCH_WILLNEED)
+                dmmap__willneed(next, B * sizeof(uint64_t));
+        }
+    }
+}
+
+void dmmap_layout_lower_bound_batch(const DmmapLayout* layout, const uint64_t* keys, size_t count, uint64_t* ranks,
+                                    unsigned flags)
+{
+    for (size_t done = 0; done < count; done += DMMAP_BATCH_GROUP)
+    {
+        size_t group = count - done < DMMAP_BATCH_GROUP ? count - done : DMMAP_BATCH_GROUP;
+        if (layout->kind == DMMAP_LAYOUT_EYTZINGER)
+            dmmap__eytzinger_batch(layout, keys + done, group, ranks + done, flags);
+        else
+            dmmap__btree_batch(layout, keys + done, group, ranks + done, flags);
+    }
+}
+
+void dmmap_pgm_lower_bound_batch(const DmmapPgm* pgm, const DmmapFile* sorted_keys, const uint64_t* keys,
+                                 size_t count, uint64_t* ranks, unsigned flags)
+{
+    const uint64_t* data = (const uint64_t*)sorted_keys->data;
+    uint64_t n = sorted_keys->size / sizeof(uint64_t);
+    DmmapRange range[DMMAP_BATCH_GROUP];
+
+    for (size_t done = 0; done < count; done += DMMAP_BATCH_GROUP)
+    {
+        size_t group = count - done < DMMAP_BATCH_GROUP ? count - done : DMMAP_BATCH_GROUP;
+
+        for (size_t g = 0; g < group; ++g)
+        {
+            range[g] = dmmap__pgm_window(pgm, keys[done + g], n);
+            const uint64_t* window = data + range[g].begin;
+            size_t len = (size_t)(range[g].end - range[g].begin);
+            DMMAP__PREFETCH(window + len / 2);
+            if (flags & DMMAP_BATCH_WILLNEED)
+                dmmap__willneed(window, len * sizeof(uint64_t));
+        }
+
+        for (size_t g = 0; g < group; ++g)
+        {
+            uint64_t key = keys[done + g];
+            uint64_t lo = range[g].begin, hi = range[g].end;
+            while (lo < hi)
+            {
+                uint64_t mid = lo + (hi - lo) / 2;
+                if (data[mid] < key)
+                    lo = mid + 1;
+                else
+                    hi = mid;
+            }
+            ranks[done + g] = lo;
+        }
+    }
+}
+
+// ***************************************************************************************
+// *  Fault-aware interleaved lookups
+// ***************************************************************************************
+
+int dmmap_residency_cache_init(DmmapResidencyCache* cache, const void* data, size_t size)
+{
+    size_t pages = (size + dmmap__page_size() - 1) / dmmap__page_size();
+    cache->data = data;
+    cache->size = size;
+    cache->bits = (uint8_t*)calloc((pages + 7) / 8, 1);
+    return cache->bits != NULL;
+}
+
+void dmmap_residency_cache_free(DmmapResidencyCache* cache)
+{
+    free(cache->bits);
+    memset(cache, 0, sizeof(*cache));
+}
+
+int dmmap_is_resident(DmmapResidencyCache* cache, const void* addr)
+{
+    size_t page_size = dmmap__page_size();
+    const void* page = (const void*)((uintptr_t)addr & ~(uintptr_t)(page_size - 1));
+
+    size_t index = 0;
+    int cached = cache && cache->bits && (const char*)addr >= (const char*)cache->data &&
+                 (const char*)addr < (const char*)cache->data + cache->size;
+    if (cached)
+    {
+        index = ((uintptr_t)page - ((uintptr_t)cache->data & ~(uintptr_t)(page_size - 1))) / page_size;
+        if (cache->bits[index / 8] & (1u << (index % 8)))
+            return 1;
+    }
+
+    uint8_t resident = 0;
+    if (!dmmap__residency(page, 1, &resident))
+        return 1; // cannot tell, let the caller touch it
+
+    if (resident && cached)
+        cache->bits[index / 8] |= (uint8_t)(1u << (index % 8));
+    return resident;
+}
+
+// The suspended state of one lookup
+typedef struct DmmapLookup
+{
+    size_t index;   // position of the key in the batch
+    uint64_t node;  // eytzinger slot or B+ tree node
+    uint32_t level; // B+ tree level still to search
+    int waiting;    // readahead for the next page was requested
+} DmmapLookup;
+
+// Address the lookup touches next, NULL once it has its answer
+static const uint64_t* dmmap__lookup_next(const DmmapLayout* layout, const DmmapLookup* lookup)
+{
+    if (layout->kind == DMMAP_LAYOUT_EYTZINGER)
+        return lookup->node <= layout->count ? layout->keys + lookup->node : NULL;
+
+    if (lookup->level == UINT32_MAX)
+        return NULL;
+    return layout->keys + (layout->level_offset[lookup->level] + lookup->node) * DMMAP_LAYOUT_BTREE_KEYS;
+}
+
+static void dmmap__lookup_step(const DmmapLayout* layout, DmmapLookup* lookup, uint64_t key, uint64_t* rank)
+{
+    const uint64_t B = DMMAP_LAYOUT_BTREE_KEYS;
+    const uint64_t* next = dmmap__lookup_next(layout, lookup);
+
+    if (layout->kind == DMMAP_LAYOUT_EYTZINGER)
+    {
+        lookup->node = 2 * lookup->node + (*next < key);
+        if (lookup->node > layout->count)
+        {
+            uint64_t slot = lookup->node >> (dmmap__ctz64(~lookup->node) + 1);
+            *rank = slot ? dmmap__eytzinger_rank(slot, layout->count, layout->levels) : layout->count;
+        }
+        return;
+    }
+
+    uint64_t i = dmmap__node_rank(next, B, key);
+    if (lookup->level > 0)
+    {
+        lookup->node = lookup->node * (B + 1) + i;
+        --lookup->level;
+        return;
+    }
+
+    uint64_t found = lookup->node * B + i;
+    *rank = found < layout->count ? found : layout->count;
+    lookup->level = UINT32_MAX;
+}
+
+void dmmap_layout_lower_bound_interleaved(const DmmapLayout* layout, const uint64_t* keys, size_t count,
+                                          uint64_t* ranks, size_t inflight, DmmapResidencyCache* cache)
+{
+    DmmapLookup lookups[DMMAP_INFLIGHT_MAX];
+    DmmapResidencyCache local;
+    int own_cache = 0;
+
+    if (!cache)
+    {
+        own_cache = dmmap_residency_cache_init(&local, layout->file.data, layout->file.size);
+        cache = own_cache ? &local : NULL;
+    }
+
+    if (inflight == 0)
+        inflight = 1;
+    if (inflight > DMMAP_INFLIGHT_MAX)
+        inflight = DMMAP_INFLIGHT_MAX;
+
+    size_t started = 0, live = 0;
+    for (; live < inflight && started < count; ++live, ++started)
+    {
+        DmmapLookup start = {started, layout->kind == DMMAP_LAYOUT_EYTZINGER ? 1u : 0u, layout->levels - 1, 0};
+        lookups[live] = start;
+    }
+
+    while (live > 0)
+    {
+        int progress = 0;
+        for (size_t s = 0; s < live;)
+        {
+            DmmapLookup* lookup = &lookups[s];
+            const uint64_t* next = dmmap__lookup_next(layout, lookup);
+
+            // Run the lookup until it finishes or reaches a cold page
+            while (next && dmmap_is_resident(cache, next))
+            {
+                dmmap__lookup_step(layout, lookup, keys[lookup->index], &ranks[lookup->index]);
+                lookup->waiting = 0;
+                progress = 1;
+                next = dmmap__lookup_next(layout, lookup);
+            }
+
+            if (next)
+            {
+                if (!lookup->waiting)
+                {
+                    dmmap__willneed(next, layout->kind == DMMAP_LAYOUT_EYTZINGER ? sizeof(uint64_t)
+                                                                                 : DMMAP_LAYOUT_BTREE_KEYS * sizeof(uint64_t));
+                    lookup->waiting = 1;
+                }
+                ++s;
+                continue;
+            }
+
+            // Finished, the slot goes to the next key or the last live lookup
+            progress = 1;
+            if (started < count)
+            {
+                DmmapLookup start = {started++, layout->kind == DMMAP_LAYOUT_EYTZINGER ? 1u : 0u, layout->levels - 1, 0};
+                *lookup = start;
+            }
+            else
+                *lookup = lookups[--live];
+        }
+
+        // Everyone waits on I/O, the oldest lookup takes its fault so the batch always moves.
+        // Slots are refilled and swapped on removal, the smallest key index is the oldest
+        if (!progress && live > 0)
+        {
+            DmmapLookup* oldest = &lookups[0];
+            for (size_t s = 1; s < live; ++s)
+            {
+                if (lookups[s].index < oldest->index)
+                    oldest = &lookups[s];
+            }
+            dmmap__lookup_step(layout, oldest, keys[oldest->index], &ranks[oldest->index]);
+            oldest->waiting = 0;
+        }
+    }
+
+    if (own_cache)
+        dmmap_residency_cache_free(&local);
+}
+
+// ***************************************************************************************
+// *  Batch open
+// ***************************************************************************************
+
+struct DmmapOpenBatch
+{
+    const char* const* filenames;
+    size_t count;
+    int read_only;
+    DmmapFile* files;
+    DmmapOpenCallback callback;
+    void* user_data;
+    uint64_t next;
+    uint64_t opened;
+    uint64_t done;
+    int has_driver;
+    DmmapThread driver;
+};
+
+static void dmmap__open_batch_finish(DmmapOpenBatch* batch, size_t index)
+{
+    if (batch->files[index].data)
+        DMMAP__ATOMIC_ADD(&batch->opened, 1);
+    if (batch->callback)
+        batch->callback(batch->user_data, index, &batch->files[index]);
+}
+
+static void dmmap__open_batch_worker(void* arg)
+{
+    DmmapOpenBatch* batch = (DmmapOpenBatch*)arg;
+    for (;;)
+    {
+        uint64_t index = DMMAP__ATOMIC_ADD(&batch->next, 1);
+        if (index >= batch->count)
+            break;
+
+        batch->files[index] = dmmap_file_open(batch->filenames[index], batch->read_only);
+        dmmap__open_batch_finish(batch, (size_t)index);
+    }
+}
+
+#ifdef DMMAP__HAS_IO_URING
+#define DMMAP__OPEN_RING_ENTRIES 256
+
+// Submits `pending` queued entries and stores each result at its `user_data` index
+static int dmmap__open_batch_reap(DmmapUring* ring, size_t pending, int* results)
+{
+    int ok = dmmap__uring_submit(ring, (unsigned)pending);
+    while (ok && pending > 0)
+    {
+        uint64_t user_data;
+        int res;
+        if (!dmmap__uring_cqe(ring, &user_data, &res))
+        {
+            ok = dmmap__uring_submit(ring, 1);
+            continue;
+        }
+        results[user_data] = res;
+        --pending;
+    }
+    return ok;
+}
+
+static int dmmap__open_batch_uring(DmmapOpenBatch* batch)
+{
+    DmmapUring ring;
+    if (!dmmap__uring_init(&ring, DMMAP__OPEN_RING_ENTRIES))
+        return 0;
+
+    size_t chunk = ring.entries;
+    struct statx* stx = (struct statx*)malloc(chunk * sizeof(*stx));
+    int* fds = (int*)malloc(chunk * sizeof(int));
+    int* stats = (int*)malloc(chunk * sizeof(int));
+    if (!stx || !fds || !stats)
+    {
+        free(stx);
+        free(fds);
+        free(stats);
+        dmmap__uring_free(&ring);
+        return 0;
+    }
+
+    int flags = batch->read_only ? O_RDONLY : O_RDWR;
+    for (size_t base = 0; base < batch->count; base += chunk)
+    {
+        size_t n = batch->count - base < chunk ? batch->count - base : chunk;
+        int ok = 1;
+        for (size_t i = 0; i < n; ++i)
+        {
+            fds[i] = -1;
+            stats[i] = -1;
+        }
+
+        // Entries the kernel has not consumed yet can leave the queue full, treat that as a broken ring
+        for (size_t i = 0; ok && i < n; ++i)
+        {
+            struct io_uring_sqe* sqe = dmmap__uring_sqe(&ring);
+            if (!sqe)
+            {
+                ok = 0;
+                break;
+            }
+            sqe->opcode = IORING_OP_OPENAT;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = (uint64_t)(uintptr_t)batch->filenames[base + i];
+            sqe->open_flags = (uint32_t)flags;
+            sqe->user_data = i;
+        }
+        if (ok)
+            ok = dmmap__open_batch_reap(&ring, n, fds);
+
+        // The descriptors are stat'ed, not the paths, which may have been replaced meanwhile
+        size_t pending = 0;
+        for (size_t i = 0; ok && i < n; ++i)
+        {
+            if (fds[i] < 0)
+                continue;
+            struct io_uring_sqe* sqe = dmmap__uring_sqe(&ring);
+            if (!sqe)
+            {
+                ok = 0;
+                break;
+            }
+            sqe->opcode = IORING_OP_STATX;
+            sqe->fd = fds[i];
+            sqe->addr = (uint64_t)(uintptr_t)"";
+            sqe->statx_flags = AT_EMPTY_PATH;
+            sqe->len = STATX_TYPE | STATX_SIZE;
+            sqe->off = (uint64_t)(uintptr_t)&stx[i];
+            sqe->user_data = i;
+            ++pending;
+        }
+        if (ok && pending)
+            ok = dmmap__open_batch_reap(&ring, pending, stats);
+
+        for (size_t i = 0; i < n; ++i)
+        {
+            size_t index = base + i;
+            if (!ok || fds[i] == -EINVAL)
+            {
+                // The ring broke down or the kernel lacks these opcodes
+                if (fds[i] >= 0)
+                    close(fds[i]);
+                batch->files[index] = dmmap_file_open(batch->filenames[index], batch->read_only);
+            }
+            else if (fds[i] >= 0)
+            {
+                struct stat sb;
+                memset(&sb, 0, sizeof(sb));
+                if (stats[i] >= 0)
+                {
+                    sb.st_mode = stx[i].stx_mode;
+                    sb.st_size = (off_t)stx[i].stx_size;
+                }
+
+                if (stats[i] >= 0 || fstat(fds[i], &sb) == 0)
+                {
+                    batch->files[index] = dmmap__open_fd(fds[i], batch->read_only, &sb);
+                    dmmap__registry_add(&batch->files[index], batch->filenames[index]);
+                }
+                else
+                    close(fds[i]);
+            }
+
+            dmmap__open_batch_finish(batch, index);
+        }
+
+        if (!ok)
+        {
+            // Whatever is left goes through the regular path
+            for (size_t index = base + n; index < batch->count; ++index)
+            {
+                batch->files[index] = dmmap_file_open(batch->filenames[index], batch->read_only);
+                dmmap__open_batch_finish(batch, index);
+            }
+            break;
+        }
+    }
+
+    free(stx);
+    free(fds);
+    free(stats);
+    dmmap__uring_free(&ring);
+    return 1;
+}
+#endif
+
+static void dmmap__open_batch_run(DmmapOpenBatch* batch)
+{
+    for (size_t i = 0; i < batch->count; ++i)
+        memset(&batch->files[i], 0, sizeof(DmmapFile));
+
+#ifdef DMMAP__HAS_IO_URING
+    if (dmmap__open_batch_uring(batch))
+        return;
+#endif
+
+    DmmapThread workers[DMMAP_OPEN_THREADS];
+    size_t threads = batch->count < DMMAP_OPEN_THREADS ? batch->count : DMMAP_OPEN_THREADS;
+    size_t started = 0;
+
+    // The calling thread is one of the workers
+    for (size_t t = 1; t < threads; ++t)
+    {
+        if (dmmap__thread_start(&workers[started], dmmap__open_batch_worker, batch))
+            ++started;
+    }
+
+    dmmap__open_batch_worker(batch);
+    for (size_t t = 0; t < started; ++t)
+        dmmap__thread_join(workers[t]);
+}
+
+size_t dmmap_file_open_batch(const char* const* filenames, size_t count, int read_only, DmmapFile* files,
+                             DmmapOpenCallback callback, void* user_data)
+{
+    DmmapOpenBatch batch;
+    memset(&batch, 0, sizeof(batch));
+    batch.filenames = filenames;
+    batch.count = count;
+    batch.read_only = read_only;
+    batch.files = files;
+    batch.callback = callback;
+    batch.user_data = user_data;
+
+    dmmap__open_batch_run(&batch);
+    return (size_t)batch.opened;
+}
+
+static void dmmap__open_batch_driver(void* arg)
+{
+    DmmapOpenBatch* batch = (DmmapOpenBatch*)arg;
+    dmmap__open_batch_run(batch);
+    DMMAP__ATOMIC_STORE(&batch->done, 1);
+}
+
+DmmapOpenBatch* dmmap_file_open_batch_async(const char* const* filenames, size_t count, int read_only,
+                                            DmmapFile* files, DmmapOpenCallback callback, void* user_data)
+{
+    DmmapOpenBatch* batch = (DmmapOpenBatch*)calloc(1, sizeof(*batch));
+    if (!batch)
+        return NULL;
+
+    batch->filenames = filenames;
+    batch->count = count;
+    batch->read_only = read_only;
+    batch->files = files;
+    batch->callback = callback;
+    batch->user_data = user_data;
+
+    batch->has_driver = dmmap__thread_start(&batch->driver, dmmap__open_batch_driver, batch);
+    if (!batch->has_driver)
+        dmmap__open_batch_driver(batch);
+    return batch;
+}
+
+int dmmap_file_open_batch_ready(DmmapOpenBatch* batch)
+{
+    return DMMAP__ATOMIC_LOAD(&batch->done) != 0;
+}
+
+size_t dmmap_file_open_batch_wait(DmmapOpenBatch* batch)
+{
+    if (batch->has_driver)
+        dmmap__thread_join(batch->driver);
+
+    size_t opened = (size_t)batch->opened;
+    free(batch);
+    return opened;
+}
+
+// ***************************************************************************************
+// *  Streaming reader
+// ***************************************************************************************
+
+// State of the buffered backends, chunk `c` always lands in buffer `c % depth`
+typedef struct DmmapReaderBuffers
+{
+#ifdef _WIN32
+    HANDLE handle;
+#else
+    int fd;
+#endif
+    char* buffers;
+    size_t buffers_size;
+    size_t chunk_size;
+    uint64_t size;
+    unsigned depth;
+    uint64_t chunks;
+    uint64_t next_chunk;
+    int held;
+    int direct;
+    int64_t results[64];
+    uint8_t ready[64];
+#ifdef DMMAP__HAS_IO_URING
+    DmmapUring ring;
+    int use_ring;
+    int fixed;
+    uint64_t submitted;
+    unsigned inflight;
+#endif
+    // Read ahead by an I/O thread when there is no ring
+    int use_thread;
+    int stop;
+    uint64_t released;
+    DmmapThread thread;
+    DmmapMutex lock;
+    DmmapCond cond;
+} DmmapReaderBuffers;
+
+static size_t dmmap__chunk_length(const DmmapReaderBuffers* state, uint64_t chunk)
+{
+    uint64_t offset = chunk * state->chunk_size;
+    uint64_t left = state->size - offset;
+    return left < state->chunk_size ? (size_t)left : state->chunk_size;
+}
+
+// Direct I/O reads whole pages, the tail of the file comes back as a short read
+static size_t dmmap__request_length(const DmmapReaderBuffers* state, size_t len)
+{
+    if (!state->direct)
+        return len;
+    size_t page_size = dmmap__page_size();
+    return (len + page_size - 1) / page_size * page_size;
+}
+
+// Reads `len` bytes at `offset` synchronously, returns the number of bytes read or -1
+static int64_t dmmap__read_at(DmmapReaderBuffers* state, void* buffer, size_t len, uint64_t offset)
+{
+    size_t done = 0;
+    while (done < len)
+    {
+#ifdef _WIN32
+        OVERLAPPED overlapped;
+        memset(&overlapped, 0, sizeof(overlapped));
+        overlapped.Offset = (DWORD)(offset + done);
+        overlapped.OffsetHigh = (DWORD)((offset + done) >> 32);
+        DWORD got = 0;
+        if (!ReadFile(state->handle, (char*)buffer + done, (DWORD)(len - done), &got, &overlapped))
+            return -1;
+#else
+        ssize_t got = pread(state->fd, (char*)buffer + done, len - done, (off_t)(offset + done));
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got < 0)
+            return -1;
+#endif
+        if (got == 0)
+            break;
+        done += (size_t)got;
+
+        // A partial page under direct I/O is the end of the file
+        if (state->direct && done % dmmap__page_size() != 0)
+            break;
+    }
+    return (int64_t)done;
+}
+
+#ifdef DMMAP__HAS_IO_URING
+static void dmmap__reader_submit(DmmapReaderBuffers* state)
+{
+    uint64_t chunk = state->submitted++;
+    unsigned slot = (unsigned)(chunk % state->depth);
+
+    struct io_uring_sqe* sqe = dmmap__uring_sqe(&state->ring);
+    sqe->opcode = state->fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    sqe->fd = state->fd;
+    sqe->addr = (uint64_t)(uintptr_t)(state->buffers + (size_t)slot * state->chunk_size);
+    sqe->len = (uint32_t)dmmap__request_length(state, dmmap__chunk_length(state, chunk));
+    sqe->off = chunk * state->chunk_size;
+    sqe->buf_index = (uint16_t)slot;
+    sqe->user_data = chunk;
+    state->ready[slot] = 0;
+    ++state->inflight;
+}
+
+static int dmmap__reader_ring_open(DmmapReaderBuffers* state)
+{
+    if (!dmmap__uring_init(&state->ring, state->depth))
+        return 0;
+
+    struct iovec iov[64];
+    for (unsigned i = 0; i < state->depth; ++i)
+    {
+        iov[i].iov_base = state->buffers + (size_t)i * state->chunk_size;
+        iov[i].iov_len = state->chunk_size;
+    }
+    state->fixed = syscall(__NR_io_uring_register, state->ring.fd, IORING_REGISTER_BUFFERS, iov, state->depth) == 0;
+    state->use_ring = 1;
+
+    while (state->submitted < state->chunks && state->submitted < state->depth)
+        dmmap__reader_submit(state);
+    if (!dmmap__uring_submit(&state->ring, 0))
+    {
+        dmmap__uring_free(&state->ring);
+        state->use_ring = 0;
+        state->submitted = 0;
+        state->inflight = 0;
+        return 0;
+    }
+    return 1;
+}
+
+// Waits for `chunk` and returns the result of its read
+static int64_t dmmap__reader_ring_wait(DmmapReaderBuffers* state, uint64_t chunk)
+{
+    unsigned slot = (unsigned)(chunk % state->depth);
+    while (!state->ready[slot])
+    {
+        uint64_t user_data;
+        int res;
+        if (dmmap__uring_cqe(&state->ring, &user_data, &res))
+        {
+            state->results[user_data % state->depth] = res;
+            state->ready[user_data % state->depth] = 1;
+            --state->inflight;
+        }
+        else if (!dmmap__uring_submit(&state->ring, 1))
+            return -1;
+    }
+    return state->results[slot];
+}
+#endif
+
+// Reads every chunk into its buffer as soon as the consumer has released the buffer
+static void dmmap__reader_io_main(void* arg)
+{
+    DmmapReaderBuffers* state = (DmmapReaderBuffers*)arg;
+    for (uint64_t chunk = 0; chunk < state->chunks; ++chunk)
+    {
+        unsigned slot = (unsigned)(chunk % state->depth);
+
+        dmmap__mutex_lock(&state->lock);
+        while (!state->stop && chunk >= state->released + state->depth)
+            dmmap__cond_wait(&state->cond, &state->lock);
+        int stop = state->stop;
+        dmmap__mutex_unlock(&state->lock);
+        if (stop)
+            return;
+
+        size_t len = dmmap__request_length(state, dmmap__chunk_length(state, chunk));
+        int64_t got = dmmap__read_at(state, state->buffers + (size_t)slot * state->chunk_size, len,
+                                     chunk * state->chunk_size);
+
+        dmmap__mutex_lock(&state->lock);
+        state->results[slot] = got;
+        state->ready[slot] = 1;
+        dmmap__cond_broadcast(&state->cond);
+        dmmap__mutex_unlock(&state->lock);
+    }
+}
+
+static int dmmap__reader_thread_open(DmmapReaderBuffers* state)
+{
+    dmmap__mutex_init(&state->lock);
+    dmmap__cond_init(&state->cond);
+    if (!dmmap__thread_start(&state->thread, dmmap__reader_io_main, state))
+    {
+        dmmap__cond_destroy(&state->cond);
+        dmmap__mutex_destroy(&state->lock);
+        return 0;
+    }
+    state->use_thread = 1;
+    return 1;
+}
+
+// Hands the buffer of the last chunk back to the I/O thread and waits for `chunk`
+static int64_t dmmap__reader_thread_wait(DmmapReaderBuffers* state, uint64_t chunk)
+{
+    unsigned slot = (unsigned)(chunk % state->depth);
+
+    dmmap__mutex_lock(&state->lock);
+    if (state->held)
+    {
+        state->ready[state->released % state->depth] = 0;
+        ++state->released;
+        dmmap__cond_broadcast(&state->cond);
+    }
+    while (!state->ready[slot])
+        dmmap__cond_wait(&state->cond, &state->lock);
+    int64_t got = state->results[slot];
+    dmmap__mutex_unlock(&state->lock);
+    return got;
+}
+
+// Returns 1 on success, 0 on failure and -1 when the source cannot be read at offsets
+static int dmmap__reader_buffers_open(DmmapReader* reader, const char* filename, unsigned depth)
+{
+    DmmapReaderBuffers* state = (DmmapReaderBuffers*)calloc(1, sizeof(*state));
+    if (!state)
+        return 0;
+
+    state->depth = depth;
+    state->chunk_size = reader->chunk_size;
+    state->direct = reader->backend == DMMAP_READER_DIRECT;
+
+#ifdef _WIN32
+    DWORD flags = state->direct ? FILE_FLAG_NO_BUFFERING : FILE_FLAG_SEQUENTIAL_SCAN;
+    state->handle = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, flags, NULL);
+    if (state->handle != INVALID_HANDLE_VALUE && GetFileType(state->handle) != FILE_TYPE_DISK)
+    {
+        CloseHandle(state->handle);
+        free(state);
+        return -1;
+    }
+    LARGE_INTEGER size;
+    if (state->handle == INVALID_HANDLE_VALUE || !GetFileSizeEx(state->handle, &size))
+    {
+        if (state->handle != INVALID_HANDLE_VALUE)
+            CloseHandle(state->handle);
+        free(state);
+        return 0;
+    }
+    reader->size = (uint64_t)size.QuadPart;
+
+    state->buffers_size = (size_t)depth * reader->chunk_size;
+    state->buffers = (char*)VirtualAlloc(NULL, state->buffers_size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+    if (!state->buffers)
+    {
+        CloseHandle(state->handle);
+        free(state);
+        return 0;
+    }
+#else
+    struct stat sb;
+    state->fd = -1;
+#ifdef O_DIRECT
+    if (state->direct)
+        state->fd = open(filename, O_RDONLY | O_DIRECT);
+#endif
+    if (state->fd == -1)
+    {
+#ifdef __APPLE__
+        state->fd = open(filename, O_RDONLY);
+        if (state->fd != -1 && state->direct)
+            state->direct = fcntl(state->fd, F_NOCACHE, 1) != -1;
+#else
+        state->direct = 0;
+        state->fd = open(filename, O_RDONLY);
+#endif
+    }
+    if (state->fd == -1 || fstat(state->fd, &sb) == -1)
+    {
+        if (state->fd != -1)
+            close(state->fd);
+        free(state);
+        return 0;
+    }
+    if (!S_ISREG(sb.st_mode) || sb.st_size == 0)
+    {
+        close(state->fd);
+        free(state);
+        return -1;
+    }
+    reader->size = (uint64_t)sb.st_size;
+#ifdef POSIX_FADV_SEQUENTIAL
+    if (!state->direct)
+        posix_fadvise(state->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+    state->buffers_size = (size_t)depth * reader->chunk_size;
+    state->buffers = (char*)mmap(NULL, state->buffers_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (state->buffers == MAP_FAILED)
+    {
+        close(state->fd);
+        free(state);
+        return 0;
+    }
+#endif
+
+    state->size = reader->size;
+    state->chunks = (reader->size + reader->chunk_size - 1) / reader->chunk_size;
+    reader->impl = state;
+
+#ifdef DMMAP__HAS_IO_URING
+    if (dmmap__reader_ring_open(state))
+        return 1;
+#endif
+    if (reader->backend == DMMAP_READER_DIRECT)
+        dmmap__reader_thread_open(state);
+    return 1;
+}
+
+// Buffered reads went through the page cache, let go of what the scan has passed
+static void dmmap__reader_buffers_drop(DmmapReader* reader, DmmapReaderBuffers* state, uint64_t position)
+{
+#ifdef POSIX_FADV_DONTNEED
+    DmmapDropBehind* drop = &reader->drop;
+    if (state->direct || !drop->distance || drop->mode != DMMAP_DROP_DONTNEED ||
+        position < (uint64_t)drop->distance + drop->dropped + DMMAP_DROP_BEHIND_BATCH)
+        return;
+
+    uint64_t upto = position - drop->distance;
+    posix_fadvise(state->fd, (off_t)drop->dropped, (off_t)(upto - drop->dropped), POSIX_FADV_DONTNEED);
+    drop->dropped = (size_t)upto;
+#else
+    (void)reader;
+    (void)state;
+    (void)position;
+#endif
+}
+
+static int dmmap__reader_buffers_next(DmmapReader* reader, DmmapChunk* chunk)
+{
+    DmmapReaderBuffers* state = (DmmapReaderBuffers*)reader->impl;
+
+#ifdef DMMAP__HAS_IO_URING
+    // The buffer handed out last time is free again, refill it with the chunk `depth` ahead
+    if (state->use_ring && state->held && state->submitted < state->chunks)
+    {
+        dmmap__reader_submit(state);
+        if (!dmmap__uring_submit(&state->ring, 0))
+            return -1;
+    }
+#endif
+
+    uint64_t index = state->next_chunk;
+    if (index >= state->chunks)
+    {
+        state->held = 0;
+        return 0;
+    }
+
+    char* buffer = state->buffers + (size_t)(index % state->depth) * reader->chunk_size;
+    size_t len = dmmap__chunk_length(state, index);
+    uint64_t offset = index * reader->chunk_size;
+    int64_t got;
+
+    dmmap__reader_buffers_drop(reader, state, offset);
+
+    if (state->use_thread)
+        got = dmmap__reader_thread_wait(state, index);
+#ifdef DMMAP__HAS_IO_URING
+    else if (state->use_ring)
+    {
+        got = dmmap__reader_ring_wait(state, index);
+        if (got >= 0 && (size_t)got < len)
+        {
+            // Short read, finish the chunk synchronously
+            int64_t rest = dmmap__read_at(state, buffer + got, len - (size_t)got, offset + (uint64_t)got);
+            got = rest < 0 ? -1 : got + rest;
+        }
+    }
+#endif
+    else
+        got = dmmap__read_at(state, buffer, dmmap__request_length(state, len), offset);
+    state->held = 0;
+
+    // Whole page reads may pick up bytes appended since the open
+    if (got > (int64_t)len)
+        got = (int64_t)len;
+    if (got < 0)
+        return -1;
+    if (got == 0)
+        return 0;
+
+    chunk->data = buffer;
+    chunk->size = (size_t)got;
+    chunk->offset = offset;
+    state->next_chunk = index + 1;
+    state->held = 1;
+    return 1;
+}
+
+static void dmmap__reader_buffers_close(DmmapReaderBuffers* state)
+{
+    if (state->use_thread)
+    {
+        dmmap__mutex_lock(&state->lock);
+        state->stop = 1;
+        dmmap__cond_broadcast(&state->cond);
+        dmmap__mutex_unlock(&state->lock);
+        dmmap__thread_join(state->thread);
+        dmmap__cond_destroy(&state->cond);
+        dmmap__mutex_destroy(&state->lock);
+    }
+
+#ifdef DMMAP__HAS_IO_URING
+    if (state->use_ring)
+    {
+        // Reads still in flight target our buffers, drain them before unmapping
+        uint64_t user_data;
+        int res;
+        while (state->inflight > 0)
+        {
+            if (dmmap__uring_cqe(&state->ring, &user_data, &res))
+                --state->inflight;
+            else if (!dmmap__uring_submit(&state->ring, 1))
+                break;
+        }
+        dmmap__uring_free(&state->ring);
+    }
+#endif
+
+#ifdef _WIN32
+    VirtualFree(state->buffers, 0, MEM_RELEASE);
+    CloseHandle(state->handle);
+#else
+    munmap(state->buffers, state->buffers_size);
+    close(state->fd);
+#endif
+    free(state);
+}
+
+// Prefetch thread of a mapping reader, faults in what the consumer reads next
+typedef struct DmmapReaderPrefetch
+{
+    DmmapState* state; // Registry entry of the mapping, for the counters
+    const char* data;
+    uint64_t size;
+    size_t chunk_size;
+    size_t max_ahead;
+    uint64_t consumed;  // Offset the consumer has reached
+    uint64_t populated; // End of what was faulted in
+    int stop;
+    DmmapThread thread;
+    DmmapMutex lock;
+    DmmapCond cond;
+} DmmapReaderPrefetch;
+
+// Faults in `[begin, end)` of the mapping, page aligned
+static void dmmap__reader_prefetch_populate(const char* begin, const char* end)
+{
+#if defined(__linux__)
+    if (madvise((void*)begin, (size_t)(end - begin), MADV_POPULATE_READ) == 0)
+        return;
+#endif
+    size_t page_size = dmmap__page_size();
+    volatile char sink = 0;
+    for (const char* page = begin; page < end; page += page_size)
+        sink ^= *page;
+    (void)sink;
+}
+
+static void dmmap__reader_prefetch_main(void* arg)
+{
+    DmmapReaderPrefetch* state = (DmmapReaderPrefetch*)arg;
+    uintptr_t page_mask = (uintptr_t)dmmap__page_size() - 1;
+    size_t ahead = 2 * state->chunk_size < state->max_ahead ? 2 * state->chunk_size : state->max_ahead;
+    double rate = 0; // Bytes per second, smoothed
+    uint64_t last_time = dmmap__now_ns();
+    uint64_t last_consumed = 0;
+
+    dmmap__mutex_lock(&state->lock);
+    while (!state->stop)
+    {
+        uint64_t consumed = state->consumed;
+        if (state->populated < consumed)
+            state->populated = consumed;
+        uint64_t target = consumed + ahead < state->size ? consumed + ahead : state->size;
+        if (state->populated >= target)
+        {
+            dmmap__cond_wait(&state->cond, &state->lock);
+
+            // Measure the consumer, the window follows what it reads in DMMAP_READER_PREFETCH_MS
+            uint64_t now = dmmap__now_ns();
+            if (state->consumed > last_consumed && now > last_time)
+            {
+                double sample = (double)(state->consumed - last_consumed) * 1e9 / (double)(now - last_time);
+                rate = rate > 0 ? 0.75 * rate + 0.25 * sample : sample;
+                double wanted = rate * DMMAP_READER_PREFETCH_MS / 1000.0;
+                ahead = wanted < (double)state->max_ahead ? (size_t)wanted : state->max_ahead;
+                if (ahead < 2 * state->chunk_size)
+                    ahead = 2 * state->chunk_size < state->max_ahead ? 2 * state->chunk_size : state->max_ahead;
+                last_consumed = state->consumed;
+                last_time = now;
+            }
+            continue;
+        }
+
+        // Populate one chunk at a time without the lock, so the consumer never waits on it
+        uint64_t from = state->populated;
+        uint64_t to = target - from > state->chunk_size ? from + state->chunk_size : target;
+        dmmap__mutex_unlock(&state->lock);
+
+        uintptr_t begin = (uintptr_t)(state->data + from) & ~page_mask;
+        dmmap__reader_prefetch_populate((const char*)begin, state->data + to);
+        if (state->state)
+            dmmap__stats_add(state->state, offsetof(DmmapFileStats, bytes_prefetched), to - from);
+
+        dmmap__mutex_lock(&state->lock);
+        if (state->populated < to)
+            state->populated = to;
+    }
+    dmmap__mutex_unlock(&state->lock);
+}
+
+static DmmapReaderPrefetch* dmmap__reader_prefetch_open(DmmapReader* reader, size_t max_ahead)
+{
+    DmmapReaderPrefetch* state = (DmmapReaderPrefetch*)calloc(1, sizeof(*state));
+    if (!state)
+        return NULL;
+
+    state->state = reader->file.state;
+    state->data = (const char*)reader->file.data;
+    state->size = reader->size;
+    state->chunk_size = reader->chunk_size;
+    state->max_ahead = max_ahead;
+    dmmap__mutex_init(&state->lock);
+    dmmap__cond_init(&state->cond);
+    if (!dmmap__thread_start(&state->thread, dmmap__reader_prefetch_main, state))
+    {
+        // The reader works without, only with the faults
+        dmmap__cond_destroy(&state->cond);
+        dmmap__mutex_destroy(&state->lock);
+        free(state);
+        return NULL;
+    }
+    return state;
+}
+
+static void dmmap__reader_prefetch_advance(DmmapReaderPrefetch* state, uint64_t offset)
+{
+    dmmap__mutex_lock(&state->lock);
+    state->consumed = offset;
+    dmmap__cond_broadcast(&state->cond);
+    dmmap__mutex_unlock(&state->lock);
+}
+
+static void dmmap__reader_prefetch_close(DmmapReaderPrefetch* state)
+{
+    dmmap__mutex_lock(&state->lock);
+    state->stop = 1;
+    dmmap__cond_broadcast(&state->cond);
+    dmmap__mutex_unlock(&state->lock);
+
+    dmmap__thread_join(state->thread);
+    dmmap__cond_destroy(&state->cond);
+    dmmap__mutex_destroy(&state->lock);
+    free(state);
+}
+
+int dmmap_reader_open(DmmapReader* reader, const char* filename, const DmmapReaderOptions* options)
+{
+    DmmapReaderOptions defaults;
+    memset(&defaults, 0, sizeof(defaults));
+    if (!options)
+        options = &defaults;
+
+    memset(reader, 0, sizeof(*reader));
+    reader->backend = options->backend;
+    reader->drop.distance = options->drop_behind;
+    reader->drop.mode = options->drop_mode ? options->drop_mode : DMMAP_DROP_DONTNEED;
+
+    size_t page_size = dmmap__page_size();
+    size_t chunk_size = options->chunk_size ? options->chunk_size : DMMAP_READER_CHUNK_SIZE;
+    reader->chunk_size = (chunk_size + page_size - 1) / page_size * page_size;
+
+    unsigned depth = reader->backend == DMMAP_READER_DIRECT ? DMMAP_READER_DIRECT_DEPTH : DMMAP_READER_QUEUE_DEPTH;
+    if (options->queue_depth)
+        depth = options->queue_depth;
+    if (depth > 64)
+        depth = 64;
+
+    if (reader->backend == DMMAP_READER_URING || reader->backend == DMMAP_READER_DIRECT)
+    {
+        int ret = dmmap__reader_buffers_open(reader, filename, depth);
+        if (ret >= 0)
+            return ret;
+
+        // Pipes and procfs files have no offsets to read ahead at, take them in whole
+        reader->backend = DMMAP_READER_MMAP;
+    }
+
+    if (reader->backend == DMMAP_READER_MMAP)
+    {
+        reader->file = dmmap_file_open(filename, 1);
+        if (!reader->file.data)
+            return 0;
+
+        reader->size = reader->file.size;
+#ifndef _WIN32
+        dmmap__advise(&reader->file, MADV_SEQUENTIAL);
+#endif
+
+        // Small files are read into a buffer whole, there is nothing to fault in
+        if (options->prefetch && reader->file.backend == DMMAP_BACKEND_MMAP)
+            reader->impl = dmmap__reader_prefetch_open(reader, options->prefetch);
+        return 1;
+    }
+
+    return 0;
+}
+
+int dmmap_reader_next(DmmapReader* reader, DmmapChunk* chunk)
+{
+    if (reader->backend != DMMAP_READER_MMAP)
+    {
+        int ret = dmmap__reader_buffers_next(reader, chunk);
+        if (ret == 1)
+            reader->offset = chunk->offset + chunk->size;
+        return ret;
+    }
+
+    // The consumer's faults since the last chunk were taken on this mapping
+    if (dmmap__stats_enabled())
+    {
+        if (reader->offset)
+            dmmap_stats_fault_end(&reader->file, &reader->faults);
+        dmmap_stats_fault_begin(&reader->faults);
+    }
+
+    if (reader->offset >= reader->size)
+        return 0;
+
+    dmmap_drop_behind(&reader->file, &reader->drop, (size_t)reader->offset);
+
+    uint64_t left = reader->size - reader->offset;
+    chunk->size = left < reader->chunk_size ? (size_t)left : reader->chunk_size;
+    chunk->data = dmmap_access(&reader->file, (size_t)reader->offset, chunk->size);
+    chunk->offset = reader->offset;
+    reader->offset += chunk->size;
+    if (reader->impl)
+        dmmap__reader_prefetch_advance((DmmapReaderPrefetch*)reader->impl, reader->offset);
+    return 1;
+}
+
+void dmmap_reader_close(DmmapReader* reader)
+{
+    if (reader->backend == DMMAP_READER_MMAP)
+    {
+        if (reader->impl)
+            dmmap__reader_prefetch_close((DmmapReaderPrefetch*)reader->impl);
+        dmmap_file_close(&reader->file);
+    }
+    else if (reader->impl)
+        dmmap__reader_buffers_close((DmmapReaderBuffers*)reader->impl);
+
+    memset(reader, 0, sizeof(*reader));
+}
+
+// ***************************************************************************************
+// *  Small files
+// ***************************************************************************************
+
+#define DMMAP__POOL_MIN_SHIFT 12
+#define DMMAP__POOL_CLASSES 13 // 4 KiB up to 16 MiB
+
+// Free buffers are chained through their first bytes
+typedef struct DmmapPoolClass
+{
+    void* head;
+    unsigned count;
+} DmmapPoolClass;
+
+static DmmapPoolClass dmmap__pool[DMMAP__POOL_CLASSES];
+static DmmapMutex dmmap__pool_mutex = DMMAP__MUTEX_INIT;
+
+static unsigned dmmap__pool_class(size_t size)
+{
+    unsigned index = 0;
+    while (index < DMMAP__POOL_CLASSES && ((size_t)1 << (DMMAP__POOL_MIN_SHIFT + index)) < size)
+        ++index;
+    return index;
+}
+
+static void* dmmap__pool_get(size_t size)
+{
+    unsigned index = dmmap__pool_class(size);
+    if (index == DMMAP__POOL_CLASSES)
+        return malloc(size);
+
+    void* buffer = NULL;
+    dmmap__mutex_lock(&dmmap__pool_mutex);
+    if (dmmap__pool[index].head)
+    {
+        buffer = dmmap__pool[index].head;
+        memcpy(&dmmap__pool[index].head, buffer, sizeof(void*));
+        --dmmap__pool[index].count;
+    }
+    dmmap__mutex_unlock(&dmmap__pool_mutex);
+
+    return buffer ? buffer : malloc((size_t)1 << (DMMAP__POOL_MIN_SHIFT + index));
+}
+
+static void dmmap__pool_put(void* buffer, size_t size)
+{
+    unsigned index = dmmap__pool_class(size);
+    if (index < DMMAP__POOL_CLASSES)
+    {
+        dmmap__mutex_lock(&dmmap__pool_mutex);
+        if (dmmap__pool[index].count < DMMAP_BUFFER_POOL_DEPTH)
+        {
+            memcpy(buffer, &dmmap__pool[index].head, sizeof(void*));
+            dmmap__pool[index].head = buffer;
+            ++dmmap__pool[index].count;
+            buffer = NULL;
+        }
+        dmmap__mutex_unlock(&dmmap__pool_mutex);
+    }
+    free(buffer);
+}
+
+void dmmap_buffer_pool_clear(void)
+{
+    for (unsigned index = 0; index < DMMAP__POOL_CLASSES; ++index)
+    {
+        dmmap__mutex_lock(&dmmap__pool_mutex);
+        void* buffer = dmmap__pool[index].head;
+        dmmap__pool[index].head = NULL;
+        dmmap__pool[index].count = 0;
+        dmmap__mutex_unlock(&dmmap__pool_mutex);
+
+        while (buffer)
+        {
+            void* next;
+            memcpy(&next, buffer, sizeof(void*));
+            free(buffer);
+            buffer = next;
+        }
+    }
+}
+
+void dmmap_set_small_file_threshold(size_t bytes)
+{
+    dmmap__small_file_threshold = bytes;
+}
+
+size_t dmmap_get_small_file_threshold(void)
+{
+    return dmmap__small_file_threshold;
+}
+
+// Opens the first `size` bytes of `filename` read-only, either mapped (and touched) or read
+static int dmmap__calibration_open(const char* filename, size_t size, int buffered)
+{
+    DmmapFile file;
+#ifdef _WIN32
+    HANDLE handle = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (handle == INVALID_HANDLE_VALUE)
+        return 0;
+    file = buffered ? dmmap__read_handle(handle, size) : dmmap__map_handle(handle, size, 1);
+    CloseHandle(handle);
+#else
+    int fd = open(filename, O_RDONLY);
+    struct stat sb;
+    if (fd == -1)
+        return 0;
+    if (fstat(fd, &sb) == -1)
+    {
+        close(fd);
+        return 0;
+    }
+    if (buffered)
+    {
+        file = dmmap__read_fd(fd, size);
+        close(fd);
+    }
+    else
+        file = dmmap__map_fd(fd, 1, size);
+#endif
+    if (!file.data)
+        return 0;
+
+    // Both ways have to deliver every byte, a mapping pays its faults here
+    volatile char sink = 0;
+    for (size_t i = 0; i < file.size; i += dmmap__page_size())
+        sink = (char)(sink + ((const char*)file.data)[i]);
+
+    dmmap_file_close(&file);
+    return 1;
+}
+
+size_t dmmap_calibrate_small_file_threshold(const char* probe_filename)
+{
+    DmmapFile probe = dmmap_file_open(probe_filename, 1);
+    if (!probe.data)
+        return dmmap__small_file_threshold;
+
+    size_t probe_size = probe.size;
+    dmmap_file_close(&probe);
+
+    const int rounds = 64;
+    size_t threshold = 0;
+    for (size_t size = 4096; size <= probe_size && size <= ((size_t)4 << 20); size *= 2)
+    {
+        uint64_t mapped = 0, buffered = 0;
+        for (int round = 0; round < rounds; ++round)
+        {
+            uint64_t start = dmmap__now_ns();
+            if (!dmmap__calibration_open(probe_filename, size, 0))
+                return dmmap__small_file_threshold;
+            uint64_t middle = dmmap__now_ns();
+            if (!dmmap__calibration_open(probe_filename, size, 1))
+                return dmmap__small_file_threshold;
+            buffered += dmmap__now_ns() - middle;
+            mapped += middle - start;
+        }
+
+        if (buffered > mapped)
+            break;
+        threshold = size;
+    }
+
+    dmmap__small_file_threshold = threshold;
+    return threshold;
+}
+
+// ***************************************************************************************
+// *  Drop-behind
+// ***************************************************************************************
+
+#if defined(__linux__) && !defined(MADV_COLD)
+#define MADV_COLD 20
+#endif
+
+#if defined(__linux__) && !defined(MADV_PAGEOUT)
+#define MADV_PAGEOUT 21
+#endif
+
+#ifdef _WIN32
+static void dmmap__working_set_trim(DmmapFile* file, uintptr_t begin, uintptr_t end);
+#endif
+
+int dmmap_drop(DmmapFile* file, size_t offset, size_t length, DmmapDropMode mode)
+{
+    if (!file->data || offset >= file->size)
+        return 0;
+    if (length > file->size - offset)
+        length = file->size - offset;
+    if (file->backend != DMMAP_BACKEND_MMAP || mode == DMMAP_DROP_NONE)
+        return 1;
+
+    // Whole pages only, the last page of the file belongs to the mapping entirely
+    uintptr_t page_mask = (uintptr_t)dmmap__page_size() - 1;
+    uintptr_t begin = ((uintptr_t)file->data + offset + page_mask) & ~page_mask;
+    uintptr_t end = (uintptr_t)file->data + offset + length;
+    end = offset + length == file->size ? (end + page_mask) & ~page_mask : end & ~page_mask;
+    if (begin >= end)
+        return 1;
+
+    if (file->state)
+        dmmap__stats_add(file->state, offsetof(DmmapFileStats, bytes_advised), (uint64_t)(end - begin));
+
+#ifdef _WIN32
+    dmmap__working_set_trim(file, begin, end);
+    return 1;
+#else
+    int advice = MADV_DONTNEED;
+#ifdef __linux__
+    if (mode == DMMAP_DROP_COLD)
+        advice = MADV_COLD;
+    else if (mode == DMMAP_DROP_PAGEOUT)
+        advice = MADV_PAGEOUT;
+#endif
+    if (madvise((void*)begin, end - begin, advice) == -1)
+        return 0;
+
+#ifdef POSIX_FADV_DONTNEED
+    if (mode == DMMAP_DROP_DONTNEED)
+    {
+        uint64_t file_offset = file->offset + (uint64_t)(begin - (uintptr_t)file->data);
+        posix_fadvise((int)file->fd, (off_t)file_offset, (off_t)(end - begin), POSIX_FADV_DONTNEED);
+    }
+#endif
+    return 1;
+#endif
+}
+
+void dmmap_drop_behind(DmmapFile* file, DmmapDropBehind* drop, size_t position)
+{
+    if (!drop->distance || position < drop->distance + drop->dropped + DMMAP_DROP_BEHIND_BATCH)
+        return;
+
+    // Stop at a page boundary so that the next batch starts with a whole page
+    uintptr_t page_mask = (uintptr_t)dmmap__page_size() - 1;
+    uintptr_t data = (uintptr_t)file->data;
+    size_t upto = (size_t)(((data + position - drop->distance) & ~page_mask) - data);
+    if (upto <= drop->dropped)
+        return;
+
+    dmmap_drop(file, drop->dropped, upto - drop->dropped, drop->mode);
+    drop->dropped = upto;
+}
+
+// ***************************************************************************************
+// *  Resident memory budget
+// ***************************************************************************************
+
+struct DmmapState
+{
+    DmmapState* prev;
+    DmmapState* next;
+    DmmapFile file; // What `dmmap_drop` needs, without `state`
+    const char* path;
+    size_t chunks;
+    uint64_t* recency;     // Epoch of the last use, per chunk
+    uint32_t* resident;    // Resident pages at the last pass, per chunk
+    uint32_t* locks;       // Locked pages overlapping each chunk, the budget skips these
+    uint8_t* locked_pages; // One bit per page locked through `dmmap_lock`, allocated by the first lock
+    uint64_t locked;       // Bytes locked through `dmmap_lock`
+    int advice;            // Access pattern advised for the whole mapping
+    int advice_before;     // `advice` before the readahead controller switched it
+    uint64_t pressured;    // Readahead is cut short by the pressure watcher
+    uint64_t refs;         // Holders that use the entry outside the registry lock
+    uint64_t removed;      // The mapping is closed, the last holder frees the entry
+
+    // Adaptive readahead, updated without locks, a lost update only delays a decision
+    uint64_t readahead;  // The controller is on
+    uint64_t last;       // Offset of the last access
+    uint64_t last_end;   // End of the last access
+    uint64_t stride;     // Distance between the last two accesses, as two's complement
+    uint64_t candidate;  // Pattern of the recent accesses
+    uint64_t hits;       // Consecutive accesses of `candidate`
+    uint64_t pattern;    // Pattern in effect
+    uint64_t window;     // Sequential prefetch window
+    uint64_t prefetched; // End of what was prefetched
+
+    DmmapFileStats stats; // Counters, updated atomically
+};
+
+typedef struct DmmapBudgetCandidate
+{
+    DmmapState* state;
+    size_t chunk;
+    uint64_t recency;
+} DmmapBudgetCandidate;
+
+static DmmapMutex dmmap__registry_lock = DMMAP__MUTEX_INIT;
+static DmmapMutex dmmap__pass_lock = DMMAP__MUTEX_INIT;  // Serializes budget passes
+static DmmapMutex dmmap__evict_lock = DMMAP__MUTEX_INIT; // Held while a pass drops one chunk
+static DmmapState* dmmap__registry = NULL;
+static size_t dmmap__registry_count = 0;
+static uint64_t dmmap__locked_bytes = 0;
+
+// Advanced by every pass, uses are stamped with the current one
+static uint64_t dmmap__epoch = 1;
+static uint64_t dmmap__budget = 0;
+
+static DmmapMutex dmmap__monitor_lock = DMMAP__MUTEX_INIT;
+static DmmapThread dmmap__monitor_thread;
+static int dmmap__monitor_running = 0;
+static uint64_t dmmap__monitor_interval = 0;
+static uint64_t dmmap__monitor_stop = 0;
+
+static void dmmap__registry_add(DmmapFile* file, const char* path)
+{
+    if (!file->data || file->backend != DMMAP_BACKEND_MMAP)
+        return;
+
+    size_t chunks = (file->size + DMMAP_BUDGET_CHUNK - 1) / DMMAP_BUDGET_CHUNK;
+    size_t path_size = path ? strlen(path) + 1 : 0;
+
+    // One allocation: the entry, recency, residency, locks and the path
+    char* block = (char*)calloc(1, sizeof(DmmapState) + chunks * (sizeof(uint64_t) + 2 * sizeof(uint32_t)) + path_size);
+    if (!block)
+        return; // The mapping works as before, the budget just does not see it
+
+    DmmapState* state = (DmmapState*)block;
+    state->file = *file;
+    state->chunks = chunks;
+    state->recency = (uint64_t*)(block + sizeof(DmmapState));
+    state->resident = (uint32_t*)(state->recency + chunks);
+    state->locks = state->resident + chunks;
+    if (path)
+    {
+        char* copy = (char*)(state->locks + chunks);
+        memcpy(copy, path, path_size);
+        state->path = copy;
+    }
+
+    uint64_t epoch = DMMAP__ATOMIC_LOAD(&dmmap__epoch);
+    for (size_t i = 0; i < chunks; ++i)
+        state->recency[i] = epoch;
+
+    dmmap__mutex_lock(&dmmap__registry_lock);
+    state->next = dmmap__registry;
+    if (dmmap__registry)
+        dmmap__registry->prev = state;
+    dmmap__registry = state;
+    ++dmmap__registry_count;
+    dmmap__mutex_unlock(&dmmap__registry_lock);
+
+    file->state = state;
+    dmmap__profile_track(state);
+}
+
+static void dmmap__registry_remove(DmmapFile* file)
+{
+    DmmapState* state = file->state;
+
+    dmmap__mutex_lock(&dmmap__registry_lock);
+    if (state->prev)
+        state->prev->next = state->next;
+    else
+        dmmap__registry = state->next;
+    if (state->next)
+        state->next->prev = state->prev;
+    --dmmap__registry_count;
+    DMMAP__ATOMIC_STORE(&state->removed, (uint64_t)1);
+    int unused = state->refs == 0;
+    dmmap__mutex_unlock(&dmmap__registry_lock);
+
+    // A budget pass may be dropping a chunk of this mapping, wait for it before the range
+    // is unmapped and can be reused, later drops see `removed`
+    dmmap__mutex_lock(&dmmap__evict_lock);
+    dmmap__mutex_unlock(&dmmap__evict_lock);
+
+    // Unmapping drops the locks of the mapping
+    if (state->locked)
+        DMMAP__ATOMIC_ADD(&dmmap__locked_bytes, (uint64_t)0 - state->locked);
+    if (unused)
+    {
+        free(state->locked_pages);
+        free(state);
+    }
+    file->state = NULL;
+}
+
+// Drops `count` references taken with `refs` under the registry lock, the entry of a
+// closed mapping is freed with the last one
+static void dmmap__state_release(DmmapState* state, uint64_t count)
+{
+    dmmap__mutex_lock(&dmmap__registry_lock);
+    state->refs -= count;
+    int unused = state->refs == 0 && state->removed;
+    dmmap__mutex_unlock(&dmmap__registry_lock);
+
+    if (unused)
+    {
+        free(state->locked_pages);
+        free(state);
+    }
+}
+
+void* dmmap_access(DmmapFile* file, size_t offset, size_t length)
+{
+    DmmapState* state = file->state;
+    if (state && length && offset < file->size)
+    {
+        size_t last = length <= file->size - offset ? offset + length - 1 : file->size - 1;
+        uint64_t epoch = DMMAP__ATOMIC_LOAD(&dmmap__epoch);
+        for (size_t chunk = offset / DMMAP_BUDGET_CHUNK; chunk <= last / DMMAP_BUDGET_CHUNK; ++chunk)
+        {
+            if (DMMAP__ATOMIC_LOAD(&state->recency[chunk]) != epoch)
+                DMMAP__ATOMIC_STORE(&state->recency[chunk], epoch);
+        }
+
+        if (DMMAP__ATOMIC_LOAD(&state->readahead))
+            dmmap__readahead(file, offset, last + 1 - offset);
+    }
+    return (char*)file->data + offset;
+}
+
+// Counts the resident pages of one chunk, `vec` holds one byte per page of a chunk plus one
+static uint32_t dmmap__chunk_resident(const DmmapState* state, size_t chunk, uint8_t* vec)
+{
+    uintptr_t page_mask = (uintptr_t)dmmap__page_size() - 1;
+    uintptr_t begin = (uintptr_t)state->file.data + chunk * DMMAP_BUDGET_CHUNK;
+    uintptr_t end = (uintptr_t)state->file.data + state->file.size;
+    if (end - begin > DMMAP_BUDGET_CHUNK)
+        end = begin + DMMAP_BUDGET_CHUNK;
+
+    begin &= ~page_mask;
+    size_t pages = (size_t)((end - begin + page_mask) / (page_mask + 1));
+    if (!dmmap__residency((const void*)begin, pages, vec))
+        return 0;
+
+    uint32_t resident = 0;
+    for (size_t i = 0; i < pages; ++i)
+        resident += vec[i];
+    return resident;
+}
+
+static int dmmap__budget_compare(const void* a, const void* b)
+{
+    uint64_t ra = ((const DmmapBudgetCandidate*)a)->recency;
+    uint64_t rb = ((const DmmapBudgetCandidate*)b)->recency;
+    return ra < rb ? -1 : ra > rb;
+}
+
+// One budget pass, `shrink_percent` lowers the target below the current residency. The
+// registry lock is only held to take a snapshot, the scan and the drops run without it.
+static void dmmap__budget_pass(uint64_t budget, unsigned shrink_percent, DmmapBudgetStats* stats)
+{
+    DmmapBudgetStats result;
+    memset(&result, 0, sizeof(result));
+    result.budget = (size_t)budget;
+
+    size_t page_size = dmmap__page_size();
+    uint8_t* vec = (uint8_t*)malloc(DMMAP_BUDGET_CHUNK / page_size + 1);
+    if (!vec)
+    {
+        if (stats)
+            *stats = result;
+        return;
+    }
+
+    dmmap__mutex_lock(&dmmap__pass_lock);
+
+    // Uses from now on count as newer than anything this pass sees
+    uint64_t epoch = DMMAP__ATOMIC_ADD(&dmmap__epoch, 1);
+
+    // The references keep the entries alive, closed mappings are skipped
+    dmmap__mutex_lock(&dmmap__registry_lock);
+    size_t held = 0;
+    size_t total_chunks = 0;
+    DmmapState** states = (DmmapState**)malloc((dmmap__registry_count + 1) * sizeof(*states));
+    for (DmmapState* state = dmmap__registry; states && state; state = state->next)
+    {
+        ++state->refs;
+        states[held++] = state;
+        total_chunks += state->chunks;
+    }
+    result.mappings = dmmap__registry_count;
+    dmmap__mutex_unlock(&dmmap__registry_lock);
+
+    DmmapBudgetCandidate* candidates = (DmmapBudgetCandidate*)malloc((total_chunks ? total_chunks : 1) * sizeof(*candidates));
+    size_t count = 0;
+    uint64_t resident = 0;
+
+    for (size_t k = 0; k < held; ++k)
+    {
+        DmmapState* state = states[k];
+        for (size_t chunk = 0; chunk < state->chunks && !DMMAP__ATOMIC_LOAD(&state->removed); ++chunk)
+        {
+            // A chunk that gained pages since the last pass was used through `data`
+            uint32_t pages = dmmap__chunk_resident(state, chunk, vec);
+            if (pages > state->resident[chunk] && DMMAP__ATOMIC_LOAD(&state->recency[chunk]) < epoch)
+                DMMAP__ATOMIC_STORE(&state->recency[chunk], epoch);
+            state->resident[chunk] = pages;
+            resident += (uint64_t)pages * page_size;
+
+            if (pages && candidates)
+            {
+                candidates[count].state = state;
+                candidates[count].chunk = chunk;
+                candidates[count].recency = DMMAP__ATOMIC_LOAD(&state->recency[chunk]);
+                ++count;
+            }
+        }
+    }
+
+    // Locked ranges change under the registry lock, leave out the chunks holding one
+    dmmap__mutex_lock(&dmmap__registry_lock);
+    size_t kept = 0;
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (!candidates[i].state->locks[candidates[i].chunk])
+            candidates[kept++] = candidates[i];
+    }
+    count = kept;
+    dmmap__mutex_unlock(&dmmap__registry_lock);
+
+    uint64_t target = budget;
+    if (shrink_percent)
+    {
+        uint64_t shrunk = resident - resident * shrink_percent / 100;
+        if (!target || shrunk < target)
+            target = shrunk;
+    }
+
+    if (target && resident > target && candidates)
+    {
+        qsort(candidates, count, sizeof(*candidates), dmmap__budget_compare);
+        for (size_t i = 0; i < count && resident > target; ++i)
+        {
+            DmmapState* state = candidates[i].state;
+            size_t chunk = candidates[i].chunk;
+            size_t offset = chunk * DMMAP_BUDGET_CHUNK;
+            uint32_t before = state->resident[chunk];
+
+            // Closing waits for the chunk being dropped, so the range is still mapped here
+            dmmap__mutex_lock(&dmmap__evict_lock);
+            if (DMMAP__ATOMIC_LOAD(&state->removed))
+            {
+                dmmap__mutex_unlock(&dmmap__evict_lock);
+                continue;
+            }
+            if (!dmmap_drop(&state->file, offset, DMMAP_BUDGET_CHUNK, DMMAP_BUDGET_DROP_MODE) ||
+                dmmap__chunk_resident(state, chunk, vec) >= before)
+                dmmap_drop(&state->file, offset, DMMAP_BUDGET_CHUNK, DMMAP_DROP_DONTNEED);
+            uint32_t after = dmmap__chunk_resident(state, chunk, vec);
+            dmmap__mutex_unlock(&dmmap__evict_lock);
+
+            uint64_t bytes = after < before ? (uint64_t)(before - after) * page_size : 0;
+            result.evicted += (size_t)bytes;
+            resident -= bytes;
+            state->resident[chunk] = after;
+        }
+    }
+    result.resident = (size_t)resident;
+
+    for (size_t k = 0; k < held; ++k)
+        dmmap__state_release(states[k], 1);
+    dmmap__mutex_unlock(&dmmap__pass_lock);
+
+    free(states);
+    free(candidates);
+    free(vec);
+    if (stats)
+        *stats = result;
+}
+
+void dmmap_budget_enforce(DmmapBudgetStats* stats)
+{
+    dmmap__budget_pass(DMMAP__ATOMIC_LOAD(&dmmap__budget), 0, stats);
+}
+
+static void dmmap__monitor_main(void* arg)
+{
+    (void)arg;
+    while (!DMMAP__ATOMIC_LOAD(&dmmap__monitor_stop))
+    {
+        dmmap_budget_enforce(NULL);
+
+        // Sleep in short steps so that stopping the monitor does not wait a whole interval
+        uint64_t interval = DMMAP__ATOMIC_LOAD(&dmmap__monitor_interval);
+        for (uint64_t slept = 0; slept < interval && !DMMAP__ATOMIC_LOAD(&dmmap__monitor_stop); slept += 10)
+            dmmap__sleep_ms(10);
+    }
+}
+
+void dmmap_budget_set(size_t bytes, unsigned interval_ms)
+{
+    dmmap__mutex_lock(&dmmap__monitor_lock);
+    DMMAP__ATOMIC_STORE(&dmmap__budget, (uint64_t)bytes);
+    DMMAP__ATOMIC_STORE(&dmmap__monitor_interval, (uint64_t)interval_ms);
+
+    if (dmmap__monitor_running && (!bytes || !interval_ms))
+    {
+        DMMAP__ATOMIC_STORE(&dmmap__monitor_stop, (uint64_t)1);
+        dmmap__thread_join(dmmap__monitor_thread);
+        dmmap__monitor_running = 0;
+    }
+
+    if (!dmmap__monitor_running && bytes && interval_ms)
+    {
+        DMMAP__ATOMIC_STORE(&dmmap__monitor_stop, (uint64_t)0);
+        dmmap__monitor_running = dmmap__thread_start(&dmmap__monitor_thread, dmmap__monitor_main, NULL);
+    }
+    dmmap__mutex_unlock(&dmmap__monitor_lock);
+}
+
+// ***************************************************************************************
+// *  Segment pool
+// ***************************************************************************************
+
+typedef struct DmmapFrame
+{
+    uint64_t segment;
+    void* data;    // Start of the mapping, NULL for a free frame
+    size_t size;
+    uint32_t pins;
+    uint32_t usage;
+    int32_t next; // Next frame of the same hash bucket, -1 ends the chain
+} DmmapFrame;
+
+struct DmmapSegmentPool
+{
+#ifdef _WIN32
+    HANDLE map;
+#else
+    int fd;
+#endif
+    int read_only;
+    uint64_t size;
+    size_t segment_size;
+    size_t frames;
+    size_t hand;
+    DmmapFrame* frame;
+    int32_t* buckets;
+    size_t bucket_mask;
+    DmmapSegmentStats stats;
+    DmmapMutex lock;
+};
+
+static size_t dmmap__segment_bucket(const DmmapSegmentPool* pool, uint64_t segment)
+{
+    return (size_t)((segment * 0x9E3779B97F4A7C15ull) >> 32) & pool->bucket_mask;
+}
+
+static int32_t dmmap__segment_find(const DmmapSegmentPool* pool, uint64_t segment)
+{
+    int32_t index = pool->buckets[dmmap__segment_bucket(pool, segment)];
+    while (index != -1 && pool->frame[index].segment != segment)
+        index = pool->frame[index].next;
+    return index;
+}
+
+static void dmmap__segment_unlink(DmmapSegmentPool* pool, int32_t index)
+{
+    int32_t* link = &pool->buckets[dmmap__segment_bucket(pool, pool->frame[index].segment)];
+    while (*link != index)
+        link = &pool->frame[*link].next;
+    *link = pool->frame[index].next;
+}
+
+static void dmmap__segment_unmap(DmmapFrame* frame)
+{
+#ifdef _WIN32
+    UnmapViewOfFile(frame->data);
+#else
+    munmap(frame->data, frame->size);
+#endif
+    frame->data = NULL;
+}
+
+// Picks a free frame or evicts one with GCLOCK, returns -1 when every frame is pinned
+static int32_t dmmap__segment_victim(DmmapSegmentPool* pool)
+{
+    // Two full rounds per usage level are enough to bring any unpinned frame to zero
+    size_t steps = pool->frames * (DMMAP_SEGMENT_MAX_USAGE + 2);
+    for (size_t step = 0; step < steps; ++step)
+    {
+        DmmapFrame* frame = &pool->frame[pool->hand];
+        int32_t index = (int32_t)pool->hand;
+        pool->hand = (pool->hand + 1) % pool->frames;
+
+        if (!frame->data)
+            return index;
+        if (frame->pins)
+            continue;
+        if (frame->usage)
+        {
+            --frame->usage;
+            continue;
+        }
+
+        dmmap__segment_unlink(pool, index);
+        dmmap__segment_unmap(frame);
+        ++pool->stats.evictions;
+        --pool->stats.mapped;
+        return index;
+    }
+    return -1;
+}
+
+DmmapSegmentPool* dmmap_segment_pool_open(const char* filename, int read_only, size_t segment_size, size_t frames)
+{
+    if (frames == 0 || frames > INT32_MAX)
+        return NULL;
+
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    size_t granularity = info.dwAllocationGranularity;
+#else
+    size_t granularity = dmmap__page_size();
+#endif
+    if (!segment_size)
+        segment_size = DMMAP_SEGMENT_SIZE;
+    segment_size = (segment_size + granularity - 1) / granularity * granularity;
+
+    size_t buckets = 1;
+    while (buckets < frames * 2)
+        buckets <<= 1;
+
+    DmmapSegmentPool* pool = (DmmapSegmentPool*)calloc(1, sizeof(*pool));
+    if (!pool)
+        return NULL;
+    pool->frame = (DmmapFrame*)calloc(frames, sizeof(DmmapFrame));
+    pool->buckets = (int32_t*)malloc(buckets * sizeof(int32_t));
+    if (!pool->frame || !pool->buckets)
+    {
+        free(pool->frame);
+        free(pool->buckets);
+        free(pool);
+        return NULL;
+    }
+    memset(pool->buckets, 0xff, buckets * sizeof(int32_t));
+    pool->bucket_mask = buckets - 1;
+    pool->frames = frames;
+    pool->segment_size = segment_size;
+    pool->read_only = read_only;
+
+    int ok;
+#ifdef _WIN32
+    DWORD access = read_only ? GENERIC_READ : GENERIC_READ | GENERIC_WRITE;
+    HANDLE file = CreateFileA(filename, access, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    LARGE_INTEGER size;
+    if (file != INVALID_HANDLE_VALUE && GetFileSizeEx(file, &size) && size.QuadPart > 0)
+    {
+        pool->size = (uint64_t)size.QuadPart;
+        pool->map = CreateFileMapping(file, NULL, read_only ? PAGE_READONLY : PAGE_READWRITE, 0, 0, NULL);
+    }
+    if (file != INVALID_HANDLE_VALUE)
+        CloseHandle(file);
+    ok = pool->map != NULL;
+#else
+    struct stat sb;
+    DmmapDeviceInfo info;
+    pool->fd = open(filename, read_only ? O_RDONLY : O_RDWR);
+    if (pool->fd != -1 && fstat(pool->fd, &sb) == 0 && dmmap__fd_info(pool->fd, &sb, &info))
+        pool->size = info.size;
+    ok = pool->size > 0;
+    if (!ok && pool->fd != -1)
+        close(pool->fd);
+#endif
+
+    if (!ok)
+    {
+        free(pool->frame);
+        free(pool->buckets);
+        free(pool);
+        return NULL;
+    }
+
+    dmmap__mutex_init(&pool->lock);
+    return pool;
+}
+
+int dmmap_segment_pin(DmmapSegmentPool* pool, uint64_t offset, unsigned priority, DmmapPin* pin)
+{
+    if (offset >= pool->size)
+        return 0;
+
+    uint64_t segment = offset / pool->segment_size;
+    uint32_t weight = priority ? (uint32_t)priority : 1;
+
+    dmmap__mutex_lock(&pool->lock);
+    int32_t index = dmmap__segment_find(pool, segment);
+    if (index != -1)
+        ++pool->stats.hits;
+    else
+    {
+        index = dmmap__segment_victim(pool);
+        if (index == -1)
+        {
+            dmmap__mutex_unlock(&pool->lock);
+            return 0;
+        }
+
+        DmmapFrame* frame = &pool->frame[index];
+        uint64_t base = segment * pool->segment_size;
+        uint64_t left = pool->size - base;
+        frame->size = left < pool->segment_size ? (size_t)left : pool->segment_size;
+#ifdef _WIN32
+        frame->data = MapViewOfFile(pool->map, pool->read_only ? FILE_MAP_READ : FILE_MAP_WRITE,
+                                    (DWORD)(base >> 32), (DWORD)base, frame->size);
+#else
+        int prot = pool->read_only ? PROT_READ : PROT_READ | PROT_WRITE;
+        frame->data = mmap(NULL, frame->size, prot, MAP_SHARED, pool->fd, (off_t)base);
+        if (frame->data == MAP_FAILED)
+            frame->data = NULL;
+#endif
+        if (!frame->data)
+        {
+            dmmap__mutex_unlock(&pool->lock);
+            return 0;
+        }
+
+        size_t bucket = dmmap__segment_bucket(pool, segment);
+        frame->segment = segment;
+        frame->pins = 0;
+        frame->usage = 0;
+        frame->next = pool->buckets[bucket];
+        pool->buckets[bucket] = index;
+        ++pool->stats.misses;
+        ++pool->stats.mapped;
+    }
+
+    DmmapFrame* frame = &pool->frame[index];
+    if (frame->pins++ == 0)
+        ++pool->stats.pinned;
+    frame->usage = frame->usage + weight > DMMAP_SEGMENT_MAX_USAGE ? DMMAP_SEGMENT_MAX_USAGE : frame->usage + weight;
+
+    pin->data = frame->data;
+    pin->size = frame->size;
+    pin->offset = segment * pool->segment_size;
+    pin->frame = (uint32_t)index;
+    dmmap__mutex_unlock(&pool->lock);
+    return 1;
+}
+
+void dmmap_segment_unpin(DmmapSegmentPool* pool, DmmapPin* pin)
+{
+    if (!pin->data)
+        return;
+
+    dmmap__mutex_lock(&pool->lock);
+    if (--pool->frame[pin->frame].pins == 0)
+        --pool->stats.pinned;
+    dmmap__mutex_unlock(&pool->lock);
+    pin->data = NULL;
+}
+
+void dmmap_segment_pool_stats(DmmapSegmentPool* pool, DmmapSegmentStats* stats)
+{
+    dmmap__mutex_lock(&pool->lock);
+    *stats = pool->stats;
+    dmmap__mutex_unlock(&pool->lock);
+}
+
+void dmmap_segment_pool_close(DmmapSegmentPool* pool)
+{
+    if (!pool)
+        return;
+
+    for (size_t i = 0; i < pool->frames; ++i)
+    {
+        if (pool->frame[i].data)
+            dmmap__segment_unmap(&pool->frame[i]);
+    }
+
+#ifdef _WIN32
+    CloseHandle(pool->map);
+#else
+    close(pool->fd);
+#endif
+    dmmap__mutex_destroy(&pool->lock);
+    free(pool->frame);
+    free(pool->buckets);
+    free(pool);
+}
+
+// ***************************************************************************************
+// *  Memory pressure watcher
+// ***************************************************************************************
+
+#ifndef _WIN32
+// Windows of `dmmap_file_open_range` start inside their first page
+static void dmmap__madvise_mapping(const DmmapFile* file, int advice)
+{
+    uintptr_t page_mask = (uintptr_t)dmmap__page_size() - 1;
+    uintptr_t begin = (uintptr_t)file->data & ~page_mask;
+    madvise((void*)begin, (uintptr_t)file->data + file->size - begin, advice);
+}
+
+// Advises the whole mapping and remembers it, so that the pressure watcher can restore it
+static void dmmap__advise(DmmapFile* file, int advice)
+{
+    if (file->state)
+    {
+        dmmap__mutex_lock(&dmmap__registry_lock);
+        file->state->advice = advice;
+        if (file->state->pressured)
+            advice = MADV_RANDOM;
+        dmmap__mutex_unlock(&dmmap__registry_lock);
+        dmmap__stats_add(file->state, offsetof(DmmapFileStats, bytes_advised), file->size);
+    }
+    dmmap__madvise_mapping(file, advice);
+}
+#endif
+
+#ifdef __linux__
+#include <poll.h>
+
+static DmmapMutex dmmap__pressure_lock = DMMAP__MUTEX_INIT;
+static DmmapThread dmmap__pressure_thread;
+static int dmmap__pressure_running = 0;
+static uint64_t dmmap__pressure_stop = 0;
+static uint64_t dmmap__pressure_active = 0;
+
+#define DMMAP__PRESSURE_AVG10_NS 10000000000ull // averaging window of "some avg10"
+
+typedef struct DmmapPressureWatch
+{
+    int fd;      // Trigger, -1 when polling
+    char path[256];
+    double threshold; // avg10 percentage when polling
+    unsigned shrink_percent;
+    unsigned calm_ms;
+} DmmapPressureWatch;
+
+// Cuts readahead of all mappings and pages out their coldest chunks
+static void dmmap__pressure_shrink(unsigned shrink_percent)
+{
+    dmmap__mutex_lock(&dmmap__registry_lock);
+    for (DmmapState* state = dmmap__registry; state; state = state->next)
+    {
+        if (!state->pressured)
+        {
+            dmmap__madvise_mapping(&state->file, MADV_RANDOM);
+            DMMAP__ATOMIC_STORE(&state->pressured, (uint64_t)1);
+        }
+    }
+    dmmap__mutex_unlock(&dmmap__registry_lock);
+
+    DMMAP__ATOMIC_STORE(&dmmap__pressure_active, (uint64_t)1);
+    dmmap__budget_pass(DMMAP__ATOMIC_LOAD(&dmmap__budget), shrink_percent, NULL);
+}
+
+static void dmmap__pressure_restore(void)
+{
+    dmmap__mutex_lock(&dmmap__registry_lock);
+    for (DmmapState* state = dmmap__registry; state; state = state->next)
+    {
+        if (state->pressured)
+        {
+            dmmap__madvise_mapping(&state->file, state->advice);
+            DMMAP__ATOMIC_STORE(&state->pressured, (uint64_t)0);
+        }
+    }
+    dmmap__mutex_unlock(&dmmap__registry_lock);
+    DMMAP__ATOMIC_STORE(&dmmap__pressure_active, (uint64_t)0);
+}
+
+// Reads the "some avg10" percentage of a PSI file, -1 on failure
+static double dmmap__pressure_avg10(const char* path)
+{
+    char buffer[256];
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return -1;
+    ssize_t got = read(fd, buffer, sizeof(buffer) - 1);
+    close(fd);
+    if (got <= 0)
+        return -1;
+
+    buffer[got] = '\0';
+    const char* avg10 = strstr(buffer, "avg10=");
+    return avg10 ? strtod(avg10 + 6, NULL) : -1;
+}
+
+static void dmmap__pressure_main(void* arg)
+{
+    DmmapPressureWatch* watch = (DmmapPressureWatch*)arg;
+    uint64_t calm_ns = (uint64_t)watch->calm_ms * 1000000ull;
+    uint64_t last_event = 0;
+    uint64_t last_shrink = 0;
+
+    while (!DMMAP__ATOMIC_LOAD(&dmmap__pressure_stop))
+    {
+        int pressure;
+        if (watch->fd != -1)
+        {
+            // Wake up regularly to notice the calm and the stop request
+            struct pollfd pfd;
+            pfd.fd = watch->fd;
+            pfd.events = POLLPRI;
+            pfd.revents = 0;
+            int ret = poll(&pfd, 1, 100);
+            if (ret < 0 && errno != EINTR)
+                break;
+            if (ret > 0 && (pfd.revents & POLLERR))
+                break; // The monitored cgroup went away
+            pressure = ret > 0 && (pfd.revents & POLLPRI);
+        }
+        else
+        {
+            dmmap__sleep_ms(100);
+            pressure = dmmap__pressure_avg10(watch->path) >= watch->threshold;
+        }
+
+        uint64_t now = dmmap__now_ns();
+        if (pressure)
+        {
+            // A polled avg10 stays above the threshold for seconds after a single spike,
+            // shrink at most once per averaging window instead of on every poll
+            if (watch->fd != -1 || !last_shrink || now - last_shrink >= DMMAP__PRESSURE_AVG10_NS)
+            {
+                dmmap__pressure_shrink(watch->shrink_percent);
+                last_shrink = now;
+            }
+            last_event = now;
+        }
+        else if (DMMAP__ATOMIC_LOAD(&dmmap__pressure_active) && now - last_event >= calm_ns)
+            dmmap__pressure_restore();
+    }
+
+    if (DMMAP__ATOMIC_LOAD(&dmmap__pressure_active))
+        dmmap__pressure_restore();
+    if (watch->fd != -1)
+        close(watch->fd);
+    free(watch);
+}
+
+int dmmap_pressure_watch(const DmmapPressureOptions* options)
+{
+    DmmapPressureOptions defaults;
+    memset(&defaults, 0, sizeof(defaults));
+    if (!options)
+        options = &defaults;
+
+    dmmap_pressure_unwatch();
+
+    DmmapPressureWatch* watch = (DmmapPressureWatch*)calloc(1, sizeof(*watch));
+    if (!watch)
+        return 0;
+
+    const char* path = options->path ? options->path : "/proc/pressure/memory";
+    if (strlen(path) >= sizeof(watch->path))
+    {
+        free(watch);
+        return 0;
+    }
+    strcpy(watch->path, path);
+
+    unsigned stall_us = options->stall_us ? options->stall_us : 200000;
+    unsigned window_us = options->window_us ? options->window_us : 2000000;
+    watch->shrink_percent = options->shrink_percent ? options->shrink_percent : 25;
+    watch->calm_ms = options->calm_ms ? options->calm_ms : 10000;
+    watch->threshold = 100.0 * stall_us / window_us;
+    if (watch->shrink_percent > 100)
+        watch->shrink_percent = 100;
+
+    char trigger[64];
+    int length = snprintf(trigger, sizeof(trigger), "some %u %u", stall_us, window_us);
+    watch->fd = open(path, O_RDWR | O_NONBLOCK);
+    if (watch->fd != -1 && write(watch->fd, trigger, (size_t)length + 1) < 0)
+    {
+        // Without CAP_SYS_RESOURCE the window has to be a multiple of 2 s, scale it up
+        int written = 0;
+        if (errno == EINVAL && window_us % 2000000 != 0)
+        {
+            uint64_t window = ((uint64_t)window_us + 1999999) / 2000000 * 2000000;
+            uint64_t stall = (uint64_t)stall_us * window / window_us;
+            length = snprintf(trigger, sizeof(trigger), "some %llu %llu", (unsigned long long)stall,
+                              (unsigned long long)window);
+            written = write(watch->fd, trigger, (size_t)length + 1) >= 0;
+        }
+        if (!written)
+        {
+            close(watch->fd);
+            watch->fd = -1;
+        }
+    }
+    if (watch->fd == -1 && dmmap__pressure_avg10(path) < 0)
+    {
+        free(watch);
+        return 0;
+    }
+
+    dmmap__mutex_lock(&dmmap__pressure_lock);
+    DMMAP__ATOMIC_STORE(&dmmap__pressure_stop, (uint64_t)0);
+    dmmap__pressure_running = dmmap__thread_start(&dmmap__pressure_thread, dmmap__pressure_main, watch);
+    int running = dmmap__pressure_running;
+    dmmap__mutex_unlock(&dmmap__pressure_lock);
+
+    if (!running)
+    {
+        if (watch->fd != -1)
+            close(watch->fd);
+        free(watch);
+    }
+    return running;
+}
+
+void dmmap_pressure_unwatch(void)
+{
+    dmmap__mutex_lock(&dmmap__pressure_lock);
+    if (dmmap__pressure_running)
+    {
+        DMMAP__ATOMIC_STORE(&dmmap__pressure_stop, (uint64_t)1);
+        dmmap__thread_join(dmmap__pressure_thread);
+        dmmap__pressure_running = 0;
+    }
+    dmmap__mutex_unlock(&dmmap__pressure_lock);
+}
+
+int dmmap_under_pressure(void)
+{
+    return DMMAP__ATOMIC_LOAD(&dmmap__pressure_active) != 0;
+}
+#else
+int dmmap_pressure_watch(const DmmapPressureOptions* options)
+{
+    (void)options;
+    return 0;
+}
+
+void dmmap_pressure_unwatch(void)
+{
+}
+
+int dmmap_under_pressure(void)
+{
+    return 0;
+}
+#endif
+
+// ***************************************************************************************
+// *  Locked ranges
+// ***************************************************************************************
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+#ifndef MLOCK_ONFAULT
+#define MLOCK_ONFAULT 1
+#endif
+
+// Widens a range of a mapping to whole pages, returns 0 when it lies outside the file
+static int dmmap__page_range(const DmmapFile* file, size_t offset, size_t length, uintptr_t* begin, size_t* size)
+{
+    if (!file->data || offset >= file->size)
+        return 0;
+    if (length > file->size - offset)
+        length = file->size - offset;
+
+    uintptr_t page_mask = (uintptr_t)dmmap__page_size() - 1;
+    uintptr_t start = (uintptr_t)file->data + offset;
+    *begin = start & ~page_mask;
+    *size = (size_t)(((start + length + page_mask) & ~page_mask) - *begin);
+    return length > 0;
+}
+
+// Allocates the locked page bitmap of a mapping before its first lock, 0 when out of memory
+static int dmmap__lock_prepare(DmmapFile* file)
+{
+    DmmapState* state = file->state;
+    if (!state)
+        return 1;
+
+    size_t page_size = dmmap__page_size();
+    size_t head = (size_t)((uintptr_t)file->data & (page_size - 1));
+    size_t pages = (head + file->size + page_size - 1) / page_size;
+
+    dmmap__mutex_lock(&dmmap__registry_lock);
+    if (!state->locked_pages)
+        state->locked_pages = (uint8_t*)calloc((pages + 7) / 8, 1);
+    int ok = state->locked_pages != NULL;
+    dmmap__mutex_unlock(&dmmap__registry_lock);
+    return ok;
+}
+
+// Records the pages of `[begin, begin + size)` as locked or unlocked. Locks do not nest,
+// so only pages that actually change state move the counters.
+static void dmmap__lock_account(DmmapFile* file, uintptr_t begin, size_t size, int lock)
+{
+    DmmapState* state = file->state;
+    if (!state)
+        return;
+
+    size_t page_size = dmmap__page_size();
+    uintptr_t base = (uintptr_t)file->data & ~(uintptr_t)(page_size - 1);
+    size_t head = (size_t)((uintptr_t)file->data - base);
+    size_t first = (size_t)(begin - base) / page_size;
+    size_t count = size / page_size;
+    uint64_t changed = 0;
+
+    dmmap__mutex_lock(&dmmap__registry_lock);
+    for (size_t page = first; state->locked_pages && page < first + count; ++page)
+    {
+        uint8_t bit = (uint8_t)(1u << (page % 8));
+        if (((state->locked_pages[page / 8] & bit) != 0) == (lock != 0))
+            continue;
+        state->locked_pages[page / 8] ^= bit;
+        ++changed;
+
+        // A page of an unaligned window can straddle two chunks
+        size_t lo = page * page_size > head ? page * page_size - head : 0;
+        size_t hi = (page + 1) * page_size - head;
+        if (hi > file->size)
+            hi = file->size;
+        for (size_t chunk = lo / DMMAP_BUDGET_CHUNK; chunk <= (hi - 1) / DMMAP_BUDGET_CHUNK; ++chunk)
+        {
+            if (lock)
+                ++state->locks[chunk];
+            else
+                --state->locks[chunk];
+        }
+    }
+
+    uint64_t bytes = changed * page_size;
+    if (lock)
+        state->locked += bytes;
+    else
+        state->locked -= bytes;
+    dmmap__mutex_unlock(&dmmap__registry_lock);
+
+    DMMAP__ATOMIC_ADD(&dmmap__locked_bytes, lock ? bytes : (uint64_t)0 - bytes);
+}
+
+#ifdef _WIN32
+// Unlocking pages that are not locked removes them from the working set. The same call
+// would release the ranges locked with `dmmap_lock`, so their pages are skipped.
+static void dmmap__working_set_trim(DmmapFile* file, uintptr_t begin, uintptr_t end)
+{
+    DmmapState* state = file->state;
+    size_t page_size = dmmap__page_size();
+    uintptr_t base = (uintptr_t)file->data & ~(uintptr_t)(page_size - 1);
+    uintptr_t run = begin;
+
+    dmmap__mutex_lock(&dmmap__registry_lock);
+    for (uintptr_t page = begin; state && state->locked && page < end; page += page_size)
+    {
+        size_t index = (size_t)(page - base) / page_size;
+        if (state->locked_pages[index / 8] & (1u << (index % 8)))
+        {
+            if (run < page)
+                VirtualUnlock((void*)run, (SIZE_T)(page - run));
+            run = page + page_size;
+        }
+    }
+    if (run < end)
+        VirtualUnlock((void*)run, (SIZE_T)(end - run));
+    dmmap__mutex_unlock(&dmmap__registry_lock);
+}
+#endif
+
+DmmapLockResult dmmap_lock(DmmapFile* file, size_t offset, size_t length, unsigned flags)
+{
+    uintptr_t begin;
+    size_t size;
+    if (!dmmap__page_range(file, offset, length, &begin, &size) || !dmmap__lock_prepare(file))
+        return DMMAP_LOCK_FAILED;
+
+#ifdef _WIN32
+    (void)flags;
+    if (!VirtualLock((void*)begin, size))
+    {
+        DWORD error = GetLastError();
+        return error == ERROR_WORKING_SET_QUOTA ? DMMAP_LOCK_LIMIT : DMMAP_LOCK_FAILED;
+    }
+#else
+    int ret;
+#if defined(__linux__) && defined(SYS_mlock2)
+    if (flags & DMMAP_LOCK_ONFAULT)
+    {
+        ret = (int)syscall(SYS_mlock2, (void*)begin, size, MLOCK_ONFAULT);
+
+        // Kernels before 4.4 lack mlock2, lock and populate the range instead
+        if (ret == -1 && (errno == ENOSYS || errno == EINVAL))
+            ret = mlock((void*)begin, size);
+    }
+    else
+        ret = mlock((void*)begin, size);
+#else
+    (void)flags;
+    ret = mlock((void*)begin, size);
+#endif
+    if (ret == -1)
+    {
+        if (errno == EPERM)
+            return DMMAP_LOCK_DENIED;
+        return errno == ENOMEM || errno == EAGAIN ? DMMAP_LOCK_LIMIT : DMMAP_LOCK_FAILED;
+    }
+#endif
+
+    dmmap__lock_account(file, begin, size, 1);
+    return DMMAP_LOCK_OK;
+}
+
+int dmmap_unlock(DmmapFile* file, size_t offset, size_t length)
+{
+    uintptr_t begin;
+    size_t size;
+    if (!dmmap__page_range(file, offset, length, &begin, &size))
+        return 0;
+
+#ifdef _WIN32
+    if (!VirtualUnlock((void*)begin, size))
+        return 0;
+#else
+    if (munlock((void*)begin, size) == -1)
+        return 0;
+#endif
+
+    dmmap__lock_account(file, begin, size, 0);
+    return 1;
+}
+
+void dmmap_lock_limits(DmmapLockLimits* limits)
+{
+    limits->locked = DMMAP__ATOMIC_LOAD(&dmmap__locked_bytes);
+    limits->limit = UINT64_MAX;
+
+#ifdef _WIN32
+    SIZE_T minimum, maximum;
+    if (GetProcessWorkingSetSize(GetCurrentProcess(), &minimum, &maximum))
+        limits->limit = (uint64_t)minimum;
+#else
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_MEMLOCK, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY)
+        limits->limit = (uint64_t)rl.rlim_cur;
+#endif
+
+    limits->available = limits->limit > limits->locked ? limits->limit - limits->locked : 0;
+}
+
+// ***************************************************************************************
+// *  NUMA placement
+// ***************************************************************************************
+
+#define DMMAP__NUMA_MASK_WORDS ((DMMAP_NUMA_MAX_NODES + 63) / 64)
+#define DMMAP__NUMA_MAX_CPUS 4096
+
+typedef struct DmmapNumaPrefault
+{
+    const DmmapFile* file;
+    size_t offset;
+    size_t length;
+    size_t stripes;
+    DmmapNumaPolicy policy;
+    int slots;                          // Nodes the stripes are dealt out to, 1 for bind and default
+    int nodes[DMMAP_NUMA_MAX_NODES];    // Node of each slot
+    uint64_t next[DMMAP_NUMA_MAX_NODES]; // Next stripe of each slot, per slot numbering
+    uint64_t done;
+} DmmapNumaPrefault;
+
+typedef struct DmmapNumaWorker
+{
+    DmmapNumaPrefault* job;
+    int slot;
+} DmmapNumaWorker;
+
+// Maps the `index`-th stripe of a slot to a stripe of the range, returns 0 when the slot has no more
+static int dmmap__numa_stripe(const DmmapNumaPrefault* job, int slot, uint64_t index, size_t* stripe)
+{
+    if (job->policy == DMMAP_NUMA_INTERLEAVE)
+        *stripe = (size_t)(index * (uint64_t)job->slots + (uint64_t)slot);
+    else
+        *stripe = (size_t)((uint64_t)job->stripes * (uint64_t)slot / (uint64_t)job->slots + index);
+
+    size_t end = job->policy == DMMAP_NUMA_INTERLEAVE
+                     ? job->stripes
+                     : (size_t)((uint64_t)job->stripes * (uint64_t)(slot + 1) / (uint64_t)job->slots);
+    return *stripe < end;
+}
+
+// Touches one page per page of a range, page aligned
+static void dmmap__numa_touch(const char* begin, size_t size)
+{
+#ifdef __linux__
+    if (madvise((void*)begin, size, MADV_POPULATE_READ) == 0)
+        return;
+#endif
+    size_t page_size = dmmap__page_size();
+    volatile char sink = 0;
+    for (size_t at = 0; at < size; at += page_size)
+        sink ^= begin[at];
+    (void)sink;
+}
+
+#ifdef _WIN32
+int dmmap_numa_nodes(void)
+{
+    ULONG highest = 0;
+    if (!GetNumaHighestNodeNumber(&highest))
+        return 1;
+    return highest + 1 < DMMAP_NUMA_MAX_NODES ? (int)highest + 1 : DMMAP_NUMA_MAX_NODES;
+}
+
+static int dmmap__numa_online(int* nodes)
+{
+    int count = 0;
+    for (int node = 0; node < dmmap_numa_nodes(); ++node)
+    {
+        GROUP_AFFINITY affinity;
+        if (GetNumaNodeProcessorMaskEx((USHORT)node, &affinity) && affinity.Mask)
+            nodes[count++] = node;
+    }
+    if (count == 0)
+        nodes[count++] = 0;
+    return count;
+}
+
+// Moves the calling thread onto the CPUs of a node, the pages it touches first are allocated there
+static void dmmap__numa_enter(int node)
+{
+    GROUP_AFFINITY affinity;
+    if (GetNumaNodeProcessorMaskEx((USHORT)node, &affinity) && affinity.Mask)
+        SetThreadGroupAffinity(GetCurrentThread(), &affinity, NULL);
+}
+
+int dmmap_numa_set(DmmapFile* file, size_t offset, size_t length, DmmapNumaPolicy policy, int node)
+{
+    // Views cannot change their placement once mapped
+    (void)file;
+    (void)offset;
+    (void)length;
+    (void)policy;
+    (void)node;
+    return 0;
+}
+
+int dmmap_numa_node_of(const DmmapFile* file, size_t offset)
+{
+    if (!file->data || offset >= file->size)
+        return -1;
+
+    volatile char sink = ((const char*)file->data)[offset];
+    (void)sink;
+
+    PSAPI_WORKING_SET_EX_INFORMATION info;
+    info.VirtualAddress = (PVOID)((const char*)file->data + offset);
+    if (!QueryWorkingSetEx(GetCurrentProcess(), &info, sizeof(info)) || !info.VirtualAttributes.Valid)
+        return -1;
+    return (int)info.VirtualAttributes.Node;
+}
+
+#elif defined(__linux__)
+#ifndef MPOL_DEFAULT
+#define MPOL_DEFAULT 0
+#define MPOL_PREFERRED 1
+#define MPOL_BIND 2
+#define MPOL_INTERLEAVE 3
+#define MPOL_LOCAL 4
+#endif
+
+#ifndef MPOL_MF_MOVE
+#define MPOL_MF_MOVE (1 << 1)
+#endif
+
+#ifndef MPOL_F_NODE
+#define MPOL_F_NODE (1 << 0)
+#define MPOL_F_ADDR (1 << 1)
+#endif
+
+// Parses a sysfs list like "0-3,8,10-11" into a bit mask of `bits` bits, returns the number of bits set
+static int dmmap__numa_parse_list(const char* path, uint64_t* mask, int bits)
+{
+    char text[1024];
+    FILE* fp = fopen(path, "r");
+    if (!fp)
+        return 0;
+    size_t size = fread(text, 1, sizeof(text) - 1, fp);
+    fclose(fp);
+    text[size] = '\0';
+
+    int count = 0;
+    memset(mask, 0, (size_t)(bits + 63) / 64 * sizeof(uint64_t));
+    for (char* at = text; *at >= '0' && *at <= '9';)
+    {
+        long first = strtol(at, &at, 10);
+        long last = first;
+        if (*at == '-')
+            last = strtol(at + 1, &at, 10);
+        for (long bit = first; bit <= last && bit < bits; ++bit)
+        {
+            if (!(mask[bit / 64] >> (bit % 64) & 1))
+                ++count;
+            mask[bit / 64] |= (uint64_t)1 << (bit % 64);
+        }
+        if (*at == ',')
+            ++at;
+    }
+    return count;
+}
+
+static int dmmap__numa_online(int* nodes)
+{
+    uint64_t mask[DMMAP__NUMA_MASK_WORDS];
+    int count = 0;
+    if (dmmap__numa_parse_list("/sys/devices/system/node/online", mask, DMMAP_NUMA_MAX_NODES) > 0)
+    {
+        for (int node = 0; node < DMMAP_NUMA_MAX_NODES; ++node)
+        {
+            if (mask[node / 64] >> (node % 64) & 1)
+                nodes[count++] = node;
+        }
+    }
+    if (count == 0)
+        nodes[count++] = 0;
+    return count;
+}
+
+int dmmap_numa_nodes(void)
+{
+    int nodes[DMMAP_NUMA_MAX_NODES];
+    return dmmap__numa_online(nodes);
+}
+
+// Moves the calling thread onto the CPUs of a node and binds its allocations to it
+static void dmmap__numa_enter(int node)
+{
+    char path[64];
+    uint64_t cpus[DMMAP__NUMA_MAX_CPUS / 64];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+    if (dmmap__numa_parse_list(path, cpus, DMMAP__NUMA_MAX_CPUS) > 0)
+        syscall(SYS_sched_setaffinity, 0, sizeof(cpus), cpus);
+
+    uint64_t nodes[DMMAP__NUMA_MASK_WORDS] = {0};
+    nodes[node / 64] = (uint64_t)1 << (node % 64);
+    syscall(SYS_set_mempolicy, MPOL_BIND, nodes, (unsigned long)DMMAP_NUMA_MAX_NODES + 1);
+}
+
+int dmmap_numa_set(DmmapFile* file, size_t offset, size_t length, DmmapNumaPolicy policy, int node)
+{
+    if (!file->data || offset >= file->size || length == 0)
+        return 0;
+    if (length > file->size - offset)
+        length = file->size - offset;
+
+    uint64_t mask[DMMAP__NUMA_MASK_WORDS] = {0};
+    int mode = MPOL_DEFAULT;
+    if (policy == DMMAP_NUMA_LOCAL)
+        mode = MPOL_LOCAL;
+    else if (policy == DMMAP_NUMA_BIND)
+    {
+        if (node < 0 || node >= DMMAP_NUMA_MAX_NODES)
+            return 0;
+        mode = MPOL_BIND;
+        mask[node / 64] = (uint64_t)1 << (node % 64);
+    }
+    else if (policy == DMMAP_NUMA_INTERLEAVE)
+    {
+        int nodes[DMMAP_NUMA_MAX_NODES];
+        int count = dmmap__numa_online(nodes);
+        mode = MPOL_INTERLEAVE;
+        for (int i = 0; i < count; ++i)
+            mask[nodes[i] / 64] |= (uint64_t)1 << (nodes[i] % 64);
+    }
+
+    uintptr_t page_mask = (uintptr_t)dmmap__page_size() - 1;
+    uintptr_t start = (uintptr_t)file->data + offset;
+    uintptr_t begin = start & ~page_mask;
+    size_t size = (size_t)(((start + length + page_mask) & ~page_mask) - begin);
+    unsigned long maxnode = mode == MPOL_DEFAULT || mode == MPOL_LOCAL ? 0 : (unsigned long)DMMAP_NUMA_MAX_NODES + 1;
+
+    // Moving fails for pages other processes map as well, they keep their place
+    if (syscall(SYS_mbind, begin, size, mode, maxnode ? mask : NULL, maxnode, MPOL_MF_MOVE) == -1 &&
+        errno != EIO)
+        return 0;
+    return 1;
+}
+
+int dmmap_numa_node_of(const DmmapFile* file, size_t offset)
+{
+    if (!file->data || offset >= file->size)
+        return -1;
+
+    int node = -1;
+    if (syscall(SYS_get_mempolicy, &node, NULL, 0UL, (const char*)file->data + offset, MPOL_F_NODE | MPOL_F_ADDR) == -1)
+        return errno == ENOSYS ? 0 : -1;
+    return node;
+}
+
+#else
+static int dmmap__numa_online(int* nodes)
+{
+    nodes[0] = 0;
+    return 1;
+}
+
+static void dmmap__numa_enter(int node)
+{
+    (void)node;
+}
+
+int dmmap_numa_nodes(void)
+{
+    return 1;
+}
+
+int dmmap_numa_set(DmmapFile* file, size_t offset, size_t length, DmmapNumaPolicy policy, int node)
+{
+    (void)file;
+    (void)offset;
+    (void)length;
+    (void)policy;
+    (void)node;
+    return 0;
+}
+
+int dmmap_numa_node_of(const DmmapFile* file, size_t offset)
+{
+    return file->data && offset < file->size ? 0 : -1;
+}
+#endif
+
+// Touches the stripes of one slot until there are none left
+static void dmmap__numa_prefault_run(DmmapNumaPrefault* job, int slot)
+{
+    uintptr_t page_mask = (uintptr_t)dmmap__page_size() - 1;
+    uintptr_t first = (uintptr_t)job->file->data + job->offset;
+    uintptr_t last = first + job->length;
+    size_t stripe;
+    while (dmmap__numa_stripe(job, slot, DMMAP__ATOMIC_ADD(&job->next[slot], (uint64_t)1), &stripe))
+    {
+        uintptr_t begin = first + stripe * (uintptr_t)DMMAP_NUMA_STRIPE;
+        uintptr_t end = last - begin > DMMAP_NUMA_STRIPE ? begin + DMMAP_NUMA_STRIPE : last;
+        uintptr_t page = begin & ~page_mask;
+        dmmap__numa_touch((const char*)page, (size_t)(((end + page_mask) & ~page_mask) - page));
+        DMMAP__ATOMIC_ADD(&job->done, (uint64_t)(end - begin));
+        if (job->file->state)
+            dmmap__stats_add(job->file->state, offsetof(DmmapFileStats, bytes_prefetched), end - begin);
+    }
+}
+
+static void dmmap__numa_prefault_worker(void* arg)
+{
+    DmmapNumaWorker* worker = (DmmapNumaWorker*)arg;
+    if (worker->job->policy != DMMAP_NUMA_DEFAULT)
+        dmmap__numa_enter(worker->job->nodes[worker->slot]);
+    dmmap__numa_prefault_run(worker->job, worker->slot);
+}
+
+size_t dmmap_numa_prefault(DmmapFile* file, size_t offset, size_t length, DmmapNumaPolicy policy, int node,
+                           unsigned threads_per_node)
+{
+    if (!file->data || offset >= file->size || length == 0)
+        return 0;
+    if (length > file->size - offset)
+        length = file->size - offset;
+
+    DmmapNumaPrefault* job = (DmmapNumaPrefault*)calloc(1, sizeof(*job));
+    if (!job)
+        return 0;
+    job->file = file;
+    job->offset = offset;
+    job->length = length;
+    job->stripes = (length + DMMAP_NUMA_STRIPE - 1) / DMMAP_NUMA_STRIPE;
+    job->policy = policy;
+    if (policy == DMMAP_NUMA_LOCAL || policy == DMMAP_NUMA_INTERLEAVE)
+        job->slots = dmmap__numa_online(job->nodes);
+    else
+    {
+        job->slots = 1;
+        job->nodes[0] = node < 0 || node >= DMMAP_NUMA_MAX_NODES ? 0 : node;
+    }
+
+    size_t threads = (size_t)job->slots * (threads_per_node ? threads_per_node : 1);
+    DmmapNumaWorker* workers = (DmmapNumaWorker*)calloc(threads, sizeof(*workers));
+    DmmapThread* handles = (DmmapThread*)calloc(threads, sizeof(*handles));
+    size_t started = 0;
+    if (workers && handles)
+    {
+        for (size_t t = 0; t < threads; ++t)
+        {
+            workers[started].job = job;
+            workers[started].slot = (int)(t % (size_t)job->slots);
+            if (dmmap__thread_start(&handles[started], dmmap__numa_prefault_worker, &workers[started]))
+                ++started;
+        }
+    }
+
+    // Without a policy the calling thread helps, otherwise it must keep its own affinity and
+    // only picks up what threads that failed to start left behind
+    if (policy == DMMAP_NUMA_DEFAULT)
+        dmmap__numa_prefault_run(job, 0);
+    for (size_t t = 0; t < started; ++t)
+        dmmap__thread_join(handles[t]);
+    for (int slot = 0; slot < job->slots; ++slot)
+        dmmap__numa_prefault_run(job, slot);
+
+    size_t done = (size_t)job->done;
+    free(workers);
+    free(handles);
+    free(job);
+    return done;
+}
+
+// ***************************************************************************************
+// *  Replicated mappings
+// ***************************************************************************************
+
+typedef struct DmmapReplicaWorker
+{
+    DmmapReplicas* replicas;
+    const DmmapFile* file;
+    int node;
+} DmmapReplicaWorker;
+
+static DMMAP__THREAD_LOCAL int dmmap__replica_node = 0;
+static DMMAP__THREAD_LOCAL unsigned dmmap__replica_calls = 0;
+
+// Allocates the copy for a node from the thread running there and fills it
+static void dmmap__replica_worker(void* arg)
+{
+    DmmapReplicaWorker* worker = (DmmapReplicaWorker*)arg;
+    size_t size = worker->replicas->size;
+    dmmap__numa_enter(worker->node);
+
+#ifdef _WIN32
+    void* copy = VirtualAllocExNuma(GetCurrentProcess(), NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE,
+                                    (DWORD)worker->node);
+    if (!copy)
+        return;
+    memcpy(copy, worker->file->data, size);
+    DWORD old_protect;
+    VirtualProtect(copy, size, PAGE_READONLY, &old_protect);
+#else
+    void* copy = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (copy == MAP_FAILED)
+        return;
+#ifdef __linux__
+    // The thread's own policy already places the pages, this keeps them there if it moves
+    uint64_t nodes[DMMAP__NUMA_MASK_WORDS] = {0};
+    nodes[worker->node / 64] = (uint64_t)1 << (worker->node % 64);
+    syscall(SYS_mbind, copy, size, MPOL_BIND, nodes, (unsigned long)DMMAP_NUMA_MAX_NODES + 1, 0);
+#endif
+    memcpy(copy, worker->file->data, size);
+    mprotect(copy, size, PROT_READ);
+#endif
+
+    worker->replicas->data[worker->node] = copy;
+}
+
+int dmmap_replicas_open(DmmapReplicas* replicas, const DmmapFile* file)
+{
+    memset(replicas, 0, sizeof(*replicas));
+    if (!file->data || file->size == 0)
+        return 0;
+    replicas->size = file->size;
+
+    int nodes[DMMAP_NUMA_MAX_NODES];
+    int count = dmmap__numa_online(nodes);
+    DmmapReplicaWorker workers[DMMAP_NUMA_MAX_NODES];
+    DmmapThread threads[DMMAP_NUMA_MAX_NODES];
+    int started[DMMAP_NUMA_MAX_NODES];
+    for (int i = 0; i < count; ++i)
+    {
+        workers[i].replicas = replicas;
+        workers[i].file = file;
+        workers[i].node = nodes[i];
+        started[i] = dmmap__thread_start(&threads[i], dmmap__replica_worker, &workers[i]);
+    }
+
+    for (int i = 0; i < count; ++i)
+    {
+        if (started[i])
+            dmmap__thread_join(threads[i]);
+    }
+
+    for (int node = 0; node < DMMAP_NUMA_MAX_NODES; ++node)
+        replicas->count += replicas->data[node] != NULL;
+    return replicas->count > 0;
+}
+
+int dmmap_numa_current_node(void)
+{
+#ifdef _WIN32
+    PROCESSOR_NUMBER processor;
+    USHORT node;
+    GetCurrentProcessorNumberEx(&processor);
+    return GetNumaProcessorNodeEx(&processor, &node) ? (int)node : 0;
+#elif defined(__linux__)
+    unsigned cpu, node;
+    return syscall(SYS_getcpu, &cpu, &node, NULL) == 0 ? (int)node : 0;
+#else
+    return 0;
+#endif
+}
+
+const void* dmmap_replica(const DmmapReplicas* replicas)
+{
+    if (dmmap__replica_calls == 0)
+    {
+        dmmap__replica_node = dmmap_numa_current_node();
+        dmmap__replica_calls = DMMAP_REPLICA_RECHECK;
+    }
+    --dmmap__replica_calls;
+
+    int node = dmmap__replica_node;
+    if (node >= 0 && node < DMMAP_NUMA_MAX_NODES && replicas->data[node])
+        return replicas->data[node];
+
+    for (node = 0; node < DMMAP_NUMA_MAX_NODES; ++node)
+    {
+        if (replicas->data[node])
+            return replicas->data[node];
+    }
+    return NULL;
+}
+
+void dmmap_replicas_close(DmmapReplicas* replicas)
+{
+    for (int node = 0; node < DMMAP_NUMA_MAX_NODES; ++node)
+    {
+        if (!replicas->data[node])
+            continue;
+#ifdef _WIN32
+        VirtualFree((void*)replicas->data[node], 0, MEM_RELEASE);
+#else
+        munmap((void*)replicas->data[node], replicas->size);
+#endif
+    }
+    memset(replicas, 0, sizeof(*replicas));
+}
+
+// ***************************************************************************************
+// *  Parallel scan
+// ***************************************************************************************
+
+typedef struct DmmapScanWorker
+{
+    const DmmapFile* file;
+    DmmapScanFn fn;
+    void* user_data;
+    unsigned index;
+    DmmapScanWorkerStats stats;
+} DmmapScanWorker;
+
+#ifdef __linux__
+// Reads the first number of a sysfs file, -1 if missing
+static long dmmap__sysfs_number(const char* path)
+{
+    char text[32];
+    FILE* fp = fopen(path, "r");
+    if (!fp)
+        return -1;
+    size_t size = fread(text, 1, sizeof(text) - 1, fp);
+    fclose(fp);
+    text[size] = '\0';
+    return size ? strtol(text, NULL, 10) : -1;
+}
+// Orders CPUs so that consecutive ones sit in different packages: the first core of every
+// package, then the second of every package, and so on
+static unsigned dmmap__scan_deal(const int* cpus, const int* packages, unsigned count, int* out)
+{
+    unsigned rank[DMMAP_SCAN_MAX_THREADS];
+    for (unsigned i = 0; i < count; ++i)
+    {
+        rank[i] = 0;
+        for (unsigned j = 0; j < i; ++j)
+            rank[i] += packages[j] == packages[i];
+    }
+
+    unsigned placed = 0;
+    for (unsigned round = 0; placed < count; ++round)
+    {
+        for (unsigned i = 0; i < count; ++i)
+        {
+            if (rank[i] == round)
+                out[placed++] = cpus[i];
+        }
+    }
+    return placed;
+}
+#endif
+
+// Lists the CPUs to pin workers to, one per physical core first and their siblings after,
+// returns the count and the number of cores in `cores`
+static unsigned dmmap__scan_cpus(int* cpus, unsigned* cores)
+{
+    unsigned count = 0;
+    *cores = 0;
+
+#ifdef _WIN32
+    SYSTEM_LOGICAL_PROCESSOR_INFORMATION info[256];
+    DWORD length = sizeof(info);
+    DWORD_PTR process_mask, system_mask;
+    if (!GetProcessAffinityMask(GetCurrentProcess(), &process_mask, &system_mask) ||
+        !GetLogicalProcessorInformation(info, &length))
+        return 0;
+
+    size_t entries = length / sizeof(info[0]);
+    for (int sibling = 0; sibling < 2; ++sibling)
+    {
+        for (size_t i = 0; i < entries; ++i)
+        {
+            if (info[i].Relationship != RelationProcessorCore)
+                continue;
+
+            // The first allowed logical processor of a core is its primary
+            ULONG_PTR mask = info[i].ProcessorMask & process_mask;
+            for (int cpu = 0, seen = 0; mask && cpu < (int)(8 * sizeof(mask)); ++cpu)
+            {
+                if (!(mask >> cpu & 1))
+                    continue;
+                if ((seen++ > 0) == sibling && count < DMMAP_SCAN_MAX_THREADS)
+                    cpus[count++] = cpu;
+            }
+            if (!sibling && mask)
+                ++*cores;
+        }
+    }
+#elif defined(__linux__)
+    uint64_t allowed[DMMAP__NUMA_MAX_CPUS / 64];
+    memset(allowed, 0, sizeof(allowed));
+    if (syscall(SYS_sched_getaffinity, 0, sizeof(allowed), allowed) <= 0)
+        return 0;
+
+    // Primaries are the lowest allowed CPU of their sibling list
+    int primary[DMMAP_SCAN_MAX_THREADS], secondary[DMMAP_SCAN_MAX_THREADS];
+    int primary_package[DMMAP_SCAN_MAX_THREADS], secondary_package[DMMAP_SCAN_MAX_THREADS];
+    unsigned primaries = 0, secondaries = 0;
+    for (int cpu = 0; cpu < DMMAP__NUMA_MAX_CPUS; ++cpu)
+    {
+        if (!(allowed[cpu / 64] >> (cpu % 64) & 1))
+            continue;
+
+        char path[96];
+        uint64_t siblings[DMMAP__NUMA_MAX_CPUS / 64];
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpu);
+        int first = cpu;
+        if (dmmap__numa_parse_list(path, siblings, DMMAP__NUMA_MAX_CPUS) > 0)
+        {
+            for (int other = 0; other < cpu && first == cpu; ++other)
+            {
+                if ((siblings[other / 64] & allowed[other / 64]) >> (other % 64) & 1)
+                    first = other;
+            }
+        }
+
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+        int package = (int)dmmap__sysfs_number(path);
+        if (first == cpu && primaries < DMMAP_SCAN_MAX_THREADS)
+        {
+            primary_package[primaries] = package;
+            primary[primaries++] = cpu;
+        }
+        else if (first != cpu && secondaries < DMMAP_SCAN_MAX_THREADS)
+        {
+            secondary_package[secondaries] = package;
+            secondary[secondaries++] = cpu;
+        }
+    }
+
+    count = dmmap__scan_deal(primary, primary_package, primaries, cpus);
+    if (secondaries > DMMAP_SCAN_MAX_THREADS - count)
+        secondaries = DMMAP_SCAN_MAX_THREADS - count;
+    count += dmmap__scan_deal(secondary, secondary_package, secondaries, cpus + count);
+    *cores = primaries;
+#else
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    *cores = online > 0 ? (unsigned)online : 1;
+    if (*cores > DMMAP_SCAN_MAX_THREADS)
+        *cores = DMMAP_SCAN_MAX_THREADS;
+    for (; count < *cores; ++count)
+        cpus[count] = -1;
+#endif
+    return count;
+}
+
+static void dmmap__scan_pin(int cpu)
+{
+    if (cpu < 0)
+        return;
+#ifdef _WIN32
+    SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << cpu);
+#elif defined(__linux__)
+    uint64_t mask[DMMAP__NUMA_MAX_CPUS / 64];
+    memset(mask, 0, sizeof(mask));
+    mask[cpu / 64] = (uint64_t)1 << (cpu % 64);
+    syscall(SYS_sched_setaffinity, 0, sizeof(mask), mask);
+#endif
+}
+
+static void dmmap__scan_worker(void* arg)
+{
+    DmmapScanWorker* worker = (DmmapScanWorker*)arg;
+    dmmap__scan_pin(worker->stats.cpu);
+
+    uint64_t start = dmmap__now_ns();
+    if (worker->stats.bytes)
+        worker->fn(worker->user_data, worker->index, (const char*)worker->file->data + worker->stats.offset,
+                   worker->stats.offset, worker->stats.bytes);
+    worker->stats.seconds = (double)(dmmap__now_ns() - start) * 1e-9;
+    worker->stats.bytes_per_second = worker->stats.seconds > 0 ? (double)worker->stats.bytes / worker->stats.seconds : 0;
+}
+
+unsigned dmmap_scan(const DmmapFile* file, const DmmapScanOptions* options, DmmapScanFn fn, void* user_data,
+                    DmmapScanWorkerStats* stats)
+{
+    DmmapScanOptions defaults;
+    memset(&defaults, 0, sizeof(defaults));
+    if (!options)
+        options = &defaults;
+    if (!file->data || !fn)
+        return 0;
+
+    int cpus[DMMAP_SCAN_MAX_THREADS];
+    unsigned cores = 0;
+    unsigned available = dmmap__scan_cpus(cpus, &cores);
+    unsigned threads = options->threads;
+    if (threads == 0)
+        threads = options->smt ? available : cores;
+    if (threads == 0)
+        threads = 1;
+    if (threads > DMMAP_SCAN_MAX_THREADS)
+        threads = DMMAP_SCAN_MAX_THREADS;
+
+    DmmapScanWorker* workers = (DmmapScanWorker*)calloc(threads, sizeof(*workers));
+    DmmapThread* handles = (DmmapThread*)calloc(threads, sizeof(*handles));
+    uint8_t* started = (uint8_t*)calloc(threads, 1);
+    if (!workers || !handles || !started)
+    {
+        free(workers);
+        free(handles);
+        free(started);
+        return 0;
+    }
+
+    size_t granularity = options->granularity ? options->granularity : dmmap__page_size();
+    size_t units = (file->size + granularity - 1) / granularity;
+    for (unsigned t = 0; t < threads; ++t)
+    {
+        size_t begin = (size_t)((uint64_t)units * t / threads) * granularity;
+        size_t end = (size_t)((uint64_t)units * (t + 1) / threads) * granularity;
+        workers[t].file = file;
+        workers[t].fn = fn;
+        workers[t].user_data = user_data;
+        workers[t].index = t;
+        workers[t].stats.cpu = options->no_pin || available == 0 ? -1 : cpus[t % available];
+        workers[t].stats.offset = begin < file->size ? begin : file->size;
+        workers[t].stats.bytes = (end < file->size ? end : file->size) - workers[t].stats.offset;
+        started[t] = (uint8_t)dmmap__thread_start(&handles[t], dmmap__scan_worker, &workers[t]);
+    }
+
+    // Ranges whose thread did not start are run here, without moving the calling thread
+    for (unsigned t = 0; t < threads; ++t)
+    {
+        if (started[t])
+            dmmap__thread_join(handles[t]);
+        else
+        {
+            workers[t].stats.cpu = -1;
+            dmmap__scan_worker(&workers[t]);
+        }
+        if (stats)
+            stats[t] = workers[t].stats;
+    }
+
+    free(workers);
+    free(handles);
+    free(started);
+    return threads;
+}
+
+// ***************************************************************************************
+// *  Residency
+// ***************************************************************************************
+
+#define DMMAP__RESIDENCY_BATCH 4096
+
+// Clamps a range of a mapping and widens it to whole pages, returns the number of pages
+static size_t dmmap__residency_range(const DmmapFile* file, size_t offset, size_t length, uintptr_t* begin)
+{
+    if (!file->data || offset >= file->size || length == 0)
+        return 0;
+    if (length > file->size - offset)
+        length = file->size - offset;
+
+    size_t page_size = dmmap__page_size();
+    uintptr_t start = (uintptr_t)file->data + offset;
+    *begin = start & ~((uintptr_t)page_size - 1);
+    return (size_t)((start + length - *begin + page_size - 1) / page_size);
+}
+
+size_t dmmap_residency(const DmmapFile* file, size_t offset, size_t length, uint8_t* bitmap)
+{
+    uintptr_t begin;
+    size_t pages = dmmap__residency_range(file, offset, length, &begin);
+    if (!pages || !bitmap)
+        return pages;
+
+    uint8_t batch[DMMAP__RESIDENCY_BATCH];
+    size_t page_size = dmmap__page_size();
+    memset(bitmap, 0, (pages + 7) / 8);
+    for (size_t done = 0; done < pages; done += DMMAP__RESIDENCY_BATCH)
+    {
+        size_t count = pages - done < DMMAP__RESIDENCY_BATCH ? pages - done : DMMAP__RESIDENCY_BATCH;
+        if (!dmmap__residency((const void*)(begin + done * page_size), count, batch))
+            return 0;
+        for (size_t i = 0; i < count; ++i)
+            bitmap[(done + i) / 8] |= (uint8_t)(batch[i] << ((done + i) % 8));
+    }
+    return pages;
+}
+
+// Keeps the largest gaps sorted, largest first
+static void dmmap__residency_gap(DmmapResidencySummary* summary, size_t offset, size_t length)
+{
+    unsigned at = summary->gap_count;
+    while (at > 0 && summary->gaps[at - 1].length < length)
+        --at;
+    if (at >= DMMAP_RESIDENCY_GAPS)
+        return;
+
+    unsigned last = summary->gap_count < DMMAP_RESIDENCY_GAPS ? summary->gap_count : DMMAP_RESIDENCY_GAPS - 1;
+    memmove(&summary->gaps[at + 1], &summary->gaps[at], (last - at) * sizeof(summary->gaps[0]));
+    summary->gaps[at].offset = offset;
+    summary->gaps[at].length = length;
+    if (summary->gap_count < DMMAP_RESIDENCY_GAPS)
+        ++summary->gap_count;
+}
+
+int dmmap_residency_summary(const DmmapFile* file, size_t offset, size_t length, DmmapResidencySummary* summary)
+{
+    memset(summary, 0, sizeof(*summary));
+    uintptr_t begin;
+    size_t pages = dmmap__residency_range(file, offset, length, &begin);
+    if (!pages)
+        return 0;
+
+    uint8_t batch[DMMAP__RESIDENCY_BATCH];
+    size_t page_size = dmmap__page_size();
+    size_t gap_start = 0, gap_pages = 0;
+    for (size_t done = 0; done < pages; done += DMMAP__RESIDENCY_BATCH)
+    {
+        size_t count = pages - done < DMMAP__RESIDENCY_BATCH ? pages - done : DMMAP__RESIDENCY_BATCH;
+        if (!dmmap__residency((const void*)(begin + done * page_size), count, batch))
+            return 0;
+
+        for (size_t i = 0; i < count; ++i)
+        {
+            if (!batch[i])
+            {
+                if (gap_pages++ == 0)
+                    gap_start = done + i;
+                continue;
+            }
+
+            ++summary->resident;
+            if (gap_pages)
+                dmmap__residency_gap(summary, gap_start, gap_pages);
+            gap_pages = 0;
+        }
+    }
+    if (gap_pages)
+        dmmap__residency_gap(summary, gap_start, gap_pages);
+
+    // Gaps were collected in pages of the widened range, the first one may start before `data`
+    uintptr_t data = (uintptr_t)file->data;
+    for (unsigned i = 0; i < summary->gap_count; ++i)
+    {
+        uintptr_t gap_begin = begin + summary->gaps[i].offset * page_size;
+        uintptr_t gap_end = gap_begin + summary->gaps[i].length * page_size;
+        if (gap_begin < data)
+            gap_begin = data;
+        if (gap_end > data + file->size)
+            gap_end = data + file->size;
+        summary->gaps[i].offset = (size_t)(gap_begin - data);
+        summary->gaps[i].length = (size_t)(gap_end - gap_begin);
+    }
+
+    summary->pages = pages;
+    summary->percent = 100.0 * (double)summary->resident / (double)pages;
+    return 1;
+}
+
+size_t dmmap_residency_heatmap(const DmmapFile* file, size_t offset, size_t length, char* out, size_t cells)
+{
+    static const char levels[] = " .:-=+*#%@";
+    uintptr_t begin;
+    size_t pages = dmmap__residency_range(file, offset, length, &begin);
+    if (!pages || cells == 0)
+        return 0;
+
+    size_t* resident = (size_t*)calloc(cells, sizeof(size_t));
+    if (!resident)
+        return 0;
+
+    uint8_t batch[DMMAP__RESIDENCY_BATCH];
+    size_t page_size = dmmap__page_size();
+    for (size_t done = 0; done < pages; done += DMMAP__RESIDENCY_BATCH)
+    {
+        size_t count = pages - done < DMMAP__RESIDENCY_BATCH ? pages - done : DMMAP__RESIDENCY_BATCH;
+        if (!dmmap__residency((const void*)(begin + done * page_size), count, batch))
+        {
+            free(resident);
+            return 0;
+        }
+        for (size_t i = 0; i < count; ++i)
+            resident[(size_t)((uint64_t)(done + i) * cells / pages)] += batch[i];
+    }
+
+    for (size_t cell = 0; cell < cells; ++cell)
+    {
+        // Cells get one page more or less when `pages` is not a multiple of `cells`
+        size_t first = (size_t)(((uint64_t)cell * pages + cells - 1) / cells);
+        size_t end = (size_t)(((uint64_t)(cell + 1) * pages + cells - 1) / cells);
+        size_t total = end - first;
+        size_t level = total ? (resident[cell] * (sizeof(levels) - 2) + total - 1) / total : 0;
+        out[cell] = levels[level];
+    }
+    out[cells] = '\0';
+
+    free(resident);
+    return cells;
+}
+
+// ***************************************************************************************
+// *  Access profiles
+// ***************************************************************************************
+
+typedef struct DmmapProfileEntry
+{
+    struct DmmapProfileEntry* next;
+    char* path;
+    size_t size;
+    size_t units;
+    uint32_t* first;   // Sample in which each unit was first seen turning resident, 0 for never
+    uint8_t* resident; // One bit per page, resident at the previous scan
+    int primed;        // The first scan took the snapshot, later ones record changes
+} DmmapProfileEntry;
+
+typedef struct DmmapProfileRun
+{
+    DmmapState* state;
+    uintptr_t begin;
+    size_t length;
+    uint32_t sample;
+    size_t order; // Position in the profile, keeps the sort stable
+} DmmapProfileRun;
+
+typedef struct DmmapProfileReplay
+{
+    DmmapProfileRun* runs;
+    size_t count;
+    uint64_t next;
+    uint64_t bytes;
+} DmmapProfileReplay;
+
+static DmmapMutex dmmap__profile_lock = DMMAP__MUTEX_INIT; // Guards the entries and the thread
+static DmmapProfileEntry* dmmap__profile = NULL;
+static DmmapThread dmmap__profile_thread;
+static int dmmap__profile_running = 0;
+static uint64_t dmmap__profile_stop = 0;
+static uint64_t dmmap__profile_recording = 0; // Mappings opened meanwhile are snapshot right away
+static DmmapProfileOptions dmmap__profile_options;
+
+static void dmmap__profile_clear(void)
+{
+    while (dmmap__profile)
+    {
+        DmmapProfileEntry* entry = dmmap__profile;
+        dmmap__profile = entry->next;
+        free(entry->first);
+        free(entry->resident);
+        free(entry->path);
+        free(entry);
+    }
+}
+
+static size_t dmmap__profile_unit_pages(void)
+{
+    size_t unit_pages = DMMAP_PROFILE_UNIT / dmmap__page_size();
+    return unit_pages ? unit_pages : 1;
+}
+
+// Returns the entry of a path, created on first use; callers hold `dmmap__profile_lock`
+static DmmapProfileEntry* dmmap__profile_entry(const char* path, size_t size)
+{
+    for (DmmapProfileEntry* entry = dmmap__profile; entry; entry = entry->next)
+    {
+        if (entry->size == size && strcmp(entry->path, path) == 0)
+            return entry;
+    }
+
+    DmmapProfileEntry* entry = (DmmapProfileEntry*)calloc(1, sizeof(*entry));
+    size_t path_size = strlen(path) + 1;
+    if (!entry || !(entry->path = (char*)malloc(path_size)))
+    {
+        free(entry);
+        return NULL;
+    }
+    entry->size = size;
+    entry->units = (size + DMMAP_PROFILE_UNIT - 1) / DMMAP_PROFILE_UNIT;
+    entry->first = (uint32_t*)calloc(entry->units, sizeof(uint32_t));
+    entry->resident = (uint8_t*)calloc((entry->units + 1) * dmmap__profile_unit_pages() / 8 + 1, 1);
+    if (!entry->first || !entry->resident)
+    {
+        free(entry->first);
+        free(entry->resident);
+        free(entry->path);
+        free(entry);
+        return NULL;
+    }
+    memcpy(entry->path, path, path_size);
+    entry->next = dmmap__profile;
+    dmmap__profile = entry;
+    return entry;
+}
+
+// Compares the residency of a mapping with the previous scan and stamps the units with a
+// page that turned resident since with `sample`. The first scan of an entry only takes the
+// snapshot, what is resident then was cached before and not touched by the process.
+// Callers hold `dmmap__profile_lock`.
+static void dmmap__profile_scan(DmmapProfileEntry* entry, const DmmapState* state, uint32_t sample)
+{
+    size_t unit_pages = dmmap__profile_unit_pages();
+    uint8_t pages[DMMAP__RESIDENCY_BATCH];
+
+    // Whole units at a time, so that a batch never splits one
+    size_t batch_units = DMMAP__RESIDENCY_BATCH / unit_pages;
+    for (size_t unit = 0; unit < entry->units; unit += batch_units)
+    {
+        size_t units = entry->units - unit < batch_units ? entry->units - unit : batch_units;
+        uintptr_t begin;
+        size_t count =
+            dmmap__residency_range(&state->file, unit * DMMAP_PROFILE_UNIT, units * DMMAP_PROFILE_UNIT, &begin);
+        if (!count || !dmmap__residency((const void*)begin, count, pages))
+            break;
+
+        for (size_t i = 0; i < count; ++i)
+        {
+            size_t page = unit * unit_pages + i;
+            uint8_t bit = (uint8_t)(1u << (page % 8));
+            int was_resident = (entry->resident[page / 8] & bit) != 0;
+            if (pages[i])
+                entry->resident[page / 8] |= bit;
+            else
+                entry->resident[page / 8] &= (uint8_t)~bit;
+
+            uint32_t* first = &entry->first[unit + i / unit_pages];
+            if (entry->primed && pages[i] && !was_resident && !*first)
+                *first = sample;
+        }
+    }
+    entry->primed = 1;
+}
+
+// Snapshots a mapping opened during a recording before the process can touch it
+static void dmmap__profile_track(const DmmapState* state)
+{
+    if (!state->path || !DMMAP__ATOMIC_LOAD(&dmmap__profile_recording))
+        return;
+
+    dmmap__mutex_lock(&dmmap__profile_lock);
+    DmmapProfileEntry* entry = dmmap__profile_entry(state->path, state->file.size);
+    if (entry && !entry->primed)
+        dmmap__profile_scan(entry, state, 0);
+    dmmap__mutex_unlock(&dmmap__profile_lock);
+}
+
+// Records the units of every mapping that turned resident since the last sample
+static void dmmap__profile_sample(uint32_t sample)
+{
+    // Sample a snapshot of the registry, opening and closing files must not wait for
+    // a whole sample. The references keep the entries alive, a mapping closed meanwhile
+    // is skipped or fails its residency query.
+    dmmap__mutex_lock(&dmmap__registry_lock);
+    size_t held = 0;
+    DmmapState** states = (DmmapState**)malloc((dmmap__registry_count + 1) * sizeof(*states));
+    for (DmmapState* state = dmmap__registry; states && state; state = state->next)
+    {
+        if (state->path)
+        {
+            ++state->refs;
+            states[held++] = state;
+        }
+    }
+    dmmap__mutex_unlock(&dmmap__registry_lock);
+
+    dmmap__mutex_lock(&dmmap__profile_lock);
+    for (size_t k = 0; k < held; ++k)
+    {
+        DmmapState* state = states[k];
+        DmmapProfileEntry* entry = NULL;
+        if (!DMMAP__ATOMIC_LOAD(&state->removed))
+            entry = dmmap__profile_entry(state->path, state->file.size);
+        if (entry)
+            dmmap__profile_scan(entry, state, sample);
+    }
+    dmmap__mutex_unlock(&dmmap__profile_lock);
+
+    for (size_t k = 0; k < held; ++k)
+        dmmap__state_release(states[k], 1);
+    free(states);
+}
+
+static void dmmap__profile_main(void* arg)
+{
+    (void)arg;
+    uint64_t start = dmmap__now_ns();
+    for (uint32_t sample = 1; !DMMAP__ATOMIC_LOAD(&dmmap__profile_stop); ++sample)
+    {
+        dmmap__profile_sample(sample);
+        if (dmmap__profile_options.duration_ms &&
+            dmmap__now_ns() - start >= (uint64_t)dmmap__profile_options.duration_ms * 1000000u)
+            break;
+
+        for (unsigned slept = 0; slept < dmmap__profile_options.interval_ms && !DMMAP__ATOMIC_LOAD(&dmmap__profile_stop);
+             slept += 10)
+            dmmap__sleep_ms(10);
+    }
+    DMMAP__ATOMIC_STORE(&dmmap__profile_recording, (uint64_t)0);
+}
+
+int dmmap_profile_start(const DmmapProfileOptions* options)
+{
+    dmmap_profile_stop();
+
+    dmmap__mutex_lock(&dmmap__profile_lock);
+    dmmap__profile_clear();
+    memset(&dmmap__profile_options, 0, sizeof(dmmap__profile_options));
+    if (options)
+        dmmap__profile_options = *options;
+    if (!dmmap__profile_options.interval_ms)
+        dmmap__profile_options.interval_ms = 250;
+
+    DMMAP__ATOMIC_STORE(&dmmap__profile_stop, (uint64_t)0);
+    DMMAP__ATOMIC_STORE(&dmmap__profile_recording, (uint64_t)1);
+    dmmap__profile_running = dmmap__thread_start(&dmmap__profile_thread, dmmap__profile_main, NULL);
+    if (!dmmap__profile_running)
+        DMMAP__ATOMIC_STORE(&dmmap__profile_recording, (uint64_t)0);
+    dmmap__mutex_unlock(&dmmap__profile_lock);
+    return dmmap__profile_running;
+}
+
+void dmmap_profile_stop(void)
+{
+    dmmap__mutex_lock(&dmmap__profile_lock);
+    int running = dmmap__profile_running;
+    dmmap__profile_running = 0;
+    dmmap__mutex_unlock(&dmmap__profile_lock);
+
+    // Joined without the lock, the thread takes it for every sample
+    if (running)
+    {
+        DMMAP__ATOMIC_STORE(&dmmap__profile_stop, (uint64_t)1);
+        dmmap__thread_join(dmmap__profile_thread);
+    }
+}
+
+int dmmap_profile_save(const char* filename)
+{
+    FILE* fp = fopen(filename, "w");
+    if (!fp)
+        return 0;
+
+    // Runs of consecutive units first seen in the same sample
+    dmmap__mutex_lock(&dmmap__profile_lock);
+    int ok = dmmap__profile != NULL && fprintf(fp, "dmmap-profile 1 %u\n", (unsigned)DMMAP_PROFILE_UNIT) > 0;
+    for (DmmapProfileEntry* entry = dmmap__profile; ok && entry; entry = entry->next)
+    {
+        size_t runs = 0;
+        for (size_t unit = 0; unit < entry->units; ++unit)
+            runs += entry->first[unit] && (unit == 0 || entry->first[unit - 1] != entry->first[unit]);
+
+        fprintf(fp, "mapping %llu %llu %s\n", (unsigned long long)entry->size, (unsigned long long)runs, entry->path);
+        for (size_t unit = 0; unit < entry->units;)
+        {
+            size_t end = unit + 1;
+            while (end < entry->units && entry->first[end] == entry->first[unit])
+                ++end;
+            if (entry->first[unit])
+                fprintf(fp, "%llu %llu %u\n", (unsigned long long)unit * DMMAP_PROFILE_UNIT,
+                        (unsigned long long)(end - unit) * DMMAP_PROFILE_UNIT, entry->first[unit]);
+            unit = end;
+        }
+    }
+    dmmap__mutex_unlock(&dmmap__profile_lock);
+
+    ok = fclose(fp) == 0 && ok;
+    return ok;
+}
+
+// Opens a saved profile and checks its header, returns NULL if it is not one
+static FILE* dmmap__profile_open(const char* filename)
+{
+    FILE* fp = fopen(filename, "r");
+    unsigned unit = 0;
+    if (fp && (fscanf(fp, "dmmap-profile 1 %u", &unit) != 1 || unit == 0))
+    {
+        fclose(fp);
+        return NULL;
+    }
+    return fp;
+}
+
+// Reads the header of the next mapping of a profile, its `runs` lines of "offset length sample" follow
+static int dmmap__profile_mapping(FILE* fp, unsigned long long* size, unsigned long long* runs, char* path,
+                                  size_t path_size)
+{
+    if (fscanf(fp, " mapping %llu %llu ", size, runs) != 2 || !fgets(path, (int)path_size, fp))
+        return 0;
+    path[strcspn(path, "\r\n")] = '\0';
+    return 1;
+}
+
+static int dmmap__profile_run_compare(const void* a, const void* b)
+{
+    const DmmapProfileRun* x = (const DmmapProfileRun*)a;
+    const DmmapProfileRun* y = (const DmmapProfileRun*)b;
+    if (x->sample != y->sample)
+        return x->sample < y->sample ? -1 : 1;
+    return x->order < y->order ? -1 : x->order > y->order;
+}
+
+static void dmmap__profile_replay_worker(void* arg)
+{
+    DmmapProfileReplay* replay = (DmmapProfileReplay*)arg;
+    size_t page_mask = dmmap__page_size() - 1;
+    for (uint64_t i; (i = DMMAP__ATOMIC_ADD(&replay->next, (uint64_t)1)) < replay->count;)
+    {
+        DmmapProfileRun* run = &replay->runs[i];
+        if (!DMMAP__ATOMIC_LOAD(&run->state->removed))
+        {
+            uintptr_t begin = run->begin & ~(uintptr_t)page_mask;
+            size_t length = (size_t)(run->begin + run->length - begin + page_mask) & ~page_mask;
+#ifdef __linux__
+            if (madvise((void*)begin, length, MADV_POPULATE_READ) != 0)
+                dmmap__willneed((const void*)begin, length);
+#else
+            dmmap__willneed((const void*)begin, length);
+#endif
+            DMMAP__ATOMIC_ADD(&replay->bytes, (uint64_t)run->length);
+            dmmap__stats_add(run->state, offsetof(DmmapFileStats, bytes_prefetched), run->length);
+        }
+
+        // Every run holds a reference on its entry, the file may be closed meanwhile
+        dmmap__state_release(run->state, 1);
+    }
+}
+
+size_t dmmap_profile_replay(const char* filename, unsigned threads)
+{
+    FILE* fp = dmmap__profile_open(filename);
+    if (!fp)
+        return 0;
+
+    DmmapProfileReplay replay;
+    memset(&replay, 0, sizeof(replay));
+    size_t capacity = 0;
+    int ok = 1;
+    char line[4096];
+    unsigned long long size, runs;
+    while (ok && dmmap__profile_mapping(fp, &size, &runs, line, sizeof(line)))
+    {
+        // The mapping of the path, the profile is skipped if it is not open
+        DmmapFile file = {0};
+        DmmapState* match = NULL;
+        uint64_t added = 0;
+        dmmap__mutex_lock(&dmmap__registry_lock);
+        for (DmmapState* state = dmmap__registry; state; state = state->next)
+        {
+            if (state->path && strcmp(state->path, line) == 0)
+            {
+                file = state->file;
+                match = state;
+                ++match->refs;
+                break;
+            }
+        }
+        dmmap__mutex_unlock(&dmmap__registry_lock);
+
+        for (unsigned long long r = 0; r < runs; ++r)
+        {
+            unsigned long long offset, length;
+            unsigned sample;
+            if (fscanf(fp, "%llu %llu %u", &offset, &length, &sample) != 3)
+            {
+                ok = 0;
+                break;
+            }
+            if (!file.data || offset >= file.size)
+                continue;
+            if (length > file.size - offset)
+                length = file.size - offset;
+
+            if (replay.count == capacity)
+            {
+                size_t grown = capacity ? capacity * 2 : 256;
+                DmmapProfileRun* more = (DmmapProfileRun*)realloc(replay.runs, grown * sizeof(*more));
+                if (!more)
+                {
+                    ok = 0;
+                    break;
+                }
+                replay.runs = more;
+                capacity = grown;
+            }
+            DmmapProfileRun* run = &replay.runs[replay.count];
+            run->state = match;
+            run->begin = (uintptr_t)file.data + (uintptr_t)offset;
+            run->length = (size_t)length;
+            run->sample = sample;
+            run->order = replay.count++;
+            ++added;
+        }
+
+        // Trade the reference held while reading for one per run
+        if (match)
+        {
+            dmmap__mutex_lock(&dmmap__registry_lock);
+            match->refs += added;
+            dmmap__mutex_unlock(&dmmap__registry_lock);
+            dmmap__state_release(match, 1);
+        }
+    }
+    fclose(fp);
+
+    if (replay.count)
+        qsort(replay.runs, replay.count, sizeof(*replay.runs), dmmap__profile_run_compare);
+
+    if (!threads)
+        threads = 4;
+    DmmapThread* handles = (DmmapThread*)calloc(threads, sizeof(*handles));
+    unsigned started = 0;
+    for (unsigned t = 0; handles && t < threads && replay.count; ++t)
+    {
+        if (dmmap__thread_start(&handles[started], dmmap__profile_replay_worker, &replay))
+            ++started;
+    }
+
+    // Whatever threads could not be started leave to the caller
+    dmmap__profile_replay_worker(&replay);
+    for (unsigned t = 0; t < started; ++t)
+        dmmap__thread_join(handles[t]);
+
+    free(handles);
+    free(replay.runs);
+    return (size_t)replay.bytes;
+}
+
+// ***************************************************************************************
+// *  Hot-first layout
+// ***************************************************************************************
+
+typedef struct DmmapHotRecord
+{
+    uint32_t sample;
+    size_t index;
+} DmmapHotRecord;
+
+static int dmmap__hot_record_compare(const void* a, const void* b)
+{
+    const DmmapHotRecord* x = (const DmmapHotRecord*)a;
+    const DmmapHotRecord* y = (const DmmapHotRecord*)b;
+    if (x->sample != y->sample)
+        return x->sample < y->sample ? -1 : 1;
+    return x->index < y->index ? -1 : x->index > y->index;
+}
+
+// Reads the first sample in which each record was touched from a profile, 0 for untouched
+static int dmmap__relayout_samples(const char* profile, const char* filename, size_t size, size_t record_size,
+                                   uint32_t* first, size_t records)
+{
+    FILE* fp = dmmap__profile_open(profile);
+    if (!fp)
+        return 0;
+
+    int ok = 1;
+    int matched = 0;
+    char path[4096];
+    unsigned long long mapping_size, runs;
+    while (ok && dmmap__profile_mapping(fp, &mapping_size, &runs, path, sizeof(path)))
+    {
+        int match = strcmp(path, filename) == 0;
+        matched |= match;
+        for (unsigned long long r = 0; r < runs; ++r)
+        {
+            unsigned long long offset, length;
+            unsigned sample;
+            if (fscanf(fp, "%llu %llu %u", &offset, &length, &sample) != 3)
+            {
+                ok = 0;
+                break;
+            }
+            if (!match || offset >= size || length == 0)
+                continue;
+
+            size_t last = (size_t)(offset + length - 1 < size ? offset + length - 1 : size - 1);
+            for (size_t record = (size_t)offset / record_size; record <= last / record_size && record < records; ++record)
+            {
+                if (!first[record] || sample < first[record])
+                    first[record] = sample;
+            }
+        }
+    }
+    fclose(fp);
+
+    // A profile without the file would produce an unchanged layout that claims to be optimized
+    return ok && matched;
+}
+
+int dmmap_relayout(const char* filename, size_t record_size, const char* profile, const char* output,
+                   const char* remap, DmmapRelayoutStats* stats)
+{
+    if (stats)
+        memset(stats, 0, sizeof(*stats));
+    if (record_size == 0)
+        return 0;
+
+    DmmapFile source = dmmap_file_open(filename, 1);
+    if (!source.data)
+        return 0;
+
+    size_t records = source.size / record_size;
+    uint32_t* first = (uint32_t*)calloc(records, sizeof(uint32_t));
+    DmmapHotRecord* hot = (DmmapHotRecord*)malloc(records * sizeof(DmmapHotRecord));
+    if (!records || !first || !hot || !dmmap__relayout_samples(profile, filename, source.size, record_size, first, records))
+    {
+        free(first);
+        free(hot);
+        dmmap_file_close(&source);
+        return 0;
+    }
+
+    size_t hot_count = 0;
+    for (size_t record = 0; record < records; ++record)
+    {
+        if (first[record])
+        {
+            hot[hot_count].sample = first[record];
+            hot[hot_count].index = record;
+            ++hot_count;
+        }
+    }
+    qsort(hot, hot_count, sizeof(*hot), dmmap__hot_record_compare);
+
+    // With no record or every record hot the layout would be the same, most likely the
+    // profile was recorded with the file already cached
+    if (stats)
+    {
+        stats->records = records;
+        stats->hot_records = hot_count;
+    }
+    if (hot_count == 0 || hot_count == records)
+    {
+        free(first);
+        free(hot);
+        dmmap_file_close(&source);
+        return 0;
+    }
+
+    DmmapFile target = dmmap_file_create(output, source.size);
+    DmmapFile table = dmmap_file_create(remap, records * sizeof(uint64_t));
+    int ok = target.data && table.data;
+    if (ok)
+    {
+        const char* from = (const char*)source.data;
+        char* to = (char*)target.data;
+        uint64_t* new_index = (uint64_t*)table.data;
+        size_t next = 0;
+
+        // Hot records in first-touch order, then the cold ones packed after them in file order
+        for (size_t i = 0; i < hot_count; ++i)
+            new_index[hot[i].index] = next++;
+        for (size_t record = 0; record < records; ++record)
+        {
+            if (!first[record])
+                new_index[record] = next++;
+        }
+        for (size_t record = 0; record < records; ++record)
+            memcpy(to + new_index[record] * record_size, from + record * record_size, record_size);
+        memcpy(to + records * record_size, from + records * record_size, source.size - records * record_size);
+
+        if (stats)
+        {
+            size_t page_size = dmmap__page_size();
+            size_t last_page = (size_t)-1;
+            for (size_t record = 0; record < records; ++record)
+            {
+                if (!first[record])
+                    continue;
+                size_t begin = record * record_size / page_size;
+                size_t end = ((record + 1) * record_size - 1) / page_size;
+                stats->pages_before += end - begin + 1 - (begin == last_page);
+                last_page = end;
+            }
+            stats->records = records;
+            stats->hot_records = hot_count;
+            stats->pages_after = (hot_count * record_size + page_size - 1) / page_size;
+        }
+    }
+
+    dmmap_file_close(&table);
+    dmmap_file_close(&target);
+    dmmap_file_close(&source);
+    free(first);
+    free(hot);
+
+    // Creating a file truncates it, do not leave a half-written layout behind
+    if (!ok)
+    {
+        remove(output);
+        remove(remap);
+    }
+    return ok;
+}
+
+// ***************************************************************************************
+// *  Adaptive readahead
+// ***************************************************************************************
+
+// Prefetches `[offset, offset + length)` of a mapping, clamped to it
+static void dmmap__readahead_fetch(const DmmapFile* file, uint64_t offset, uint64_t length)
+{
+    if (offset >= file->size || length == 0)
+        return;
+
+    // The pressure watcher cut readahead short, a prefetch would refill what it paged out
+    if (file->state && DMMAP__ATOMIC_LOAD(&file->state->pressured))
+        return;
+
+    if (length > file->size - offset)
+        length = file->size - offset;
+    dmmap__willneed((const char*)file->data + offset, (size_t)length);
+    dmmap__stats_add(file->state, offsetof(DmmapFileStats, bytes_prefetched), length);
+}
+
+static void dmmap__readahead(DmmapFile* file, size_t offset, size_t length)
+{
+    DmmapState* state = file->state;
+    uint64_t last = DMMAP__ATOMIC_LOAD(&state->last);
+    uint64_t last_end = DMMAP__ATOMIC_LOAD(&state->last_end);
+    uint64_t stride = (uint64_t)offset - last;
+    uint64_t end = (uint64_t)offset + length;
+
+    // Sequential readers may overlap the previous access or skip less than a page
+    uint64_t kind = DMMAP_PATTERN_RANDOM;
+    if (offset >= last && offset <= last_end + dmmap__page_size())
+        kind = DMMAP_PATTERN_SEQUENTIAL;
+    else if (stride == DMMAP__ATOMIC_LOAD(&state->stride))
+        kind = DMMAP_PATTERN_STRIDED;
+
+    DMMAP__ATOMIC_STORE(&state->last, (uint64_t)offset);
+    DMMAP__ATOMIC_STORE(&state->last_end, end);
+    DMMAP__ATOMIC_STORE(&state->stride, stride);
+
+    uint64_t hits = 1;
+    if (DMMAP__ATOMIC_LOAD(&state->candidate) == kind)
+        hits = DMMAP__ATOMIC_ADD(&state->hits, (uint64_t)1) + 1;
+    else
+    {
+        DMMAP__ATOMIC_STORE(&state->candidate, kind);
+        DMMAP__ATOMIC_STORE(&state->hits, hits);
+    }
+
+    uint64_t pattern = DMMAP__ATOMIC_LOAD(&state->pattern);
+    if (hits >= DMMAP_READAHEAD_CONFIRM && pattern != kind)
+    {
+#ifndef _WIN32
+        // The first switch saves the advice of the mapping, disabling the controller restores it
+        if (pattern == DMMAP_PATTERN_UNKNOWN)
+        {
+            dmmap__mutex_lock(&dmmap__registry_lock);
+            state->advice_before = state->advice;
+            dmmap__mutex_unlock(&dmmap__registry_lock);
+        }
+#endif
+        pattern = kind;
+        DMMAP__ATOMIC_STORE(&state->pattern, pattern);
+        DMMAP__ATOMIC_STORE(&state->window, (uint64_t)DMMAP_READAHEAD_MIN);
+        DMMAP__ATOMIC_STORE(&state->prefetched, end);
+#ifndef _WIN32
+        dmmap__advise(file, pattern == DMMAP_PATTERN_SEQUENTIAL ? MADV_SEQUENTIAL : MADV_RANDOM);
+#endif
+
+        // Catch up with the strides a switching reader is about to touch
+        for (uint64_t ahead = 1; pattern == DMMAP_PATTERN_STRIDED && ahead < DMMAP_READAHEAD_STRIDES; ++ahead)
+            dmmap__readahead_fetch(file, (uint64_t)offset + ahead * stride, length);
+    }
+
+    if (pattern == DMMAP_PATTERN_SEQUENTIAL)
+    {
+        // Top up once the reader is half way into the window, and widen it each time
+        uint64_t window = DMMAP__ATOMIC_LOAD(&state->window);
+        uint64_t prefetched = DMMAP__ATOMIC_LOAD(&state->prefetched);
+        if (end + window / 2 >= prefetched)
+        {
+            uint64_t from = prefetched > end ? prefetched : end;
+            dmmap__readahead_fetch(file, from, end + window - from);
+            DMMAP__ATOMIC_STORE(&state->prefetched, end + window);
+            DMMAP__ATOMIC_STORE(&state->window, window * 2 < DMMAP_READAHEAD_MAX ? window * 2 : (uint64_t)DMMAP_READAHEAD_MAX);
+        }
+    }
+    else if (pattern == DMMAP_PATTERN_STRIDED && kind == DMMAP_PATTERN_STRIDED)
+        dmmap__readahead_fetch(file, (uint64_t)offset + DMMAP_READAHEAD_STRIDES * stride, length);
+}
+
+int dmmap_readahead_auto(DmmapFile* file, int enable)
+{
+    DmmapState* state = file->state;
+    if (!state)
+        return 0;
+
+    DMMAP__ATOMIC_STORE(&state->readahead, (uint64_t)(enable != 0));
+    DMMAP__ATOMIC_STORE(&state->candidate, (uint64_t)DMMAP_PATTERN_UNKNOWN);
+    DMMAP__ATOMIC_STORE(&state->hits, (uint64_t)0);
+    if (!enable && DMMAP__ATOMIC_LOAD(&state->pattern) != DMMAP_PATTERN_UNKNOWN)
+    {
+#ifndef _WIN32
+        dmmap__mutex_lock(&dmmap__registry_lock);
+        int advice = state->advice_before;
+        dmmap__mutex_unlock(&dmmap__registry_lock);
+        dmmap__advise(file, advice);
+#endif
+    }
+    DMMAP__ATOMIC_STORE(&state->pattern, (uint64_t)DMMAP_PATTERN_UNKNOWN);
+    return 1;
+}
+
+DmmapAccessPattern dmmap_access_pattern(const DmmapFile* file)
+{
+    return file->state ? (DmmapAccessPattern)DMMAP__ATOMIC_LOAD(&file->state->pattern) : DMMAP_PATTERN_UNKNOWN;
+}
+
+// ***************************************************************************************
+// *  Performance counters
+// ***************************************************************************************
+
+#if !defined(_WIN32) && defined(__linux__) && !defined(RUSAGE_THREAD)
+#define RUSAGE_THREAD 1
+#endif
+
+static uint64_t dmmap__stats_on = 0;
+static DmmapFileStats dmmap__stats_total;
+
+static int dmmap__stats_enabled(void)
+{
+    return DMMAP__ATOMIC_LOAD(&dmmap__stats_on) != 0;
+}
+
+// Adds to one counter, given by its offset in `DmmapFileStats`, of a mapping and of the totals
+static void dmmap__stats_add(DmmapState* state, size_t counter, uint64_t value)
+{
+    if (!dmmap__stats_enabled())
+        return;
+
+    DMMAP__ATOMIC_ADD((uint64_t*)((char*)&dmmap__stats_total + counter), value);
+    if (state)
+        DMMAP__ATOMIC_ADD((uint64_t*)((char*)&state->stats + counter), value);
+}
+
+static void dmmap__stats_open(const DmmapFile* file, const uint64_t* marks)
+{
+    if (!file->data)
+        return;
+
+    dmmap__stats_add(file->state, offsetof(DmmapFileStats, opens), 1);
+    dmmap__stats_add(file->state, offsetof(DmmapFileStats, open_ns), marks[1] - marks[0]);
+    dmmap__stats_add(file->state, offsetof(DmmapFileStats, fstat_ns), marks[2] - marks[1]);
+    dmmap__stats_add(file->state, offsetof(DmmapFileStats, map_ns), marks[3] - marks[2]);
+}
+
+static void dmmap__stats_unmap(uint64_t start)
+{
+    dmmap__stats_add(NULL, offsetof(DmmapFileStats, unmap_ns), dmmap__now_ns() - start);
+}
+
+// Fault counts of the calling thread, of the process where threads are not counted apart
+static void dmmap__fault_counts(uint64_t* minor, uint64_t* major)
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    *minor = GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)) ? counters.PageFaultCount : 0;
+    *major = 0;
+#else
+    struct rusage usage;
+#ifdef RUSAGE_THREAD
+    int who = RUSAGE_THREAD;
+#else
+    int who = RUSAGE_SELF;
+#endif
+    if (getrusage(who, &usage) == -1)
+        memset(&usage, 0, sizeof(usage));
+    *minor = (uint64_t)usage.ru_minflt;
+    *major = (uint64_t)usage.ru_majflt;
+#endif
+}
+
+void dmmap_stats_enable(int enable)
+{
+    DMMAP__ATOMIC_STORE(&dmmap__stats_on, (uint64_t)(enable != 0));
+}
+
+int dmmap_file_stats(const DmmapFile* file, DmmapFileStats* stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    if (!file->state)
+        return 0;
+
+    const uint64_t* from = (const uint64_t*)&file->state->stats;
+    uint64_t* to = (uint64_t*)stats;
+    for (size_t i = 0; i < sizeof(*stats) / sizeof(uint64_t); ++i)
+        to[i] = DMMAP__ATOMIC_LOAD(&from[i]);
+    return 1;
+}
+
+void dmmap_stats_totals(DmmapFileStats* stats)
+{
+    uint64_t* to = (uint64_t*)stats;
+    for (size_t i = 0; i < sizeof(*stats) / sizeof(uint64_t); ++i)
+        to[i] = DMMAP__ATOMIC_LOAD((uint64_t*)&dmmap__stats_total + i);
+}
+
+void dmmap_stats_fault_begin(DmmapFaultScope* scope)
+{
+    dmmap__fault_counts(&scope->minor, &scope->major);
+}
+
+void dmmap_stats_fault_end(DmmapFile* file, const DmmapFaultScope* scope)
+{
+    uint64_t minor, major;
+    dmmap__fault_counts(&minor, &major);
+    if (minor > scope->minor)
+        dmmap__stats_add(file->state, offsetof(DmmapFileStats, minor_faults), minor - scope->minor);
+    if (major > scope->major)
+        dmmap__stats_add(file->state, offsetof(DmmapFileStats, major_faults), major - scope->major);
+}
+
+int dmmap_file_flush(DmmapFile* file)
+{
+    if (!file->data)
+        return 0;
+    if (file->backend != DMMAP_BACKEND_MMAP)
+        return 1;
+
+    uint64_t start = dmmap__now_ns();
+#ifdef _WIN32
+    int ok = FlushViewOfFile(file->data, file->size) != 0;
+#else
+    // Windows of `dmmap_file_open_range` start inside their first page
+    size_t delta = (uintptr_t)file->data % dmmap__page_size();
+    int ok = msync((char*)file->data - delta, file->size + delta, MS_SYNC) == 0;
+#endif
+
+    if (dmmap__stats_enabled())
+    {
+        uint64_t elapsed = dmmap__now_ns() - start;
+        uint64_t us = elapsed / 1000;
+        unsigned bucket = us ? dmmap__log2_64(us) : 0;
+        if (bucket >= DMMAP_STATS_BUCKETS)
+            bucket = DMMAP_STATS_BUCKETS - 1;
+        dmmap__stats_add(file->state, offsetof(DmmapFileStats, flushes), 1);
+        dmmap__stats_add(file->state, offsetof(DmmapFileStats, flush_ns), elapsed);
+        dmmap__stats_add(file->state, offsetof(DmmapFileStats, flush_histogram) + bucket * sizeof(uint64_t), 1);
+    }
+    return ok;
+}
+
 #endif
 
 #endif // DMMAP__H__